@@ -0,0 +1,144 @@
+/*
+    Copyright (C) 2025  Flyinghead
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#define LOG_SUBSYSTEM Log::Lobby
+#include "accounting.h"
+#include "metrics.h"
+#include <algorithm>
+#include <functional>
+#include <cinttypes>
+#include <ctime>
+
+namespace Accounting
+{
+
+static const char *ResourceNames[] {
+	"packets_in",
+	"bytes_in",
+	"bytes_out",
+	"cpu_us",
+};
+
+const char *getResourceName(Resource resource) {
+	return ResourceNames[resource];
+}
+
+uint64_t threadCpuTime()
+{
+	timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+}
+
+HeavyHitters::HeavyHitters()
+	: cells(Depth * Width * ResourceCount)
+{
+}
+
+void HeavyHitters::add(std::string_view key, Resource resource, uint64_t n)
+{
+	// Row hashes derived from a single hash
+	uint64_t hash = std::hash<std::string_view>()(key);
+	uint32_t h1 = hash;
+	uint32_t h2 = (hash >> 32) | 1;
+	uint64_t estimate = UINT64_MAX;
+	for (unsigned row = 0; row < Depth; row++)
+	{
+		uint64_t& cell = cells[((row * Width) + (h1 + row * h2) % Width) * ResourceCount + resource];
+		cell += n;
+		estimate = std::min(estimate, cell);
+	}
+	std::vector<Entry>& entries = top[resource];
+	auto it = std::find_if(entries.begin(), entries.end(), [key](const Entry& entry) {
+		return entry.key == key;
+	});
+	if (it != entries.end()) {
+		it->estimate = estimate;
+	}
+	else if (entries.size() < TopCount) {
+		entries.push_back({ std::string(key), estimate });
+	}
+	else
+	{
+		auto min = std::min_element(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) {
+			return a.estimate < b.estimate;
+		});
+		if (estimate > min->estimate)
+			*min = { std::string(key), estimate };
+	}
+}
+
+std::vector<HeavyHitters::Entry> HeavyHitters::getTop(Resource resource) const
+{
+	std::vector<Entry> entries = top[resource];
+	std::sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) {
+		return a.estimate > b.estimate;
+	});
+	return entries;
+}
+
+void HeavyHitters::clear()
+{
+	std::fill(cells.begin(), cells.end(), 0);
+	for (auto& entries : top)
+		entries.clear();
+}
+
+static void logTop(GameId gameId, const char *what, Resource resource, const std::vector<HeavyHitters::Entry>& entries)
+{
+	if (entries.empty())
+		return;
+	std::string s;
+	for (size_t i = 0; i < entries.size() && i < 3; i++)
+		s += (i == 0 ? "" : ", ") + entries[i].key + ' ' + std::to_string(entries[i].estimate);
+	INFO_LOG(gameId, "Top %s by %s: %s", what, ResourceNames[resource], s.c_str());
+}
+
+void GameUsage::endPeriod()
+{
+	for (int r = 0; r < ResourceCount; r++)
+	{
+		lastPlayers[r] = players.getTop((Resource)r);
+		lastIps[r] = ips.getTop((Resource)r);
+		logTop(gameId, "players", (Resource)r, lastPlayers[r]);
+		logTop(gameId, "IPs", (Resource)r, lastIps[r]);
+	}
+	players.clear();
+	ips.clear();
+}
+
+void GameUsage::registerMetrics()
+{
+	std::string label = Metrics::gameLabel(gameId);
+	auto collect = [](const std::array<std::vector<HeavyHitters::Entry>, ResourceCount>& last, const char *keyName,
+			std::vector<Metrics::Sample>& samples)
+	{
+		for (int r = 0; r < ResourceCount; r++)
+			for (const HeavyHitters::Entry& entry : last[r])
+				samples.push_back({ std::string(keyName) + "=\"" + Metrics::labelValue(entry.key)
+						+ "\",resource=\"" + ResourceNames[r] + '"', (double)entry.estimate });
+	};
+	Metrics::gauges("iwango_top_players", "Heaviest players of the last accounting period (estimated)", label,
+			[this, collect](std::vector<Metrics::Sample>& samples) {
+		collect(lastPlayers, "player", samples);
+	});
+	Metrics::gauges("iwango_top_ips", "Heaviest IP addresses of the last accounting period (estimated)", label,
+			[this, collect](std::vector<Metrics::Sample>& samples) {
+		collect(lastIps, "ip", samples);
+	});
+}
+
+}
@@ -0,0 +1,95 @@
+/*
+    Copyright (C) 2025  Flyinghead
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#pragma once
+#include "common.h"
+#include <array>
+#include <vector>
+#include <string>
+#include <string_view>
+
+//
+// Resources used by players and the heaviest players and IP addresses of each game.
+// Only used on the event loop thread.
+//
+namespace Accounting
+{
+enum Resource {
+	PacketsIn,
+	BytesIn,
+	BytesOut,	// sent to all the players because of the player's packets
+	CpuTime,	// handler CPU time in microseconds
+	ResourceCount
+};
+
+using Usage = std::array<uint64_t, ResourceCount>;
+
+const char *getResourceName(Resource resource);
+
+// CPU time used by the current thread in microseconds
+uint64_t threadCpuTime();
+
+// Count-min sketch of each resource by key, with the heaviest keys
+class HeavyHitters
+{
+public:
+	static constexpr unsigned Depth = 4;
+	static constexpr unsigned Width = 1024;
+	static constexpr unsigned TopCount = 10;
+
+	struct Entry
+	{
+		std::string key;
+		uint64_t estimate;
+	};
+
+	HeavyHitters();
+	void add(std::string_view key, Resource resource, uint64_t n);
+	// Heaviest keys first
+	std::vector<Entry> getTop(Resource resource) const;
+	void clear();
+
+private:
+	std::vector<uint64_t> cells;
+	std::array<std::vector<Entry>, ResourceCount> top;
+};
+
+// Usage of a game
+class GameUsage
+{
+public:
+	GameUsage(GameId gameId)
+		: gameId(gameId) {}
+
+	void add(std::string_view player, std::string_view ip, Resource resource, uint64_t n)
+	{
+		if (!player.empty())
+			players.add(player, resource, n);
+		ips.add(ip, resource, n);
+	}
+	// Log the heaviest players and IPs and start a new period
+	void endPeriod();
+	// Export the heaviest players and IPs of the last period
+	void registerMetrics();
+
+private:
+	GameId gameId;
+	HeavyHitters players;
+	HeavyHitters ips;
+	std::array<std::vector<HeavyHitters::Entry>, ResourceCount> lastPlayers;
+	std::array<std::vector<HeavyHitters::Entry>, ResourceCount> lastIps;
+};
+}
@@ -0,0 +1,178 @@
+/*
+    Copyright (C) 2025  Flyinghead
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include "alloc_profile.h"
+#ifdef ALLOC_PROFILE
+#include <atomic>
+#include <new>
+#include <cstdlib>
+#include <algorithm>
+#include <cinttypes>
+
+namespace AllocProfile
+{
+
+namespace
+{
+
+struct Counters
+{
+	std::atomic<uint64_t> calls;
+	std::atomic<uint64_t> allocs;
+	std::atomic<uint64_t> bytes;
+	std::atomic<uint64_t> frees;
+};
+
+// Threads past the limit share the last counters
+constexpr unsigned MaxThreads = 64;
+Counters counters[MaxThreads][TagCount];
+std::atomic<unsigned> threadCount;
+
+// No dynamic initialization: nothing must be allocated here
+thread_local int threadIndex = -1;
+thread_local unsigned currentTag = Other;
+
+Counters& getCounters(unsigned tag)
+{
+	if (threadIndex == -1)
+		threadIndex = std::min(threadCount.fetch_add(1), MaxThreads - 1);
+	return counters[threadIndex][tag];
+}
+
+void *allocate(size_t size)
+{
+	Counters& c = getCounters(currentTag);
+	c.allocs.fetch_add(1, std::memory_order_relaxed);
+	c.bytes.fetch_add(size, std::memory_order_relaxed);
+	return malloc(size == 0 ? 1 : size);
+}
+
+void *allocate(size_t size, std::align_val_t alignment)
+{
+	Counters& c = getCounters(currentTag);
+	c.allocs.fetch_add(1, std::memory_order_relaxed);
+	c.bytes.fetch_add(size, std::memory_order_relaxed);
+	size_t align = (size_t)alignment;
+	return aligned_alloc(align, (size + align - 1) / align * align);
+}
+
+void release(void *p)
+{
+	if (p == nullptr)
+		return;
+	getCounters(currentTag).frees.fetch_add(1, std::memory_order_relaxed);
+	free(p);
+}
+
+}
+
+Scope::Scope(unsigned tag)
+	: previous(currentTag)
+{
+	currentTag = tag < TagCount ? tag : Other;
+	getCounters(currentTag).calls.fetch_add(1, std::memory_order_relaxed);
+}
+
+Scope::~Scope() {
+	currentTag = previous;
+}
+
+void report(FILE *f)
+{
+	fprintf(f, "tag\tcalls\tallocs\tbytes\tfrees\tallocs/call\tbytes/call\n");
+	unsigned threads = std::min(threadCount.load(), MaxThreads);
+	for (unsigned tag = 0; tag < TagCount; tag++)
+	{
+		uint64_t calls = 0, allocs = 0, bytes = 0, frees = 0;
+		for (unsigned t = 0; t < threads; t++)
+		{
+			calls += counters[t][tag].calls.load(std::memory_order_relaxed);
+			allocs += counters[t][tag].allocs.load(std::memory_order_relaxed);
+			bytes += counters[t][tag].bytes.load(std::memory_order_relaxed);
+			frees += counters[t][tag].frees.load(std::memory_order_relaxed);
+		}
+		if (calls == 0 && allocs == 0)
+			continue;
+		char name[16];
+		if (tag == Other)
+			snprintf(name, sizeof(name), "other");
+		else if (tag == Database)
+			snprintf(name, sizeof(name), "database");
+		else
+			snprintf(name, sizeof(name), "0x%02x", tag);
+		fprintf(f, "%s\t%" PRIu64 "\t%" PRIu64 "\t%" PRIu64 "\t%" PRIu64 "\t%.2f\t%.1f\n", name, calls, allocs, bytes, frees,
+				calls == 0 ? 0.0 : (double)allocs / calls, calls == 0 ? 0.0 : (double)bytes / calls);
+	}
+	fflush(f);
+}
+
+}
+
+using namespace AllocProfile;
+
+void *operator new(size_t size)
+{
+	void *p = allocate(size);
+	if (p == nullptr)
+		throw std::bad_alloc();
+	return p;
+}
+void *operator new[](size_t size) {
+	return operator new(size);
+}
+void *operator new(size_t size, const std::nothrow_t&) noexcept {
+	return allocate(size);
+}
+void *operator new[](size_t size, const std::nothrow_t&) noexcept {
+	return allocate(size);
+}
+void *operator new(size_t size, std::align_val_t alignment)
+{
+	void *p = allocate(size, alignment);
+	if (p == nullptr)
+		throw std::bad_alloc();
+	return p;
+}
+void *operator new[](size_t size, std::align_val_t alignment) {
+	return operator new(size, alignment);
+}
+
+void operator delete(void *p) noexcept {
+	release(p);
+}
+void operator delete[](void *p) noexcept {
+	release(p);
+}
+void operator delete(void *p, size_t) noexcept {
+	release(p);
+}
+void operator delete[](void *p, size_t) noexcept {
+	release(p);
+}
+void operator delete(void *p, std::align_val_t) noexcept {
+	release(p);
+}
+void operator delete[](void *p, std::align_val_t) noexcept {
+	release(p);
+}
+void operator delete(void *p, size_t, std::align_val_t) noexcept {
+	release(p);
+}
+void operator delete[](void *p, size_t, std::align_val_t) noexcept {
+	release(p);
+}
+
+#endif
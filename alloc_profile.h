@@ -0,0 +1,63 @@
+/*
+    Copyright (C) 2025  Flyinghead
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#pragma once
+#include <stdio.h>
+
+//
+// Heap allocations counted by the opcode being handled or the background task running.
+// Only built with ALLOC_PROFILE defined (make ALLOC_PROFILE=1), which replaces the global operator new and delete.
+//
+namespace AllocProfile
+{
+// Tags 0 to 0xff are lobby opcodes
+enum Tag : unsigned {
+	Other = 0x100,		// untagged code, mostly the event loop
+	Database = 0x101,	// database tasks
+	TagCount
+};
+
+#ifdef ALLOC_PROFILE
+// Tag the allocations of the current thread while in scope
+class Scope
+{
+public:
+	Scope(unsigned tag);
+	~Scope();
+
+	Scope(const Scope&) = delete;
+	Scope& operator=(const Scope&) = delete;
+
+private:
+	unsigned previous;
+};
+
+constexpr bool Enabled = true;
+// Tab-separated report: tag, calls, allocations, bytes, frees, allocations per call, bytes per call
+void report(FILE *f);
+
+#else
+class Scope
+{
+public:
+	Scope(unsigned) {}
+	~Scope() {}
+};
+
+constexpr bool Enabled = false;
+inline void report(FILE *) {}
+#endif
+}
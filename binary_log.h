@@ -0,0 +1,44 @@
+/*
+    Copyright (C) 2025  Flyinghead
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#pragma once
+#include <cstdint>
+
+//
+// Binary log file format. Integers are little-endian.
+// The file starts with the magic string followed by records:
+//   uint8 type, uint16 body length, body
+// Start (written each time the server opens the file):
+//   int64 realtime in ns, uint64 monotonic time in ns
+//   Log sites ids are only valid until the next start record.
+// Site (written before the first event of a log statement):
+//   uint32 id, uint8 level, uint8 subsystem, uint32 line,
+//   uint16 length + file name, uint16 length + format string
+// Event:
+//   uint32 site id, uint64 monotonic time in ns, int8 game id, arguments
+//   Each argument is a Log::Args::Tag followed by an int64, uint64, double,
+//   or uint16 length + string bytes
+//
+namespace BinaryLog
+{
+constexpr char Magic[8] = { 'I', 'W', 'L', 'O', 'G', '0', '0', '1' };
+
+enum RecordType : uint8_t {
+	Start = 1,
+	Site = 2,
+	Event = 3,
+};
+}
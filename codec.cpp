@@ -0,0 +1,170 @@
+/*
+    Copyright (C) 2025  Flyinghead
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include "codec.h"
+#include <cstring>
+
+//
+// Each token starts with a tag byte: 2 bits of type and 6 bits of length.
+// A length of 63 is followed by more length bytes, 7 bits each, low bits first.
+//   Literal: length + 1 bytes follow
+//   Zeros:   length + MinRun zero bytes
+//   Match:   length + MinRun bytes copied from a 16-bit little-endian distance back
+//
+namespace
+{
+
+enum Token : uint8_t {
+	Literal = 0,
+	Zeros = 1,
+	Match = 2,
+};
+constexpr size_t MinRun = 4;
+constexpr size_t MaxDistance = 0xffff;
+constexpr int HashBits = 12;
+
+void putToken(std::vector<uint8_t>& out, Token type, size_t length)
+{
+	if (length < 63) {
+		out.push_back((type << 6) | length);
+		return;
+	}
+	out.push_back((type << 6) | 63);
+	length -= 63;
+	while (length >= 0x80) {
+		out.push_back((length & 0x7f) | 0x80);
+		length >>= 7;
+	}
+	out.push_back(length);
+}
+
+void putLiterals(std::vector<uint8_t>& out, const uint8_t *data, size_t size)
+{
+	if (size == 0)
+		return;
+	putToken(out, Literal, size - 1);
+	out.insert(out.end(), data, data + size);
+}
+
+inline uint32_t hash(const uint8_t *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return (v * 2654435761u) >> (32 - HashBits);
+}
+
+}
+
+std::vector<uint8_t> packBlock(const uint8_t *data, size_t size)
+{
+	std::vector<uint8_t> out;
+	out.reserve(size / 4 + 16);
+	std::vector<uint32_t> lastPos(1 << HashBits, UINT32_MAX);
+	size_t literalStart = 0;
+	size_t pos = 0;
+	while (pos + MinRun <= size)
+	{
+		size_t run = 0;
+		while (pos + run < size && data[pos + run] == 0)
+			run++;
+		if (run >= MinRun)
+		{
+			putLiterals(out, data + literalStart, pos - literalStart);
+			putToken(out, Zeros, run - MinRun);
+			pos += run;
+			literalStart = pos;
+			continue;
+		}
+		uint32_t h = hash(data + pos);
+		size_t candidate = lastPos[h];
+		lastPos[h] = pos;
+		if (candidate != UINT32_MAX && pos - candidate <= MaxDistance
+				&& memcmp(data + candidate, data + pos, MinRun) == 0)
+		{
+			size_t length = MinRun;
+			while (pos + length < size && data[candidate + length] == data[pos + length])
+				length++;
+			putLiterals(out, data + literalStart, pos - literalStart);
+			putToken(out, Match, length - MinRun);
+			size_t distance = pos - candidate;
+			out.push_back(distance & 0xff);
+			out.push_back(distance >> 8);
+			pos += length;
+			literalStart = pos;
+			continue;
+		}
+		pos++;
+	}
+	putLiterals(out, data + literalStart, size - literalStart);
+	return out;
+}
+
+bool unpackBlock(const uint8_t *data, size_t size, std::vector<uint8_t>& out, size_t maxSize)
+{
+	out.clear();
+	const uint8_t *end = data + size;
+	while (data < end)
+	{
+		Token type = (Token)(*data >> 6);
+		size_t length = *data++ & 63;
+		if (length == 63)
+		{
+			for (int shift = 0; ; shift += 7)
+			{
+				if (data == end || shift > 28)
+					return false;
+				length += (size_t)(*data & 0x7f) << shift;
+				if ((*data++ & 0x80) == 0)
+					break;
+			}
+		}
+		switch (type)
+		{
+		case Literal:
+			length++;
+			if ((size_t)(end - data) < length || out.size() + length > maxSize)
+				return false;
+			out.insert(out.end(), data, data + length);
+			data += length;
+			break;
+		case Zeros:
+			length += MinRun;
+			if (out.size() + length > maxSize)
+				return false;
+			out.resize(out.size() + length);
+			break;
+		case Match:
+		{
+			length += MinRun;
+			if (end - data < 2)
+				return false;
+			size_t distance = data[0] | (data[1] << 8);
+			data += 2;
+			if (distance == 0 || distance > out.size() || out.size() + length > maxSize)
+				return false;
+			// Copied byte by byte since the source can overlap the destination
+			size_t from = out.size() - distance;
+			out.reserve(out.size() + length);
+			for (size_t i = 0; i < length; i++)
+				out.push_back(out[from + i]);
+			break;
+		}
+		default:
+			return false;
+		}
+	}
+	return true;
+}
@@ -0,0 +1,28 @@
+/*
+    Copyright (C) 2025  Flyinghead
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+//
+// Fast block compression for small, mostly zero buffers like the extra user memory.
+// Runs of zeros are run-length encoded and other repeated sequences are replaced by LZ matches.
+//
+std::vector<uint8_t> packBlock(const uint8_t *data, size_t size);
+// Returns false if the packed data is invalid or unpacks to more than maxSize bytes
+bool unpackBlock(const uint8_t *data, size_t size, std::vector<uint8_t>& out, size_t maxSize);
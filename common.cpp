@@ -16,49 +16,19 @@
 */
 #include "common.h"
 #include <string>
-#include <cstdarg>
+#include <memory_resource>
 
-const char *LevelNames[] = {
-	"ERROR",
-	"WARNING",
-	"NOTICE",
-	"INFO",
-	"DEBUG",
-};
-const char *Games[] = {
-	"",
-	"daytona",
-	"daytonajp",
-	"tetris",
-	"golf",
-	"aeroI",
-	"100swords",
-	"culdcept",
-	"aeroF",
-	"psmash",
-	"yakyuu",
-	"runejade",
-};
-
-void logger(Log::LEVEL level, GameId gameId, const char* file, int line, const char *format, ...)
+namespace tmp
 {
-	va_list args;
-	va_start(args, format);
-	char *temp;
-	if (vasprintf(&temp, format, args) < 0)
-		throw std::bad_alloc();
-	va_end(args);
+// Big enough for the temporaries of any packet handler. The arena grows from the heap if needed.
+static thread_local uint8_t arenaBuffer[64 * 1024];
+static thread_local std::pmr::monotonic_buffer_resource arenaResource(arenaBuffer, sizeof(arenaBuffer));
 
-	time_t now = time(nullptr);
-	struct tm tm = *localtime(&now);
+std::pmr::memory_resource *arena() {
+	return &arenaResource;
+}
 
-	char *msg;
-	const int len = asprintf(&msg, "[%02d/%02d %02d:%02d:%02d] %s:%u %c[%s] %s\n",
-			tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec,
-			file, line, LevelNames[(int)level][0], Games[(int)gameId + 1], temp);
-	free(temp);
-	if (len < 0)
-		throw std::bad_alloc();
-	fputs(msg, stderr);
-	free(msg);
+void releaseArena() {
+	arenaResource.release();
+}
 }
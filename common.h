@@ -1,8 +1,16 @@
 #pragma once
 #include <vector>
+#include <atomic>
+#include <algorithm>
+#include <type_traits>
 #include <string>
 #include <sstream>
 #include <iostream>
+#include <string_view>
+#include <memory_resource>
+#include <charconv>
+#include <functional>
+#include <cstring>
 #include <unicode/unistr.h>
 
 std::string getConfig(const std::string& name, const std::string& default_value);
@@ -23,7 +31,7 @@ enum class GameId
 	RuneJade,
 };
 
-inline static GameId identifyGame(const std::string& gameId)
+inline static GameId identifyGame(std::string_view gameId)
 {
 	if (gameId == "S00001S0001010440110")
 		return GameId::DaytonaJP;
@@ -64,9 +72,58 @@ inline static std::vector<std::string> splitString(const std::string& s, char c)
 	return strings;
 }
 
-inline static std::string utf8ToSjis(const std::string& value, bool fullWidth)
+//
+// Per-thread scratch arena for temporaries that don't outlive the current packet handler.
+// Allocation is a pointer bump. Everything is released at once by releaseArena()
+// after each dispatched packet.
+//
+namespace tmp
 {
-    icu::UnicodeString src(value.c_str(), "utf8");
+using string = std::pmr::string;
+template<typename T>
+using vector = std::pmr::vector<T>;
+
+std::pmr::memory_resource *arena();
+void releaseArena();
+
+// Same as splitString() but the returned views point into s
+inline static vector<std::string_view> split(std::string_view s, char c)
+{
+	vector<std::string_view> strings(arena());
+	size_t start = 0;
+	for (;;)
+	{
+		size_t pos = s.find(c, start);
+		if (pos == std::string_view::npos)
+			break;
+		strings.push_back(s.substr(start, pos - start));
+		start = pos + 1;
+	}
+	strings.push_back(s.substr(start));
+	return strings;
+}
+}
+
+// atoi() equivalent for string views
+inline static int parseInt(std::string_view s)
+{
+	while (!s.empty() && (s[0] == ' ' || s[0] == '\t'))
+		s.remove_prefix(1);
+	if (!s.empty() && s[0] == '+')
+		s.remove_prefix(1);
+	int v = 0;
+	std::from_chars(s.data(), s.data() + s.size(), v);
+	return v;
+}
+
+// Like std::string::c_str(), conversions stop at the first nul char
+inline static int32_t cstrLength(std::string_view s) {
+	return strnlen(s.data(), s.size());
+}
+
+inline static std::string utf8ToSjis(std::string_view value, bool fullWidth)
+{
+    icu::UnicodeString src(value.data(), cstrLength(value), "utf8");
     int32_t srclen = src.length();
     if (fullWidth)
     {
@@ -77,15 +134,15 @@ inline static std::string utf8ToSjis(const std::string& value, bool fullWidth)
     }
     int length = src.extract(0, srclen, nullptr, "shift_jis");
 
-    std::vector<char> result(length + 1);
-    src.extract(0, srclen, &result[0], "shift_jis");
+    std::string result(length, '\0');
+    src.extract(0, srclen, &result[0], length, "shift_jis");
 
-    return std::string(result.begin(), result.end() - 1);
+    return result;
 }
 
-inline static std::string sjisToUtf8(const std::string& value)
+inline static std::string sjisToUtf8(std::string_view value)
 {
-    icu::UnicodeString src(value.c_str(), "shift_jis");
+    icu::UnicodeString src(value.data(), cstrLength(value), "shift_jis");
 	// convert full-width to ascii
     int32_t srclen = src.length();
     for (int i = 0; i < srclen; i++)
@@ -93,10 +150,10 @@ inline static std::string sjisToUtf8(const std::string& value)
     		src.setCharAt(i, (char16_t)(src[i] - 0xFF00 + 0x20));
     int length = src.extract(0, srclen, nullptr, "utf8");
 
-    std::vector<char> result(length + 1);
-    src.extract(0, srclen, &result[0], "utf8");
+    std::string result(length, '\0');
+    src.extract(0, srclen, &result[0], length, "utf8");
 
-    return std::string(result.begin(), result.end() - 1);
+    return result;
 }
 
 namespace Log {
@@ -108,35 +165,176 @@ enum LEVEL
 	INFO = 3,
 	DEBUG = 4,
 };
+
+enum Subsystem
+{
+	General,
+	Gate,
+	Lobby,
+	Database,
+	Chat,
+	SubsystemCount
+};
+
+constexpr int GameCount = (int)GameId::RuneJade + 2;
+// Highest enabled level by game and subsystem
+extern std::atomic<uint8_t> Levels[GameCount][SubsystemCount];
+
+inline static bool isEnabled(LEVEL level, GameId gameId, Subsystem subsystem) {
+	return level <= Levels[(int)gameId + 1][subsystem].load(std::memory_order_relaxed);
+}
+
+// Set the log levels from the LogLevel[.<game>][.<subsystem>] config entries
+void configure(const std::function<std::string(const std::string& name, const std::string& defaultValue)>& getValue);
+
+// Write log messages from a background thread. Messages are dropped when the queue is full unless blockWhenFull is true.
+// If binaryLogPath is set, messages other than errors are only written to this file in binary format.
+void start(size_t queueSize, bool blockWhenFull, const std::string& binaryLogPath = {});
+// Write all queued messages and stop the background thread
+void stop();
+// Number of messages dropped since the last report
+size_t getDropped();
+
+const char *getLevelName(LEVEL level);
+const char *getSubsystemName(Subsystem subsystem);
+const char *getGameName(GameId gameId);
+
+// A log statement
+struct Site
+{
+	const char *file;
+	int line;
+	LEVEL level;
+	Subsystem subsystem;
+	const char *format;
+	// Assigned on first use
+	std::atomic<uint32_t> id;
+};
+
+// Raw arguments of a binary log record.
+// Strings are recorded up to their terminating NUL: %.*s precision isn't applied, so only pass NUL-terminated strings.
+struct Args
+{
+	static constexpr size_t Capacity = 448;
+	enum Tag : uint8_t {
+		Signed = 'i',
+		Unsigned = 'u',
+		Double = 'd',
+		String = 's',
+	};
+
+	void add(const char *s)
+	{
+		if (s == nullptr)
+			s = "(null)";
+		if (size + 3 > Capacity)
+			return;
+		size_t len = std::min(strlen(s), Capacity - size - 3);
+		data[size++] = String;
+		data[size++] = len & 0xff;
+		data[size++] = len >> 8;
+		memcpy(&data[size], s, len);
+		size += len;
+	}
+	void add(const void *p) {
+		add(Unsigned, (uint64_t)(uintptr_t)p);
+	}
+	void add(double d) {
+		add(Double, d);
+	}
+	template<typename T>
+	std::enable_if_t<std::is_integral_v<T> || std::is_enum_v<T>> add(T v)
+	{
+		if (std::is_signed_v<T>)
+			add(Signed, (int64_t)v);
+		else
+			add(Unsigned, (uint64_t)v);
+	}
+
+	uint8_t data[Capacity];
+	size_t size = 0;
+
+private:
+	template<typename T>
+	void add(Tag tag, T v)
+	{
+		if (size + 1 + sizeof(T) > Capacity)
+			return;
+		data[size++] = tag;
+		memcpy(&data[size], &v, sizeof(T));
+		size += sizeof(T);
+	}
+};
+
+// Set when logging to a binary file
+extern std::atomic<bool> BinaryEnabled;
+void writeBinary(Site& site, GameId gameId, const Args& args);
 }
 
 void logger(Log::LEVEL level, GameId gameId, const char *file, int line, const char *format, ...);
 
-#define ERROR_LOG(gameId, ...)                      \
-	do {                                    \
-		logger(Log::ERROR, gameId, __FILE__, __LINE__, __VA_ARGS__);    \
-	} while (0)
+namespace Log {
+template<typename... T>
+void write(Site& site, GameId gameId, const char *format, T... args)
+{
+	if (BinaryEnabled.load(std::memory_order_relaxed))
+	{
+		Args raw;
+		(raw.add(args), ...);
+		writeBinary(site, gameId, raw);
+		if (site.level != ERROR)
+			return;
+	}
+	logger(site.level, gameId, site.file, site.line, format, args...);
+}
+}
 
-#define WARN_LOG(gameId, ...)                       \
-	do {                                    \
-		logger(Log::WARNING, gameId, __FILE__, __LINE__, __VA_ARGS__);    \
-	} while (0)
+// Subsystem of the log messages of a source file. Must be defined before including this file.
+#ifndef LOG_SUBSYSTEM
+#define LOG_SUBSYSTEM Log::General
+#endif
+// Messages above this level are compiled out
+#ifndef LOG_MAX_LEVEL
+#ifdef NDEBUG
+#define LOG_MAX_LEVEL 3
+#else
+#define LOG_MAX_LEVEL 4
+#endif
+#endif
 
-#define NOTICE_LOG(gameId, ...)                     \
-	do {                                    \
-		logger(Log::NOTICE, gameId, __FILE__, __LINE__, __VA_ARGS__);    \
+#define LOG_FORMAT_(format, ...) format
+// Arguments are only evaluated if the level is enabled
+#define SUBSYSTEM_LOG(level, subsystem, gameId, ...)                        \
+	do {                                                                    \
+		const GameId logGameId_ = (gameId);                                 \
+		if (level <= LOG_MAX_LEVEL && Log::isEnabled(level, logGameId_, subsystem)) {  \
+			static Log::Site logSite_ { __FILE__, __LINE__, level, subsystem, LOG_FORMAT_(__VA_ARGS__), {} };  \
+			Log::write(logSite_, logGameId_, __VA_ARGS__);                  \
+		}                                                                   \
 	} while (0)
 
-#define INFO_LOG(gameId, ...)                       \
-	do {                                    \
-		logger(Log::INFO, gameId, __FILE__, __LINE__, __VA_ARGS__);    \
-	} while (0)
+#define ERROR_LOG(gameId, ...) SUBSYSTEM_LOG(Log::ERROR, LOG_SUBSYSTEM, gameId, __VA_ARGS__)
 
-#ifndef NDEBUG
-#define DEBUG_LOG(gameId, ...)                      \
-	do {                                    \
-		logger(Log::DEBUG, gameId, __FILE__, __LINE__, __VA_ARGS__);    \
-	} while (0)
+#if LOG_MAX_LEVEL >= 1
+#define WARN_LOG(gameId, ...) SUBSYSTEM_LOG(Log::WARNING, LOG_SUBSYSTEM, gameId, __VA_ARGS__)
+#else
+#define WARN_LOG(...) do {} while (0)
+#endif
+
+#if LOG_MAX_LEVEL >= 2
+#define NOTICE_LOG(gameId, ...) SUBSYSTEM_LOG(Log::NOTICE, LOG_SUBSYSTEM, gameId, __VA_ARGS__)
+#else
+#define NOTICE_LOG(...) do {} while (0)
+#endif
+
+#if LOG_MAX_LEVEL >= 3
+#define INFO_LOG(gameId, ...) SUBSYSTEM_LOG(Log::INFO, LOG_SUBSYSTEM, gameId, __VA_ARGS__)
+#else
+#define INFO_LOG(...) do {} while (0)
+#endif
+
+#if LOG_MAX_LEVEL >= 4
+#define DEBUG_LOG(gameId, ...) SUBSYSTEM_LOG(Log::DEBUG, LOG_SUBSYSTEM, gameId, __VA_ARGS__)
 #else
-#define DEBUG_LOG(...)
+#define DEBUG_LOG(...) do {} while (0)
 #endif
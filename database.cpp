@@ -14,35 +14,251 @@
     You should have received a copy of the GNU General Public License
     along with this program.  If not, see <https://www.gnu.org/licenses/>.
 */
+#define LOG_SUBSYSTEM Log::Database
 #include "database.h"
 #include "common.h"
+#include "storage.h"
+#include "metrics.h"
+#include "trace.h"
+#include "probes.h"
+#include "alloc_profile.h"
 #include <cstdio>
+#include <cstring>
 #include <stdexcept>
 #include <algorithm>
+#include <memory>
+#include <unordered_map>
+#include <map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <atomic>
+#include <chrono>
+#include <list>
+#include <set>
+#include <filesystem>
+#include <ctime>
 
-static std::string databasePath = "iwango.db";
+static std::unique_ptr<Storage> storage;
 
-void setDatabasePath(const std::string& databasePath)
+static Storage& getStorage()
+{
+	if (storage == nullptr)
+		storage = createSqliteStorage("iwango.db");
+	return *storage;
+}
+
+namespace
+{
+
+static std::string cacheKey(GameId gameId, const std::string& name) {
+	return std::to_string((int)gameId) + ':' + name;
+}
+
+//
+// In-memory copy of USER_HANDLE, kept in sync by the handle functions below
+//
+class HandleCache
 {
-	if (!databasePath.empty()) {
-		::databasePath = databasePath;
-		Database db(databasePath);
+public:
+	void load()
+	{
+		std::lock_guard<std::mutex> _(mutex);
+		userHandles.clear();
+		owners.clear();
+		getStorage().forEachHandle([this](GameId gameId, const std::string& user, int index, const std::string& handle) {
+			userHandles[key(gameId, user)][index] = handle;
+			owners[key(gameId, handle)] = { user, index };
+		});
+		loaded = true;
+	}
+
+	// Returns false if the cache isn't loaded
+	bool getHandles(GameId gameId, const std::string& user, std::vector<std::string>& handles)
+	{
+		std::lock_guard<std::mutex> _(mutex);
+		if (!loaded)
+			return false;
+		handles.clear();
+		auto it = userHandles.find(key(gameId, user));
+		if (it != userHandles.end())
+			for (const auto& [index, handle] : it->second)
+				handles.push_back(handle);
+		return true;
+	}
+
+	// Is the handle used by another user or in another slot?
+	bool isInUse(GameId gameId, const std::string& handle, const std::string& user, int index)
+	{
+		std::lock_guard<std::mutex> _(mutex);
+		auto it = owners.find(key(gameId, handle));
+		return it != owners.end() && (it->second.user != user || it->second.index != index);
+	}
+
+	void set(GameId gameId, const std::string& user, int index, const std::string& handle)
+	{
+		std::lock_guard<std::mutex> _(mutex);
+		if (!loaded)
+			return;
+		std::string& slot = userHandles[key(gameId, user)][index];
+		if (!slot.empty())
+			owners.erase(key(gameId, slot));
+		slot = handle;
+		owners[key(gameId, handle)] = { user, index };
+	}
+
+	// Following handles move down one slot
+	void remove(GameId gameId, const std::string& user, int index)
+	{
+		std::lock_guard<std::mutex> _(mutex);
+		if (!loaded)
+			return;
+		auto uit = userHandles.find(key(gameId, user));
+		if (uit == userHandles.end())
+			return;
+		std::map<int, std::string>& handles = uit->second;
+		auto it = handles.find(index);
+		if (it != handles.end()) {
+			owners.erase(key(gameId, it->second));
+			handles.erase(it);
+		}
+		std::map<int, std::string> renumbered;
+		for (auto& [i, handle] : handles)
+		{
+			int newIndex = i > index ? i - 1 : i;
+			owners[key(gameId, handle)].index = newIndex;
+			renumbered[newIndex] = std::move(handle);
+		}
+		if (renumbered.empty())
+			userHandles.erase(uit);
+		else
+			handles = std::move(renumbered);
 	}
+
+private:
+	static std::string key(GameId gameId, const std::string& name) {
+		return cacheKey(gameId, name);
+	}
+
+	struct Owner
+	{
+		std::string user;
+		int index;
+	};
+	std::mutex mutex;
+	bool loaded = false;
+	std::unordered_map<std::string, std::map<int, std::string>> userHandles;
+	std::unordered_map<std::string, Owner> owners;
+};
+static HandleCache handleCache;
+
+}
+
+namespace
+{
+
+//
+// Routes each game to its own storage
+//
+class ShardedStorage : public Storage
+{
+public:
+	using Factory = std::unique_ptr<Storage> (*)(const std::string& path);
+
+	ShardedStorage(Factory factory, const std::string& path, int shardCount)
+		: shardCount(shardCount)
+	{
+		for (int shard : getShards(shardCount))
+			shards[shard] = factory(getShardPath(path, shard));
+	}
+
+	void forEachHandle(const HandleVisitor& visitor) override {
+		for (auto& [i, storage] : shards)
+			storage->forEachHandle(visitor);
+	}
+	std::vector<std::string> getHandles(GameId gameId, const std::string& user) override {
+		return shard(gameId).getHandles(gameId, user);
+	}
+	void createHandle(GameId gameId, const std::string& user, int index, const std::string& handle) override {
+		shard(gameId).createHandle(gameId, user, index, handle);
+	}
+	bool replaceHandle(GameId gameId, const std::string& user, int index, const std::string& handle) override {
+		return shard(gameId).replaceHandle(gameId, user, index, handle);
+	}
+	void deleteHandle(GameId gameId, const std::string& user, int index) override {
+		shard(gameId).deleteHandle(gameId, user, index);
+	}
+	std::vector<uint8_t> getExtraUserMem(GameId gameId, const std::string& user) override {
+		return shard(gameId).getExtraUserMem(gameId, user);
+	}
+	void updateExtraUserMem(GameId gameId, const std::string& user, const uint8_t *data, int offset, int size) override {
+		shard(gameId).updateExtraUserMem(gameId, user, data, offset, size);
+	}
+	void backup(const std::string& path) override {
+		for (auto& [i, storage] : shards)
+			storage->backup(getShardPath(path, i));
+	}
+
+private:
+	Storage& shard(GameId gameId)
+	{
+		auto it = shards.find(getShard(gameId, shardCount));
+		if (it == shards.end())
+			throw std::runtime_error("No database shard for game " + std::to_string((int)gameId));
+		return *it->second;
+	}
+
+	int shardCount;
+	std::map<int, std::unique_ptr<Storage>> shards;
+};
+
+}
+
+void setDatabasePath(const std::string& databasePath)
+{
+	if (databasePath.empty())
+		return;
+	std::string engine = getConfig("DatabaseEngine", "sqlite");
+	ShardedStorage::Factory factory;
+	if (engine == "memory")
+		factory = createMemoryStorage;
+	else if (engine == "sqlite")
+		factory = createSqliteStorage;
+	else
+		throw std::runtime_error("Unknown database engine: " + engine);
+	int shards = parseShards(getConfig("DatabaseShards", "0"));
+	if (shards == 0 || shards == 1)
+		storage = factory(databasePath);
+	else
+		storage = std::make_unique<ShardedStorage>(factory, databasePath, shards);
 }
 
 //
 // Gate server
 //
+void loadHandleCache()
+{
+	Trace::Span span("db", "loadHandleCache");
+	handleCache.load();
+}
+
+bool getCachedHandles(GameId gameId, const std::string& user, std::vector<std::string>& handles) {
+	return handleCache.getHandles(gameId, user, handles);
+}
+
+bool isHandleInUse(GameId gameId, const std::string& handle, const std::string& user, int index) {
+	return handleCache.isInUse(gameId, handle, user, index);
+}
+
 bool createHandle(GameId gameId, const std::string& user, int index, const std::string& handle)
 {
+	Trace::Span span("db", "createHandle", gameId, -1, &user);
+	if (handleCache.isInUse(gameId, handle, user, -1))
+		throw UniqueConstraintViolation("Handle " + handle + " already exists");
 	try {
-		Database db(databasePath);
-		Statement stmt(db, "INSERT INTO USER_HANDLE (USER_NAME, GAME, HANDLE_INDEX, HANDLE) VALUES (?, ?, ?, ?)");
-		stmt.bind(1, user);
-		stmt.bind(2, (int)gameId);
-		stmt.bind(3, index);
-		stmt.bind(4, handle);
-		stmt.step();
+		getStorage().createHandle(gameId, user, index, handle);
+		handleCache.set(gameId, user, index, handle);
 
 		return true;
 	} catch (const UniqueConstraintViolation& e) {
@@ -55,14 +271,12 @@ bool createHandle(GameId gameId, const std::string& user, int index, const std::
 
 bool replaceHandle(GameId gameId, const std::string& user, int index, const std::string& handle)
 {
+	Trace::Span span("db", "replaceHandle", gameId, -1, &user);
+	if (handleCache.isInUse(gameId, handle, user, index))
+		throw UniqueConstraintViolation("Handle " + handle + " already exists");
 	try {
-		Database db(databasePath);
-		Statement stmt(db, "UPDATE USER_HANDLE SET HANDLE = ? WHERE USER_NAME = ? AND GAME = ? AND HANDLE_INDEX = ?");
-		stmt.bind(1, handle);
-		stmt.bind(2, user);
-		stmt.bind(3, (int)gameId);
-		stmt.bind(4, index);
-		stmt.step();
+		if (getStorage().replaceHandle(gameId, user, index, handle))
+			handleCache.set(gameId, user, index, handle);
 
 		return true;
 	} catch (const UniqueConstraintViolation& e) {
@@ -75,27 +289,10 @@ bool replaceHandle(GameId gameId, const std::string& user, int index, const std:
 
 bool deleteHandle(GameId gameId, const std::string& user, int index)
 {
+	Trace::Span span("db", "deleteHandle", gameId, -1, &user);
 	try {
-		Database db(databasePath);
-		db.exec("BEGIN TRANSACTION");
-		{
-			Statement stmt(db, "DELETE FROM USER_HANDLE WHERE USER_NAME = ? AND GAME = ? AND HANDLE_INDEX = ?");
-			stmt.bind(1, user);
-			stmt.bind(2, (int)gameId);
-			stmt.bind(3, index);
-			stmt.step();
-		}
-		for (int i = index + 1; i < 8; i++)
-		{
-			Statement stmt(db, "UPDATE USER_HANDLE SET HANDLE_INDEX = HANDLE_INDEX - 1 WHERE USER_NAME = ? AND GAME = ? AND HANDLE_INDEX = ?");
-			stmt.bind(1, user);
-			stmt.bind(2, (int)gameId);
-			stmt.bind(3, i);
-			stmt.step();
-			if (stmt.changedRows() == 0)
-				break;
-		}
-		db.exec("COMMIT");
+		getStorage().deleteHandle(gameId, user, index);
+		handleCache.remove(gameId, user, index);
 
 		return true;
 	} catch (const std::runtime_error& e) {
@@ -106,14 +303,11 @@ bool deleteHandle(GameId gameId, const std::string& user, int index)
 
 std::vector<std::string> getHandles(GameId gameId, const std::string& user, const std::string& defaultHandle)
 {
+	Trace::Span span("db", "getHandles", gameId, -1, &user);
 	std::vector<std::string> handles;
 	try {
-		Database db(databasePath);
-		Statement stmt(db, "SELECT HANDLE FROM USER_HANDLE WHERE USER_NAME = ? AND GAME = ? ORDER BY HANDLE_INDEX");
-		stmt.bind(1, user);
-		stmt.bind(2, (int)gameId);
-		while (stmt.step())
-			handles.push_back(stmt.getStringColumn(0));
+		if (!handleCache.getHandles(gameId, user, handles))
+			handles = getStorage().getHandles(gameId, user);
 		if (handles.empty() && !defaultHandle.empty()) {
 			try {
 				if (createHandle(gameId, user, 0, defaultHandle))
@@ -132,36 +326,13 @@ std::vector<std::string> getHandles(GameId gameId, const std::string& user, cons
 //
 void updateExtraUserMem(GameId gameId, const std::string& user, const uint8_t *data, int offset, int size)
 {
+	Trace::Span span("db", "updateExtraUserMem", gameId, -1, &user);
+	if (offset < 0 || size < 0 || offset + size > ExtraUserMemSize) {
+		ERROR_LOG(gameId, "updateExtraUserMem: invalid range %d-%d", offset, offset + size);
+		return;
+	}
 	try {
-		Database db(databasePath);
-		std::vector<uint8_t> blob;
-		bool newBlob = false;
-		Statement stmt(db, "SELECT EXTRAMEM FROM USER_EXTRAMEM WHERE USER_NAME = ? AND GAME = ?");
-		stmt.bind(1, user);
-		stmt.bind(2, (int)gameId);
-		if (stmt.step())
-			blob = stmt.getBlobColumn(0);
-		else
-			newBlob = true;
-		if ((int)blob.size() < offset + size)
-			blob.resize(offset + size);
-		memcpy(blob.data() + offset, data, size);
-		if (newBlob)
-		{
-			Statement stmt(db, "INSERT INTO USER_EXTRAMEM (USER_NAME, GAME, EXTRAMEM) VALUES (?, ?, ?)");
-			stmt.bind(1, user);
-			stmt.bind(2, (int)gameId);
-			stmt.bind(3, data, size);
-			stmt.step();
-		}
-		else
-		{
-			Statement stmt(db, "UPDATE USER_EXTRAMEM SET EXTRAMEM = ? WHERE USER_NAME = ? AND GAME = ?");
-			stmt.bind(1, data, size);
-			stmt.bind(2, user);
-			stmt.bind(3, (int)gameId);
-			stmt.step();
-		}
+		getStorage().updateExtraUserMem(gameId, user, data, offset, size);
 	} catch (const std::runtime_error& e) {
 		ERROR_LOG(gameId, "updateExtraUserMem: %s", e.what());
 	}
@@ -169,15 +340,354 @@ void updateExtraUserMem(GameId gameId, const std::string& user, const uint8_t *d
 
 std::vector<uint8_t> getExtraUserMem(GameId gameId, const std::string& user)
 {
+	Trace::Span span("db", "getExtraUserMem", gameId, -1, &user);
 	try {
-		Database db(databasePath);
-		Statement stmt(db, "SELECT EXTRAMEM FROM USER_EXTRAMEM WHERE USER_NAME = ? AND GAME = ?");
-		stmt.bind(1, user);
-		stmt.bind(2, (int)gameId);
-		if (stmt.step())
-			return stmt.getBlobColumn(0);
+		return getStorage().getExtraUserMem(gameId, user);
 	} catch (const std::runtime_error& e) {
 		ERROR_LOG(gameId, "getExtraUserMem: %s", e.what());
 	}
 	return {};
 }
+
+//
+// Extra user memory cache
+//
+namespace
+{
+
+struct ExtraMemEntry
+{
+	std::shared_ptr<std::vector<uint8_t>> data;
+	std::list<std::string>::iterator lruPos;
+};
+
+static std::mutex extraMemMutex;
+static std::unordered_map<std::string, ExtraMemEntry> extraMemEntries;
+static std::list<std::string> extraMemLru;	// most recently used first
+static size_t extraMemCapacity = 16 * 1024 * 1024;
+static size_t extraMemBytes;
+static uint64_t extraMemHits;
+static uint64_t extraMemMisses;
+
+static void touch(ExtraMemEntry& entry) {
+	extraMemLru.splice(extraMemLru.begin(), extraMemLru, entry.lruPos);
+}
+
+static void evict()
+{
+	// Entries still referenced by a player or reader are kept
+	auto it = extraMemLru.end();
+	while (extraMemBytes > extraMemCapacity && it != extraMemLru.begin())
+	{
+		--it;
+		auto eit = extraMemEntries.find(*it);
+		if (eit->second.data.use_count() > 1)
+			continue;
+		extraMemBytes -= eit->second.data->size();
+		extraMemEntries.erase(eit);
+		it = extraMemLru.erase(it);
+	}
+}
+
+static ExtraMem insert(const std::string& key, std::shared_ptr<std::vector<uint8_t>> data)
+{
+	auto [it, inserted] = extraMemEntries.try_emplace(key);
+	ExtraMemEntry& entry = it->second;
+	if (inserted) {
+		extraMemLru.push_front(key);
+		entry.lruPos = extraMemLru.begin();
+	}
+	else {
+		extraMemBytes -= entry.data->size();
+		touch(entry);
+	}
+	entry.data = std::move(data);
+	extraMemBytes += entry.data->size();
+	ExtraMem mem = entry.data;
+	evict();
+	return mem;
+}
+
+}
+
+void ExtraMemCache::setCapacity(size_t bytes)
+{
+	std::lock_guard<std::mutex> _(extraMemMutex);
+	extraMemCapacity = bytes;
+	evict();
+}
+
+ExtraMem ExtraMemCache::get(GameId gameId, const std::string& user)
+{
+	std::lock_guard<std::mutex> _(extraMemMutex);
+	if (extraMemCapacity == 0)
+		return nullptr;
+	auto it = extraMemEntries.find(cacheKey(gameId, user));
+	if (it == extraMemEntries.end()) {
+		extraMemMisses++;
+		return nullptr;
+	}
+	extraMemHits++;
+	touch(it->second);
+	return it->second.data;
+}
+
+ExtraMem ExtraMemCache::load(GameId gameId, const std::string& user)
+{
+	ExtraMem mem = get(gameId, user);
+	if (mem != nullptr)
+		return mem;
+	auto data = std::make_shared<std::vector<uint8_t>>(getExtraUserMem(gameId, user));
+	std::lock_guard<std::mutex> _(extraMemMutex);
+	if (extraMemCapacity == 0)
+		return data;
+	std::string key = cacheKey(gameId, user);
+	// Updated by the event loop in the meantime?
+	auto it = extraMemEntries.find(key);
+	if (it != extraMemEntries.end())
+		return it->second.data;
+	return insert(key, data);
+}
+
+ExtraMem ExtraMemCache::update(GameId gameId, const std::string& user, ExtraMem base, int offset, const uint8_t *data, int size)
+{
+	std::lock_guard<std::mutex> _(extraMemMutex);
+	std::string key = cacheKey(gameId, user);
+	std::shared_ptr<std::vector<uint8_t>> mem;
+	auto it = extraMemCapacity == 0 ? extraMemEntries.end() : extraMemEntries.find(key);
+	if (it != extraMemEntries.end()) {
+		mem = it->second.data;
+		base.reset();
+	}
+	if (mem == nullptr)
+		// Evicted or never loaded
+		mem = base != nullptr ? std::make_shared<std::vector<uint8_t>>(*base) : std::make_shared<std::vector<uint8_t>>();
+	else if (mem.use_count() > 2)
+		// Copy on write since readers hold the current version
+		mem = std::make_shared<std::vector<uint8_t>>(*mem);
+	if ((int)mem->size() < ExtraUserMemSize)
+		mem->resize(ExtraUserMemSize);
+	memcpy(mem->data() + offset, data, size);
+	if (extraMemCapacity == 0)
+		return mem;
+	return insert(key, mem);
+}
+
+ExtraMemCache::Stats ExtraMemCache::getStats()
+{
+	std::lock_guard<std::mutex> _(extraMemMutex);
+	Stats stats { extraMemEntries.size(), extraMemBytes, extraMemHits, extraMemMisses };
+	extraMemHits = 0;
+	extraMemMisses = 0;
+	return stats;
+}
+
+//
+// Database backups
+//
+namespace
+{
+
+std::mutex backupMutex;
+std::thread backupThread;
+std::atomic<bool> backupRunning;
+
+// Backup files of all shards share the same timestamp
+void deleteOldBackups(const std::string& directory, int keepCount)
+{
+	namespace fs = std::filesystem;
+	const std::string prefix = "iwango-";
+	constexpr size_t TimestampLength = 15;
+	std::set<std::string> timestamps;
+	for (const auto& entry : fs::directory_iterator(directory))
+	{
+		std::string name = entry.path().filename().string();
+		if (name.compare(0, prefix.length(), prefix) == 0 && name.length() > prefix.length() + TimestampLength)
+			timestamps.insert(name.substr(prefix.length(), TimestampLength));
+	}
+	while ((int)timestamps.size() > keepCount)
+	{
+		std::string oldest = prefix + *timestamps.begin();
+		timestamps.erase(timestamps.begin());
+		for (const auto& entry : fs::directory_iterator(directory))
+			if (entry.path().filename().string().compare(0, oldest.length(), oldest) == 0) {
+				INFO_LOG(GameId::Unknown, "Deleting old backup %s", entry.path().c_str());
+				fs::remove(entry.path());
+			}
+	}
+}
+
+}
+
+void DatabaseBackup::start(const std::string& directory, int keepCount)
+{
+	std::lock_guard<std::mutex> _(backupMutex);
+	if (backupRunning) {
+		WARN_LOG(GameId::Unknown, "Database backup already in progress");
+		return;
+	}
+	if (backupThread.joinable())
+		backupThread.join();
+	backupRunning = true;
+	backupThread = std::thread([directory, keepCount]() {
+		time_t now = time(nullptr);
+		struct tm tm;
+		char timestamp[32];
+		strftime(timestamp, sizeof(timestamp), "%Y%m%d-%H%M%S", localtime_r(&now, &tm));
+		std::string path = directory + "/iwango-" + timestamp + ".db";
+		auto start = std::chrono::steady_clock::now();
+		try {
+			std::filesystem::create_directories(directory);
+			getStorage().backup(path);
+			auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+			NOTICE_LOG(GameId::Unknown, "Database backed up to %s in %d ms", path.c_str(), (int)duration.count());
+			deleteOldBackups(directory, keepCount);
+		} catch (const std::exception& e) {
+			ERROR_LOG(GameId::Unknown, "Database backup failed: %s", e.what());
+		}
+		backupRunning = false;
+	});
+}
+
+void DatabaseBackup::wait()
+{
+	std::lock_guard<std::mutex> _(backupMutex);
+	if (backupThread.joinable())
+		backupThread.join();
+}
+
+//
+// Database worker
+//
+namespace
+{
+
+using the_clock = std::chrono::steady_clock;
+
+struct DbTask
+{
+	std::function<void()> fn;
+	the_clock::time_point queued;
+};
+
+class WorkerThread
+{
+public:
+	WorkerThread() : thread(&WorkerThread::run, this) {
+	}
+
+	void post(DbTask&& task)
+	{
+		{
+			std::lock_guard<std::mutex> _(mutex);
+			queue.push_back(std::move(task));
+		}
+		cv.notify_one();
+	}
+
+	void stop()
+	{
+		{
+			std::lock_guard<std::mutex> _(mutex);
+			stopping = true;
+		}
+		cv.notify_one();
+		thread.join();
+	}
+
+private:
+	void run();
+
+	std::mutex mutex;
+	std::condition_variable cv;
+	std::deque<DbTask> queue;
+	bool stopping = false;
+	std::thread thread;
+};
+
+static std::vector<std::unique_ptr<WorkerThread>> workers;
+static std::atomic<size_t> queueDepth;
+static std::atomic<uint64_t> taskCount;
+static std::atomic<uint64_t> totalLatency;
+static std::atomic<uint64_t> maxLatency;
+
+static void runTask(DbTask& task)
+{
+	the_clock::time_point start = the_clock::now();
+	uint64_t queueTime = std::chrono::duration_cast<std::chrono::microseconds>(start - task.queued).count();
+	PROBE1(db_start, queueTime);
+	AllocProfile::Scope allocScope(AllocProfile::Database);
+	try {
+		task.fn();
+	} catch (const std::exception& e) {
+		ERROR_LOG(GameId::Unknown, "Database task failed: %s", e.what());
+	}
+	the_clock::time_point end = the_clock::now();
+	PROBE2(db_end, queueTime, std::chrono::duration_cast<std::chrono::microseconds>(end - start).count());
+	uint64_t latency = std::chrono::duration_cast<std::chrono::microseconds>(end - task.queued).count();
+	Metrics::DatabaseTaskDuration.observe(latency);
+	taskCount++;
+	totalLatency += latency;
+	uint64_t max = maxLatency;
+	while (latency > max && !maxLatency.compare_exchange_weak(max, latency))
+		;
+}
+
+void WorkerThread::run()
+{
+	for (;;)
+	{
+		DbTask task;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			cv.wait(lock, [this]() { return stopping || !queue.empty(); });
+			if (queue.empty())
+				break;
+			task = std::move(queue.front());
+			queue.pop_front();
+		}
+		queueDepth--;
+		runTask(task);
+	}
+}
+
+}
+
+void DatabaseWorker::start(unsigned threadCount)
+{
+	for (unsigned i = 0; i < std::max(threadCount, 1u); i++)
+		workers.push_back(std::make_unique<WorkerThread>());
+	Metrics::gauge("iwango_db_queue_depth", "Queued database tasks", {}, []() {
+		return queueDepth.load();
+	});
+	NOTICE_LOG(GameId::Unknown, "Database worker started with %zd thread(s)", workers.size());
+}
+
+void DatabaseWorker::stop()
+{
+	for (auto& worker : workers)
+		worker->stop();
+	workers.clear();
+}
+
+void DatabaseWorker::post(const std::string& key, std::function<void()> task)
+{
+	DbTask dbTask { std::move(task), the_clock::now() };
+	if (workers.empty()) {
+		runTask(dbTask);
+		return;
+	}
+	queueDepth++;
+	workers[std::hash<std::string>()(key) % workers.size()]->post(std::move(dbTask));
+}
+
+DatabaseWorker::Stats DatabaseWorker::getStats()
+{
+	Stats stats;
+	stats.queueDepth = queueDepth;
+	stats.tasks = taskCount.exchange(0);
+	uint64_t latency = totalLatency.exchange(0);
+	stats.avgLatencyUs = stats.tasks == 0 ? 0 : latency / stats.tasks;
+	stats.maxLatencyUs = maxLatency.exchange(0);
+	return stats;
+}
@@ -17,14 +17,102 @@
 #pragma once
 #include "common.h"
 #include <dcserver/database.hpp>
+#include <dcserver/asio.hpp>
 #include <string>
 #include <vector>
+#include <functional>
+#include <memory>
 
 void setDatabasePath(const std::string& databasePath);
+// Load all handles in memory. Lookups and name clash checks then avoid the database.
+void loadHandleCache();
+// Returns false if the handle cache isn't loaded
+bool getCachedHandles(GameId gameId, const std::string& user, std::vector<std::string>& handles);
+// Is the handle already used by another user or another slot? False if unknown.
+bool isHandleInUse(GameId gameId, const std::string& handle, const std::string& user, int index);
 bool createHandle(GameId gameId, const std::string& user, int index, const std::string& handle);
 bool replaceHandle(GameId gameId, const std::string& user, int index, const std::string& handle);
 bool deleteHandle(GameId gameId, const std::string& user, int index);
 std::vector<std::string> getHandles(GameId gameId, const std::string& user, const std::string& defaultHandle);
 
+constexpr int ExtraUserMemSize = 0x2000;
 std::vector<uint8_t> getExtraUserMem(GameId gameId, const std::string& user);
 void updateExtraUserMem(GameId gameId, const std::string& user, const uint8_t *data, int offset, int size);
+
+using ExtraMem = std::shared_ptr<const std::vector<uint8_t>>;
+
+//
+// LRU cache of extra user memory shared by all players and database workers.
+// Entries are immutable: updates make a copy if the current version is being read.
+// A capacity of 0 disables the cache, as needed when other processes share the database.
+//
+class ExtraMemCache
+{
+public:
+	static void setCapacity(size_t bytes);
+	// Returns null if not cached
+	static ExtraMem get(GameId gameId, const std::string& user);
+	// Read from the database if not cached. Returns an empty vector if not found.
+	static ExtraMem load(GameId gameId, const std::string& user);
+	// Base is the caller's current version, used if the entry has been evicted
+	static ExtraMem update(GameId gameId, const std::string& user, ExtraMem base, int offset, const uint8_t *data, int size);
+
+	struct Stats
+	{
+		size_t entries;
+		size_t bytes;
+		uint64_t hits;
+		uint64_t misses;
+	};
+	// Hit and miss counters are reset after reading
+	static Stats getStats();
+};
+
+//
+// Online backups of the database to a directory, named iwango-YYYYMMDD-HHMMSS.db
+//
+class DatabaseBackup
+{
+public:
+	// Start a backup on a background thread unless one is running. Older backups are deleted to keep at most keepCount.
+	static void start(const std::string& directory, int keepCount);
+	// Wait until the current backup is done
+	static void wait();
+};
+
+//
+// Runs database calls on background threads so that they never block the event loop.
+// Tasks posted with the same key (user name) run in order on the same thread.
+//
+class DatabaseWorker
+{
+public:
+	// Until started, tasks run synchronously on the calling thread
+	static void start(unsigned threadCount);
+	// Run all pending tasks and stop the worker threads
+	static void stop();
+
+	static void post(const std::string& key, std::function<void()> task);
+
+	// Run work() on a worker thread then done(result) on the given io_context
+	template<typename Work, typename Done>
+	static void run(asio::io_context& io_context, const std::string& key, Work work, Done done)
+	{
+		post(key, [&io_context, work = std::move(work), done = std::move(done)]() {
+			auto result = work();
+			asio::post(io_context, [done, result = std::move(result)]() {
+				done(result);
+			});
+		});
+	}
+
+	struct Stats
+	{
+		size_t queueDepth;
+		uint64_t tasks;
+		uint64_t avgLatencyUs;
+		uint64_t maxLatencyUs;
+	};
+	// Latency includes the time spent in the queue. Counters are reset after reading.
+	static Stats getStats();
+};
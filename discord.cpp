@@ -15,6 +15,7 @@
     along with this program.  If not, see <https://www.gnu.org/licenses/>.
 */
 #include "discord.h"
+#include "load_monitor.h"
 #include <dcserver/discord.hpp>
 #include <chrono>
 
@@ -39,8 +40,10 @@ const char *getDCNetGameId(GameId gameId)
 		return gameIds[(int)gameId];
 }
 
-void discordLobbyJoined(GameId gameId, const std::string& username, const std::string& lobbyName, const std::vector<std::string>& playerList)
+void discordLobbyJoined(GameId gameId, const std::string& username, const std::string& lobbyName, const tmp::vector<std::string_view>& playerList)
 {
+	if (LoadMonitor::isAtLeast(LoadMonitor::NoDiscord))
+		return;
 	using the_clock = std::chrono::steady_clock;
 	static the_clock::time_point last_notif;
 	the_clock::time_point now = the_clock::now();
@@ -51,17 +54,19 @@ void discordLobbyJoined(GameId gameId, const std::string& username, const std::s
 	notif.content = "Player **" + discordEscape(username) + "** joined lobby **" + discordEscape(lobbyName) + "**";
 	notif.embed.title = "Lobby Players";
 	for (const auto& player : playerList)
-		notif.embed.text += discordEscape(player) + "\n";
+		notif.embed.text += discordEscape(std::string(player)) + "\n";
 	discordNotif(getDCNetGameId(gameId), notif);
 }
 
-void discordGameCreated(GameId gameId, const std::string& username, const std::string& gameName, const std::vector<std::string>& playerList)
+void discordGameCreated(GameId gameId, const std::string& username, const std::string& gameName, const tmp::vector<std::string_view>& playerList)
 {
+	if (LoadMonitor::isAtLeast(LoadMonitor::NoDiscord))
+		return;
 	Notif notif;
 	notif.content = "Player **" + discordEscape(username) + "** created team **" + discordEscape(gameName) + "**";
 	notif.embed.title = "Lobby Players";
 	for (const auto& player : playerList)
-		notif.embed.text += discordEscape(player) + "\n";
+		notif.embed.text += discordEscape(std::string(player)) + "\n";
 
 	discordNotif(getDCNetGameId(gameId), notif);
 }
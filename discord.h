@@ -20,5 +20,5 @@
 #include <vector>
 
 const char *getDCNetGameId(GameId gameId);
-void discordLobbyJoined(GameId gameId, const std::string& username, const std::string& lobbyName, const std::vector<std::string>& playerList);
-void discordGameCreated(GameId gameId, const std::string& username, const std::string& gameName, const std::vector<std::string>& playerList);
+void discordLobbyJoined(GameId gameId, const std::string& username, const std::string& lobbyName, const tmp::vector<std::string_view>& playerList);
+void discordGameCreated(GameId gameId, const std::string& username, const std::string& gameName, const tmp::vector<std::string_view>& playerList);
@@ -0,0 +1,85 @@
+/*
+    Copyright (C) 2025  Flyinghead
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#define LOG_SUBSYSTEM Log::Lobby
+#include "flight_recorder.h"
+#include <cerrno>
+#include <ctime>
+
+static std::string Directory = ".";
+// Automatic dumps allowed per minute
+constexpr unsigned MaxDumps = 10;
+
+void FlightRecorder::setDirectory(const std::string& directory) {
+	Directory = directory;
+}
+
+FILE *FlightRecorder::createFile(const std::string& suffix, std::string& path)
+{
+	time_t t = time(nullptr);
+	struct tm tm;
+	localtime_r(&t, &tm);
+	char name[64];
+	strftime(name, sizeof(name), "iwango-flight-%Y%m%d-%H%M%S", &tm);
+	path = Directory + '/' + name + suffix + ".txt";
+	FILE *f = fopen(path.c_str(), "w");
+	if (f == nullptr)
+		ERROR_LOG(GameId::Unknown, "Can't create flight recorder file %s: %s", path.c_str(), strerror(errno));
+	return f;
+}
+
+void FlightRecorder::print(FILE *f) const
+{
+	auto now = std::chrono::steady_clock::now();
+	unsigned count = std::min(next, Size);
+	for (unsigned i = next - count; i != next; i++)
+	{
+		const Entry& entry = entries[i % Size];
+		double age = std::chrono::duration_cast<std::chrono::microseconds>(now - entry.time).count() / 1e6;
+		fprintf(f, "%10.6f %s %04x %5u ", -age, entry.direction == In ? "in " : "out", entry.opcode, entry.length);
+		for (unsigned j = 0; j < std::min<unsigned>(entry.length, DataSize); j++)
+			fprintf(f, " %02x", entry.data[j]);
+		fputc('\n', f);
+	}
+}
+
+void FlightRecorder::dump(const char *reason, GameId gameId, const std::string& player, const std::string& address)
+{
+	if (dumped)
+		return;
+	dumped = true;
+	static std::chrono::steady_clock::time_point periodStart;
+	static unsigned dumpCount;
+	auto now = std::chrono::steady_clock::now();
+	if (now - periodStart >= std::chrono::minutes(1)) {
+		periodStart = now;
+		dumpCount = 0;
+	}
+	if (++dumpCount > MaxDumps)
+		return;
+	std::string path;
+	std::string suffix = '-' + address;
+	for (char& c : suffix)
+		if (c == ':')
+			c = '_';
+	FILE *f = createFile(suffix, path);
+	if (f == nullptr)
+		return;
+	fprintf(f, "# %s\n# %s %s %s\n# time opcode length data\n", reason, Log::getGameName(gameId), address.c_str(), player.c_str());
+	print(f);
+	fclose(f);
+	WARN_LOG(gameId, "[%s] %s: last packets saved to %s", address.c_str(), reason, path.c_str());
+}
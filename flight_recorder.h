@@ -0,0 +1,70 @@
+/*
+    Copyright (C) 2025  Flyinghead
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#pragma once
+#include "common.h"
+#include <array>
+#include <chrono>
+#include <string>
+#include <cstring>
+#include <stdio.h>
+
+//
+// The last packets received and sent by a connection, saved to a file on protocol errors
+//
+class FlightRecorder
+{
+public:
+	static constexpr unsigned Size = 32;
+	static constexpr unsigned DataSize = 16;
+
+	enum Direction : uint8_t {
+		In,
+		Out
+	};
+
+	void record(Direction direction, uint16_t opcode, const uint8_t *data, size_t length)
+	{
+		Entry& entry = entries[next++ % Size];
+		entry.time = std::chrono::steady_clock::now();
+		entry.direction = direction;
+		entry.opcode = opcode;
+		entry.length = length;
+		memcpy(entry.data, data, std::min<size_t>(length, DataSize));
+	}
+
+	// Write the recorded packets, oldest first
+	void print(FILE *f) const;
+	// Save the recorded packets to a new file. Only done once per connection.
+	void dump(const char *reason, GameId gameId, const std::string& player, const std::string& address);
+
+	static void setDirectory(const std::string& directory);
+	// Create a new file in the flight recorder directory
+	static FILE *createFile(const std::string& suffix, std::string& path);
+
+private:
+	struct Entry
+	{
+		std::chrono::steady_clock::time_point time;
+		Direction direction;
+		uint16_t opcode;
+		uint32_t length;
+		uint8_t data[DataSize];
+	};
+	std::array<Entry, Size> entries {};
+	uint32_t next = 0;
+	bool dumped = false;
+};
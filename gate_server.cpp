@@ -1,10 +1,14 @@
+#define LOG_SUBSYSTEM Log::Gate
 #include "common.h"
 #include "database.h"
 #include "gate_server.h"
 #include "models.h"
+#include "metrics.h"
+#include "probes.h"
 #include <stdio.h>
 #include <vector>
 #include <algorithm>
+#include <unordered_map>
 #include <signal.h>
 
 using sstream = std::stringstream;
@@ -13,6 +17,235 @@ static std::string toSjis(const std::string& str, GameId gameId) {
 	return utf8ToSjis(str, gameId == GameId::GolfShiyouyo || gameId == GameId::CuldCept || gameId == GameId::RuneJade);
 }
 
+static std::string handleList(const std::vector<std::string>& handles, GameId gameId)
+{
+	sstream ss;
+	for (unsigned i = 0; i < handles.size(); i++)
+	{
+		if (i > 0)
+			ss << ' ';
+		ss << (i + 1) << toSjis(handles[i], gameId);
+	}
+	return ss.str();
+}
+
+//
+// Lobby server instances of each game, local or running in other processes.
+// REQUEST_FILTER is answered with the least loaded instance, or with all of them
+// for games listed in ServerListGames.
+// Responses only depend on the instance and the local address, so the packets
+// are built once and reused.
+//
+class LobbyInstances
+{
+public:
+	static void update()
+	{
+		games.clear();
+		std::string listGames = "," + getConfig("ServerListGames", "") + ",";
+		for (int i = (int)GameId::Daytona; i <= (int)GameId::RuneJade; i++)
+		{
+			LobbyServer *server = LobbyServer::getServer((GameId)i);
+			// Daytona JP uses the Daytona instances
+			if (server == nullptr || i == (int)GameId::DaytonaJP)
+				continue;
+			Instance instance;
+			instance.local = server;
+			instance.name = server->getName();
+			instance.port = server->getIpPort();
+			Game& game = games[i];
+			game.instances.push_back(instance);
+			game.listAll = listGames.find("," + server->getGameName() + ",") != std::string::npos;
+		}
+		emptyResponse.clear();
+		addPacket(emptyResponse, 0x3E8);
+		addPacket(emptyResponse, 0x3EA);
+	}
+
+	static void report(GameId gameId, asio::ip::address address, uint16_t port, unsigned players, const std::string& name)
+	{
+		auto git = games.find((int)gameId);
+		if (git == games.end())
+			return;
+		Game& game = git->second;
+		removeExpired(gameId, game);
+		// Instances on this host use the same address as the gate
+		if (address.is_loopback())
+			address = asio::ip::address();
+		Instance *instance = nullptr;
+		for (Instance& inst : game.instances)
+			if (inst.address == address && inst.port == port)
+			{
+				if (inst.local != nullptr)
+					// Reported by this process
+					return;
+				instance = &inst;
+				break;
+			}
+		if (instance == nullptr)
+		{
+			if (game.instances.size() >= MaxInstances) {
+				WARN_LOG(gameId, "gate: too many lobby server instances, %s ignored", address.to_string().c_str());
+				return;
+			}
+			INFO_LOG(gameId, "gate: new lobby server instance %s at %s:%d", name.c_str(),
+					address.is_unspecified() ? "localhost" : address.to_string().c_str(), port);
+			game.instances.emplace_back();
+			instance = &game.instances.back();
+			instance->address = address;
+			instance->port = port;
+		}
+		if (instance->name.compare(0, std::string::npos, name, 0, MaxNameLength) != 0) {
+			instance->name = name.substr(0, MaxNameLength);
+			instance->responses.clear();
+		}
+		instance->players = players;
+		instance->lastReport = the_clock::now();
+	}
+
+	static void reportAnonymous(GameId gameId, asio::ip::address address, uint16_t port, std::vector<uint64_t>&& handles)
+	{
+		auto git = games.find((int)gameId);
+		if (git == games.end())
+			return;
+		if (address.is_loopback())
+			address = asio::ip::address();
+		// Only known instances, which have sent their LOBBY report
+		for (Instance& instance : git->second.instances)
+			if (instance.local == nullptr && instance.address == address && instance.port == port) {
+				instance.anonymousHandles = std::move(handles);
+				break;
+			}
+	}
+
+	// Anonymous handles used by the instances of other processes
+	static std::vector<uint64_t> getRemoteAnonymousHandles(GameId gameId)
+	{
+		if (gameId == GameId::DaytonaJP)
+			gameId = GameId::Daytona;
+		std::vector<uint64_t> handles;
+		auto git = games.find((int)gameId);
+		if (git == games.end())
+			return handles;
+		removeExpired(gameId, git->second);
+		for (const Instance& instance : git->second.instances)
+		{
+			if (handles.size() < instance.anonymousHandles.size())
+				handles.resize(instance.anonymousHandles.size());
+			for (size_t i = 0; i < instance.anonymousHandles.size(); i++)
+				handles[i] |= instance.anonymousHandles[i];
+		}
+		return handles;
+	}
+
+	static const std::vector<uint8_t>& getResponse(GameId gameId, const asio::ip::address& localAddress)
+	{
+		if (gameId == GameId::DaytonaJP)
+			gameId = GameId::Daytona;
+		auto git = games.find((int)gameId);
+		if (git == games.end())
+			return emptyResponse;
+		Game& game = git->second;
+		removeExpired(gameId, game);
+		if (game.listAll)
+		{
+			listResponse.clear();
+			addPacket(listResponse, 0x3E8);
+			for (Instance& instance : game.instances)
+				addServer(listResponse, instance, localAddress);
+			addPacket(listResponse, 0x3EA);
+			return listResponse;
+		}
+		Instance *best = nullptr;
+		for (Instance& instance : game.instances)
+			if (best == nullptr || instance.getPlayerCount() < best->getPlayerCount())
+				best = &instance;
+		if (best == nullptr)
+			return emptyResponse;
+		uint32_t key = localAddress.to_v4().to_uint();
+		auto it = best->responses.find(key);
+		if (it != best->responses.end())
+			return it->second;
+		std::vector<uint8_t>& response = best->responses[key];
+		addPacket(response, 0x3E8);
+		addServer(response, *best, localAddress);
+		addPacket(response, 0x3EA);
+		return response;
+	}
+
+private:
+	using the_clock = std::chrono::steady_clock;
+
+	struct Instance
+	{
+		unsigned getPlayerCount() const {
+			return local != nullptr ? local->getPlayerCount() : players;
+		}
+
+		LobbyServer *local = nullptr;
+		std::string name;
+		// Unspecified if on this host
+		asio::ip::address address;
+		uint16_t port = 0;
+		unsigned players = 0;
+		std::vector<uint64_t> anonymousHandles;
+		the_clock::time_point lastReport;
+		// Responses by local address
+		std::unordered_map<uint32_t, std::vector<uint8_t>> responses;
+	};
+	struct Game
+	{
+		std::vector<Instance> instances;
+		bool listAll = false;
+	};
+
+	// Forget the instances that stopped reporting
+	static void removeExpired(GameId gameId, Game& game)
+	{
+		const the_clock::time_point expired = the_clock::now() - std::chrono::seconds(ReportTimeout);
+		for (auto it = game.instances.begin(); it != game.instances.end(); )
+		{
+			if (it->local == nullptr && it->lastReport < expired)
+			{
+				INFO_LOG(gameId, "gate: lobby server instance %s at %s:%d expired", it->name.c_str(),
+						it->address.is_unspecified() ? "localhost" : it->address.to_string().c_str(), it->port);
+				it = game.instances.erase(it);
+			}
+			else {
+				++it;
+			}
+		}
+	}
+
+	static void addServer(std::vector<uint8_t>& out, const Instance& instance, const asio::ip::address& localAddress)
+	{
+		const asio::ip::address& address = instance.address.is_unspecified() ? localAddress : instance.address;
+		addPacket(out, 0x3E9, instance.name + ' ' + address.to_string() + ' ' + std::to_string(instance.port) + " 1");
+	}
+
+	static void addPacket(std::vector<uint8_t>& out, uint16_t opcode, const std::string& payload = {})
+	{
+		uint16_t size = payload.size() + 2;
+		out.push_back(size & 0xff);
+		out.push_back(size >> 8);
+		out.push_back(opcode & 0xff);
+		out.push_back(opcode >> 8);
+		out.insert(out.end(), payload.begin(), payload.end());
+	}
+
+	// Instances that haven't reported for this many seconds are removed
+	static constexpr int ReportTimeout = 30;
+	// Keep the list response within the gate connection send buffer
+	static constexpr size_t MaxInstances = 16;
+	static constexpr size_t MaxNameLength = 32;
+	static std::unordered_map<int, Game> games;
+	static std::vector<uint8_t> emptyResponse;
+	static std::vector<uint8_t> listResponse;
+};
+std::unordered_map<int, LobbyInstances::Game> LobbyInstances::games;
+std::vector<uint8_t> LobbyInstances::emptyResponse;
+std::vector<uint8_t> LobbyInstances::listResponse;
+
 class GateConnection : public SharedThis<GateConnection>
 {
 public:
@@ -30,6 +263,11 @@ public:
 
 	void send(const std::vector<uint8_t>& data)
 	{
+		if (data.size() > sendBuffer.size() - sendIdx) {
+			ERROR_LOG(GameId::Unknown, "gate: Send buffer overflow: %zd > %zd", data.size(), sendBuffer.size() - sendIdx);
+			close();
+			return;
+		}
 		memcpy(&sendBuffer[sendIdx], data.data(), data.size());
 		sendIdx += data.size();
 		send();
@@ -46,8 +284,8 @@ private:
 		if (sending)
 			return;
 		sending = true;
-		uint16_t packetSize = *(uint16_t *)&sendBuffer[0] + 2;
-		asio::async_write(socket, asio::buffer(sendBuffer, packetSize),
+		// Send all pending packets at once
+		asio::async_write(socket, asio::buffer(sendBuffer, sendIdx),
 			std::bind(&GateConnection::onSent, shared_from_this(),
 					asio::placeholders::error,
 					asio::placeholders::bytes_transferred));
@@ -102,9 +340,11 @@ private:
 		// Grab data and process if correct.
 		std::string payload = std::string(&recvBuffer.bytes()[2], &recvBuffer.bytes()[len]);
 		INFO_LOG(GameId::Unknown, "gate: [%s] Request [%s]", socket.remote_endpoint().address().to_string().c_str(), payload.c_str());
-		processRequest(payload);
+		bool deferred = processRequest(payload);
+		tmp::releaseArena();
 		recvBuffer.consume(len);
-		receive();
+		if (!deferred)
+			receive();
 	}
 
 	void sendPacket(uint16_t opcode, const std::string& payload = {})
@@ -116,41 +356,48 @@ private:
 		send();
 	}
 
+	// Send the response to a deferred request and resume reading
+	void reply(uint16_t opcode, const std::string& payload = {})
+	{
+		if (!socket.is_open())
+			return;
+		sendPacket(opcode, payload);
+		receive();
+	}
+
 	bool isAnonymous(const std::string& userName) {
 		return userName == "flycast1" || userName == "flycast2" || userName == "dream";
 	}
 
 	//What is 0x3F6 and 0x3FF for?
-	void processRequest(const std::string& request)
+	// Returns true if the response is sent asynchronously
+	bool processRequest(const std::string& request)
 	{
-		std::vector<std::string> split = splitString(request, ' ');
+		tmp::vector<std::string_view> split = tmp::split(request, ' ');
 		if (split[0] == "REQUEST_FILTER")
 		{
 			if (split.size() < 2) {
+				Metrics::GateRejected.add();
 				sendPacket(ERROR1);
-				return;
+				return false;
 			}
 			GameId gameId = identifyGame(split[1]);
-			// Lobby servers list
-			sendPacket(0x3E8);
-			LobbyServer *server = LobbyServer::getServer(gameId);
-			if (server != nullptr)
-			{
-				sstream ss;
-				ss << server->getName() << ' ' << socket.local_endpoint().address().to_string()
-				   << ' ' << server->getIpPort() << " 1";
-				sendPacket(0x3E9, ss.str());
+			std::error_code ec;
+			asio::ip::tcp::endpoint local = socket.local_endpoint(ec);
+			if (ec) {
+				close();
+				return true;
 			}
-			sendPacket(0x3EA);
+			send(LobbyInstances::getResponse(gameId, local.address()));
 		}
 		else if (split[0] == "HANDLE_LIST_GET")
 		{
 			if (split.size() < 4) {
 				sendPacket(ERROR1);
-				return;
+				return false;
 			}
 			GameId gameId = identifyGame(split[2]);
-			std::string userName = split[1];
+			std::string userName(split[1]);
 			std::string handleName;
 			if (gameId != GameId::RuneJade)
 			{
@@ -159,18 +406,13 @@ private:
 						// Forcibly assign a 'PlayerN' handle
 						std::string handleName;
 						LobbyServer *server = LobbyServer::getServer(gameId);
-						for (int i = 1; i < 100 && server != nullptr; i++)
-						{
-							handleName =  "Player" + std::to_string(i);
-							if (server->getPlayer(handleName) == nullptr)
-								break;
-							handleName = "";
-						}
+						if (server != nullptr)
+							handleName = server->reserveAnonymousHandle(LobbyInstances::getRemoteAnonymousHandles(gameId));
 						if (!handleName.empty())
 							sendPacket(0x3F2, "1" + toSjis(handleName, gameId));
 						else
 							sendPacket(0x3F2);
-						return;
+						return false;
 				}
 				handleName = userName;
 				std::transform(handleName.begin(), handleName.end(), handleName.begin(), [](char c) {
@@ -188,82 +430,114 @@ private:
 				else
 					handleName = handleName.substr(0, maxLength);
 			}
-			std::vector<std::string> handles = getHandles(gameId, userName, handleName);
-			sstream ss;
-			for (unsigned i = 0; i < handles.size(); i++)
-			{
-				if (i > 0)
-					ss << ' ';
-				ss << (i + 1) << toSjis(handles[i], gameId);
+			std::vector<std::string> handles;
+			if (getCachedHandles(gameId, userName, handles) && (!handles.empty() || handleName.empty())) {
+				sendPacket(0x3F2, handleList(handles, gameId));
+				return false;
 			}
-			sendPacket(0x3F2, ss.str());
+			// The default handle needs to be created
+			DatabaseWorker::run(io_context, userName,
+				[gameId, userName, handleName]() {
+					return getHandles(gameId, userName, handleName);
+				},
+				[self = shared_from_this(), gameId](const std::vector<std::string>& handles) {
+					self->reply(0x3F2, handleList(handles, gameId));
+				});
+			return true;
 		}
 		else if (split[0] == "HANDLE_ADD")
 		{
 			if (split.size() < 5) {
 				sendPacket(ERROR1);
-				return;
+				return false;
 			}
 
-			std::string userName = split[1];
+			std::string userName(split[1]);
 			if (isAnonymous(userName)) {
 				sendPacket(NAME_IN_USE1);
-				return;
+				return false;
 			}
 			GameId gameId = identifyGame(split[2]);
-			int handleIndx = atoi(split[3].c_str());
+			int handleIndx = parseInt(split[3]);
 			std::string handlename = sjisToUtf8(split[4]);
-
-			try {
-				if (createHandle(gameId, userName, handleIndx, handlename))
-					sendPacket(0x3F3, "1 " + toSjis(handlename, gameId));
-				else
-					sendPacket(ERROR1);
-			} catch (const UniqueConstraintViolation&) {
+			if (isHandleInUse(gameId, handlename, userName, -1)) {
 				sendPacket(NAME_IN_USE1);
+				return false;
 			}
+
+			DatabaseWorker::run(io_context, userName,
+				[gameId, userName, handleIndx, handlename]() {
+					try {
+						return createHandle(gameId, userName, handleIndx, handlename) ? HandleResult::Ok : HandleResult::Error;
+					} catch (const UniqueConstraintViolation&) {
+						return HandleResult::NameInUse;
+					}
+				},
+				[self = shared_from_this(), gameId, handlename](HandleResult result) {
+					if (result == HandleResult::Ok)
+						self->reply(0x3F3, "1 " + toSjis(handlename, gameId));
+					else
+						self->reply(result == HandleResult::NameInUse ? NAME_IN_USE1 : ERROR1);
+				});
+			return true;
 		}
 		else if (split[0] == "HANDLE_REPLACE")
 		{
 			if (split.size() < 5) {
 				sendPacket(ERROR1);
-				return;
+				return false;
 			}
 
-			std::string userName = split[1];
+			std::string userName(split[1]);
 			if (isAnonymous(userName)) {
 				sendPacket(NAME_IN_USE1);
-				return;
+				return false;
 			}
 			GameId gameId = identifyGame(split[2]);
-			int handleIndx = atoi(split[3].c_str());
+			int handleIndx = parseInt(split[3]);
 			std::string newHandleName = sjisToUtf8(split[4]);
-
-			try {
-				if (replaceHandle(gameId, userName, handleIndx, newHandleName))
-					sendPacket(0x3F4, "1 " + toSjis(newHandleName, gameId));
-				else
-					sendPacket(ERROR1);
-			} catch (const UniqueConstraintViolation&) {
+			if (isHandleInUse(gameId, newHandleName, userName, handleIndx)) {
 				sendPacket(NAME_IN_USE1);
+				return false;
 			}
+
+			DatabaseWorker::run(io_context, userName,
+				[gameId, userName, handleIndx, newHandleName]() {
+					try {
+						return replaceHandle(gameId, userName, handleIndx, newHandleName) ? HandleResult::Ok : HandleResult::Error;
+					} catch (const UniqueConstraintViolation&) {
+						return HandleResult::NameInUse;
+					}
+				},
+				[self = shared_from_this(), gameId, newHandleName](HandleResult result) {
+					if (result == HandleResult::Ok)
+						self->reply(0x3F4, "1 " + toSjis(newHandleName, gameId));
+					else
+						self->reply(result == HandleResult::NameInUse ? NAME_IN_USE1 : ERROR1);
+				});
+			return true;
 		}
 		else if (split[0] == "HANDLE_DELETE")
 		{
 			if (split.size() < 5) {
 				sendPacket(ERROR1);
-				return;
+				return false;
 			}
 
-			std::string userName = split[1];
+			std::string userName(split[1]);
 			GameId gameId = identifyGame(split[2]);
-			int handleIndx = atoi(split[3].c_str());
+			int handleIndx = parseInt(split[3]);
 
-			if (deleteHandle(gameId, userName, handleIndx))
-				sendPacket(0x3F5);
-			else
-				sendPacket(ERROR1);
+			DatabaseWorker::run(io_context, userName,
+				[gameId, userName, handleIndx]() {
+					return deleteHandle(gameId, userName, handleIndx);
+				},
+				[self = shared_from_this()](bool success) {
+					self->reply(success ? 0x3F5 : ERROR1);
+				});
+			return true;
 		}
+		return false;
 	}
 
 	void onTimeOut(const std::error_code& ec)
@@ -292,6 +566,11 @@ private:
 		NAME_IN_USE2 = 0x3FE,
 		ERROR2 = 0x3FF,
 	};
+	enum class HandleResult {
+		Ok,
+		Error,
+		NameInUse,
+	};
 	asio::io_context& io_context;
 	asio::ip::tcp::socket socket;
 	asio::steady_timer timer;
@@ -306,13 +585,37 @@ private:
 GateServer::GateServer(asio::io_context& io_context, uint16_t port)
 	: io_context(io_context),
 	  acceptor(asio::ip::tcp::acceptor(io_context,
-			asio::ip::tcp::endpoint(asio::ip::tcp::v4(), port)))
+			asio::ip::tcp::endpoint(asio::ip::tcp::v4(), port))),
+	  reportSocket(io_context)
 {
 	asio::socket_base::reuse_address option(true);
 	acceptor.set_option(option);
+	uint16_t reportPort = std::stoi(getConfig("InstanceReportPort", "0"));
+	if (reportPort == 0)
+		return;
+	std::string reportAddress = getConfig("InstanceReportAddress", "127.0.0.1");
+	try {
+		for (const std::string& allowed : splitString(getConfig("InstanceReportAllow", "127.0.0.1"), ','))
+			if (!allowed.empty())
+				reportAllowed.push_back(asio::ip::make_address(allowed));
+		reportSocket = asio::ip::udp::socket(io_context, asio::ip::udp::endpoint(asio::ip::make_address(reportAddress), reportPort));
+	} catch (const std::exception& e) {
+		ERROR_LOG(GameId::Unknown, "gate: Can't receive instance reports on %s:%d: %s", reportAddress.c_str(), reportPort, e.what());
+	}
+}
+
+void GateServer::updateServers() {
+	LobbyInstances::update();
 }
 
 void GateServer::start()
+{
+	if (reportSocket.is_open())
+		receiveReport();
+	accept();
+}
+
+void GateServer::accept()
 {
 	GateConnection::Ptr newConnection = GateConnection::create(io_context);
 
@@ -322,9 +625,63 @@ void GateServer::start()
 
 void GateServer::handleAccept(GateConnection::Ptr newConnection, const std::error_code& error)
 {
-	if (!error) {
+	if (error) {
+		Metrics::GateRejected.add();
+	}
+	else {
+		Metrics::GateAccepted.add();
+		PROBE2(conn_accept, -1, newConnection->getSocket().remote_endpoint().address().to_string().c_str());
 		INFO_LOG(GameId::Unknown, "gate: New connection from %s", newConnection->getSocket().remote_endpoint().address().to_string().c_str());
 		newConnection->receive();
 	}
-	start();
+	accept();
+}
+
+void GateServer::receiveReport()
+{
+	reportSocket.async_receive_from(asio::buffer(reportBuffer), reportSender,
+			std::bind(&GateServer::onReport, shared_from_this(), asio::placeholders::error, asio::placeholders::bytes_transferred));
+}
+
+// Lobby server instance reports: "LOBBY <game id> <port> <players> <server name>"
+// and "ANON <game id> <port> <hex bitmap words of the anonymous handles in use>"
+void GateServer::onReport(const std::error_code& ec, size_t len)
+{
+	if (ec)
+	{
+		if (ec == asio::error::operation_aborted)
+			return;
+		ERROR_LOG(GameId::Unknown, "gate: instance report: %s", ec.message().c_str());
+	}
+	else if (std::find(reportAllowed.begin(), reportAllowed.end(), reportSender.address()) == reportAllowed.end())
+	{
+		WARN_LOG(GameId::Unknown, "gate: instance report from %s ignored", reportSender.address().to_string().c_str());
+	}
+	else
+	{
+		std::string report(reportBuffer.data(), len);
+		tmp::vector<std::string_view> split = tmp::split(report, ' ');
+		if (split.size() >= 5 && split[0] == "LOBBY")
+		{
+			size_t namePos = split[4].data() - report.data();
+			LobbyInstances::report((GameId)parseInt(split[1]), reportSender.address(), parseInt(split[2]),
+					parseInt(split[3]), report.substr(namePos));
+		}
+		else if (split.size() >= 3 && split[0] == "ANON")
+		{
+			std::vector<uint64_t> handles;
+			for (size_t i = 3; i < split.size(); i++)
+			{
+				uint64_t bits = 0;
+				std::from_chars(split[i].data(), split[i].data() + split[i].length(), bits, 16);
+				handles.push_back(bits);
+			}
+			LobbyInstances::reportAnonymous((GameId)parseInt(split[1]), reportSender.address(), parseInt(split[2]), std::move(handles));
+		}
+		else {
+			WARN_LOG(GameId::Unknown, "gate: invalid instance report from %s", reportSender.address().to_string().c_str());
+		}
+		tmp::releaseArena();
+	}
+	receiveReport();
 }
@@ -1,6 +1,8 @@
 #pragma once
 #include <dcserver/asio.hpp>
 #include <dcserver/shared_this.hpp>
+#include <array>
+#include <vector>
 
 class GateConnection;
 
@@ -8,13 +10,23 @@ class GateServer : public SharedThis<GateServer>
 {
 public:
 	void start();
+	// Must be called when lobby servers are added or changed
+	static void updateServers();
 
 private:
 	GateServer(asio::io_context& io_context, uint16_t port);
+	void accept();
 	void handleAccept(std::shared_ptr<GateConnection> newConnection, const std::error_code& error);
+	void receiveReport();
+	void onReport(const std::error_code& ec, size_t len);
 
 	asio::io_context& io_context;
 	asio::ip::tcp::acceptor acceptor;
+	asio::ip::udp::socket reportSocket;
+	asio::ip::udp::endpoint reportSender;
+	std::array<char, 256> reportBuffer;
+	// Senders allowed to report instances
+	std::vector<asio::ip::address> reportAllowed;
 
 	friend super;
 };
@@ -12,6 +12,7 @@ CREATE TABLE USER_EXTRAMEM (
 	ID INTEGER PRIMARY KEY AUTOINCREMENT,
 	USER_NAME VARCHAR(28) NOT NULL,
 	GAME INTEGER NOT NULL,
-	EXTRAMEM BLOB
+	EXTRAMEM BLOB,
+	FORMAT INTEGER NOT NULL DEFAULT 0
 );
 CREATE UNIQUE INDEX UNIQUE_EXTRAMEM_INDEX ON USER_EXTRAMEM(USER_NAME, GAME);
@@ -0,0 +1,138 @@
+/*
+    Copyright (C) 2025  Flyinghead
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include "load_monitor.h"
+#include "models.h"
+#include "metrics.h"
+#include <sstream>
+
+LoadMonitor::Step LoadMonitor::step = LoadMonitor::Normal;
+std::deque<LoadMonitor::Task> LoadMonitor::deferred;
+std::set<std::pair<const void *, size_t>> LoadMonitor::deferredKeys;
+
+static const char *StepNames[] {
+	"normal",
+	"discord notifications suspended",
+	"shared mem updates coalesced",
+	"list refreshes deferred",
+	"new logins refused",
+};
+
+void LoadMonitor::start()
+{
+	interval = std::chrono::milliseconds(std::max(std::stoi(getConfig("LoadProbeInterval", "20")), 1));
+	sharedMemInterval = std::chrono::milliseconds(std::stoi(getConfig("SharedMemCoalescing", "200")));
+	recoveryWindows = std::stoi(getConfig("LoadRecoveryTime", "10"));
+	deferredPerTick = std::max(std::stoi(getConfig("LoadDeferredPerTick", "10")), 1);
+	// Lag in ms that triggers each step
+	std::istringstream iss(getConfig("LoadSheddingLag", "0"));
+	std::string value;
+	for (int i = NoDiscord; i < StepCount && std::getline(iss, value, ','); i++)
+		thresholds[i] = std::chrono::milliseconds(std::stoi(value));
+
+	Metrics::gauge("iwango_load_shedding_step", "Current load shedding step (0 is normal)", {}, []() {
+		return (double)step;
+	});
+	Metrics::gauge("iwango_deferred_tasks", "List refreshes waiting to be answered", {}, []() {
+		return (double)deferred.size();
+	});
+	expected = asio::chrono::steady_clock::now();
+	windowEnd = expected + std::chrono::seconds(1);
+	onTimer({});
+}
+
+void LoadMonitor::onTimer(const std::error_code& ec)
+{
+	if (ec)
+		return;
+	auto now = asio::chrono::steady_clock::now();
+	auto lag = std::chrono::duration_cast<std::chrono::microseconds>(now - expected);
+	Metrics::EventLoopLag.observe(lag.count());
+	windowLag = std::max(windowLag, lag);
+	if (now >= windowEnd)
+	{
+		updateStep(windowLag);
+		windowLag = {};
+		windowEnd = now + std::chrono::seconds(1);
+	}
+	if (step >= CoalesceSharedMem)
+	{
+		if (now >= nextSharedMemFlush)
+		{
+			LobbyServer::flushAllSharedMem();
+			// Widened at each step
+			nextSharedMemFlush = now + sharedMemInterval * (1 << (step - CoalesceSharedMem));
+		}
+	}
+	runDeferred(step >= DeferRefresh ? deferredPerTick : deferred.size());
+
+	expected = asio::chrono::steady_clock::now() + interval;
+	timer.expires_at(expected);
+	timer.async_wait(std::bind(&LoadMonitor::onTimer, this, asio::placeholders::error));
+}
+
+void LoadMonitor::updateStep(std::chrono::microseconds lag)
+{
+	Step target = Normal;
+	for (int i = NoDiscord; i < StepCount; i++)
+		if (thresholds[i].count() != 0 && lag >= thresholds[i])
+			target = (Step)i;
+	Step newStep = step;
+	if (target > step) {
+		newStep = target;
+		calmWindows = 0;
+	}
+	else if (target < step)
+	{
+		// Step down progressively once the lag stayed low long enough
+		if (++calmWindows >= recoveryWindows) {
+			newStep = (Step)(step - 1);
+			calmWindows = 0;
+		}
+	}
+	else {
+		calmWindows = 0;
+	}
+	if (newStep == step)
+		return;
+	if (newStep > step)
+		WARN_LOG(GameId::Unknown, "Event loop lag %d ms: %s", (int)(lag.count() / 1000), StepNames[newStep]);
+	else
+		NOTICE_LOG(GameId::Unknown, "Event loop lag %d ms: back to %s", (int)(lag.count() / 1000), StepNames[newStep]);
+	step = newStep;
+	if (step < CoalesceSharedMem)
+		LobbyServer::flushAllSharedMem();
+}
+
+void LoadMonitor::defer(const void *owner, size_t key, std::function<void()> task)
+{
+	if (!deferredKeys.emplace(owner, key).second)
+		// Already pending
+		return;
+	Metrics::RefreshesDeferred.add();
+	deferred.push_back({ owner, key, std::move(task) });
+}
+
+void LoadMonitor::runDeferred(size_t count)
+{
+	for (; count > 0 && !deferred.empty(); count--)
+	{
+		Task task = std::move(deferred.front());
+		deferred.pop_front();
+		deferredKeys.erase({ task.owner, task.key });
+		task.run();
+	}
+}
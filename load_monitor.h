@@ -0,0 +1,81 @@
+/*
+    Copyright (C) 2025  Flyinghead
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#pragma once
+#include <dcserver/asio.hpp>
+#include <functional>
+#include <deque>
+#include <set>
+#include <array>
+
+//
+// Measures how late a periodic timer fires on the event loop and degrades the service
+// in steps when the lag gets too high, so that players already in a game stay connected.
+// Only used on the event loop thread.
+//
+class LoadMonitor
+{
+public:
+	enum Step {
+		Normal,
+		NoDiscord,			// Discord notifications are suspended
+		CoalesceSharedMem,	// Player shared mem updates are sent at most once per interval
+		DeferRefresh,		// List refreshes are answered when the event loop has time left
+		RefuseLogin,		// New logins are refused
+		StepCount
+	};
+
+	LoadMonitor(asio::io_context& io_context)
+		: timer(io_context) {
+	}
+
+	void start();
+
+	static bool isAtLeast(Step s) {
+		return step >= s;
+	}
+	// Run a task later. Tasks with the same owner and key are only run once.
+	static void defer(const void *owner, size_t key, std::function<void()> task);
+
+private:
+	void onTimer(const std::error_code& ec);
+	void updateStep(std::chrono::microseconds lag);
+	void runDeferred(size_t count);
+
+	struct Task
+	{
+		const void *owner;
+		size_t key;
+		std::function<void()> run;
+	};
+
+	asio::steady_timer timer;
+	asio::chrono::steady_clock::time_point expected;
+	asio::chrono::steady_clock::time_point windowEnd;
+	asio::chrono::steady_clock::time_point nextSharedMemFlush;
+	std::chrono::milliseconds interval { 20 };
+	std::chrono::milliseconds sharedMemInterval { 200 };
+	// Lag threshold of each step, 0 if disabled
+	std::array<std::chrono::microseconds, StepCount> thresholds {};
+	std::chrono::microseconds windowLag {};
+	unsigned recoveryWindows = 10;
+	unsigned calmWindows = 0;
+	unsigned deferredPerTick = 10;
+
+	static Step step;
+	static std::deque<Task> deferred;
+	static std::set<std::pair<const void *, size_t>> deferredKeys;
+};
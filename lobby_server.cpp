@@ -1,10 +1,17 @@
+#define LOG_SUBSYSTEM Log::Lobby
 #include "lobby_server.h"
 #include "gate_server.h"
 #include "models.h"
 #include "database.h"
+#include "metrics.h"
+#include "trace.h"
+#include "load_monitor.h"
+#include "probes.h"
+#include "alloc_profile.h"
 #include <dcserver/status.hpp>
 #include <fstream>
 #include <unordered_map>
+#include <cinttypes>
 
 #ifndef LOCALSTATEDIR
 #define LOCALSTATEDIR "./"
@@ -23,12 +30,17 @@ void LobbyConnection::receive()
 
 void LobbyConnection::send(const std::vector<uint8_t>& data)
 {
+	flightRecorder.record(FlightRecorder::Out, *(uint16_t *)&data[2], data.data(), data.size());
+	PROBE3(send_enqueue, *(uint16_t *)&data[2], data.size(), sendIdx);
 	if (data.size() > sendBuffer.size() - sendIdx) {
 		ERROR_LOG(player->gameId, "Send buffer overflow: %zd > %zd", data.size(), sendBuffer.size() - sendIdx);
+		Metrics::SendsDropped.add(player->gameId);
+		dumpFlightRecorder("Send buffer overflow");
 		return;
 	}
 	memcpy(&sendBuffer[sendIdx], data.data(), data.size());
 	sendIdx += data.size();
+	Metrics::SendQueueBytes.observe(sendIdx);
 	send();
 }
 
@@ -36,6 +48,8 @@ void LobbyConnection::close()
 {
 	if (player)
 		INFO_LOG(player->gameId, "[%s] Connection closed for %s", player->getIp().c_str(), player->name.c_str());
+	if (player)
+		PROBE2(conn_close, (int)player->gameId, player->name.c_str());
 	asio::error_code ec;
 	timer.cancel(ec);
 	if (socket.is_open()) {
@@ -45,6 +59,12 @@ void LobbyConnection::close()
 	player.reset();
 }
 
+void LobbyConnection::dumpFlightRecorder(const char *reason)
+{
+	if (player)
+		flightRecorder.dump(reason, player->gameId, player->name, player->getIp() + ':' + std::to_string(player->getPort()));
+}
+
 void LobbyConnection::onReceive(const std::error_code& ec, size_t len)
 {
 	if (ec || len < 10)
@@ -62,14 +82,23 @@ void LobbyConnection::onReceive(const std::error_code& ec, size_t len)
 		if (ec && ec != asio::error::eof && ec != asio::error::operation_aborted
 				&& ec != asio::error::bad_descriptor)
 			ERROR_LOG(gameId, "[%s] onReceive: %s", addr.c_str(), ec.message().c_str());
-		else if (len != 0)
+		else if (len != 0) {
 			ERROR_LOG(gameId, "[%s] onReceive: small packet: %zd", addr.c_str(), len);
+			flightRecorder.record(FlightRecorder::In, 0, recvBuffer.bytes(), len);
+			dumpFlightRecorder("Small packet");
+		}
 		if (player)
 			player->disconnect(false);
 		return;
 	}
 	// Grab data and process if correct.
 	uint16_t opcode = *(uint16_t *)&recvBuffer.bytes()[8];
+	flightRecorder.record(FlightRecorder::In, opcode, recvBuffer.bytes(), len);
+	PROBE3(packet_receive, (int)player->gameId, opcode, len);
+	Metrics::PacketsReceived.add(player->gameId, opcode);
+	Metrics::BytesReceived.add(player->gameId, opcode, len);
+	player->account(Accounting::PacketsIn, 1);
+	player->account(Accounting::BytesIn, len);
 	std::vector<uint8_t> payload(&recvBuffer.bytes()[10], &recvBuffer.bytes()[len]);
 #ifndef NDEBUG
 	//uint16_t unk1 = *(uint16_t *)&recvBuffer.bytes()[2];
@@ -107,6 +136,7 @@ void LobbyConnection::onSent(const std::error_code& ec, size_t len)
 		return;
 	}
 	sending = false;
+	PROBE1(send_done, len);
 	assert(len <= sendIdx);
 	sendIdx -= len;
 	if (sendIdx != 0) {
@@ -152,9 +182,14 @@ private:
 
 	void handleAccept(LobbyConnection::Ptr newConnection, const std::error_code& error)
 	{
-		if (!error)
+		if (error) {
+			Metrics::LobbyRejected.add();
+		}
+		else
 		{
+			Metrics::LobbyAccepted.add();
 			Player::Ptr player = Player::create(newConnection, server);
+			PROBE2(conn_accept, (int)player->gameId, player->getIp().c_str());
 			INFO_LOG(player->gameId, "New connection from %s", newConnection->getSocket().remote_endpoint().address().to_string().c_str());
 			newConnection->setPlayer(player);
 			server.addPlayer(player);
@@ -170,6 +205,192 @@ private:
 	friend super;
 };
 
+class ExtraMemFlusher
+{
+public:
+	ExtraMemFlusher(asio::io_context& io_context)
+		: io_context(io_context), timer(io_context)
+	{
+	}
+
+	void start()
+	{
+		interval = std::stoi(getConfig("ExtraMemFlushInterval", "30"));
+		if (interval > 0)
+			onTimer({});
+	}
+
+	void onTimer(const std::error_code& ec)
+	{
+		if (ec)
+			return;
+		LobbyServer::flushAllExtraMem();
+		timer.expires_at(asio::chrono::steady_clock::now() + asio::chrono::seconds(interval));
+		timer.async_wait(std::bind(&ExtraMemFlusher::onTimer, this, asio::placeholders::error));
+	}
+
+private:
+	asio::io_context& io_context;
+	asio::steady_timer timer;
+	int interval = 30;
+};
+
+// Log the heaviest players and IPs at regular intervals
+class AccountingReporter
+{
+public:
+	AccountingReporter(asio::io_context& io_context)
+		: timer(io_context)
+	{
+	}
+
+	void start()
+	{
+		interval = std::stoi(getConfig("AccountingInterval", "60"));
+		if (interval > 0)
+			setTimer();
+	}
+
+private:
+	void setTimer()
+	{
+		timer.expires_at(asio::chrono::steady_clock::now() + asio::chrono::seconds(interval));
+		timer.async_wait(std::bind(&AccountingReporter::onTimer, this, asio::placeholders::error));
+	}
+
+	void onTimer(const std::error_code& ec)
+	{
+		if (ec)
+			return;
+		LobbyServer::endAccountingPeriod();
+		setTimer();
+	}
+
+	asio::steady_timer timer;
+	int interval = 60;
+};
+
+//
+// Database backups at regular intervals or on SIGUSR1
+//
+class BackupScheduler
+{
+public:
+	BackupScheduler(asio::io_context& io_context)
+		: io_context(io_context), timer(io_context), signals(io_context, SIGUSR1)
+	{
+	}
+
+	void start()
+	{
+		directory = getConfig("BackupDirectory", LOCALSTATEDIR "/lib/iwango/backup");
+		keepCount = std::stoi(getConfig("BackupCount", "7"));
+		interval = std::stoi(getConfig("BackupInterval", "0"));
+		waitSignal();
+		if (interval > 0)
+			startTimer();
+	}
+
+private:
+	void startTimer()
+	{
+		timer.expires_at(asio::chrono::steady_clock::now() + asio::chrono::hours(interval));
+		timer.async_wait(std::bind(&BackupScheduler::onTimer, this, asio::placeholders::error));
+	}
+
+	void onTimer(const std::error_code& ec)
+	{
+		if (ec)
+			return;
+		DatabaseBackup::start(directory, keepCount);
+		startTimer();
+	}
+
+	void waitSignal() {
+		signals.async_wait(std::bind(&BackupScheduler::onSignal, this, asio::placeholders::error));
+	}
+
+	void onSignal(const std::error_code& ec)
+	{
+		if (ec)
+			return;
+		INFO_LOG(GameId::Unknown, "Database backup requested");
+		DatabaseBackup::start(directory, keepCount);
+		waitSignal();
+	}
+
+	asio::io_context& io_context;
+	asio::steady_timer timer;
+	asio::signal_set signals;
+	std::string directory;
+	int keepCount = 7;
+	int interval = 0;
+};
+
+//
+// Reports the player count of each lobby server to the gate of another process
+//
+class InstanceReporter
+{
+public:
+	InstanceReporter(asio::io_context& io_context)
+		: io_context(io_context), timer(io_context), socket(io_context)
+	{
+	}
+
+	void start()
+	{
+		std::string gateAddress = getConfig("GateAddress", "");
+		if (gateAddress.empty())
+			return;
+		size_t colon = gateAddress.find(':');
+		if (colon == std::string::npos) {
+			ERROR_LOG(GameId::Unknown, "GateAddress %s: the gate InstanceReportPort is missing", gateAddress.c_str());
+			return;
+		}
+		std::string port = gateAddress.substr(colon + 1);
+		try {
+			asio::ip::udp::resolver resolver(io_context);
+			gate = *resolver.resolve(asio::ip::udp::v4(), gateAddress.substr(0, colon), port).begin();
+			socket.open(asio::ip::udp::v4());
+		} catch (const std::system_error& e) {
+			ERROR_LOG(GameId::Unknown, "Can't resolve gate address %s: %s", gateAddress.c_str(), e.what());
+			return;
+		}
+		onTimer({});
+	}
+
+	void onTimer(const std::error_code& ec)
+	{
+		if (ec)
+			return;
+		for (LobbyServer *server : LobbyServer::getServers())
+		{
+			std::string report = "LOBBY " + std::to_string((int)server->getGameId()) + ' ' + std::to_string(server->getIpPort())
+					+ ' ' + std::to_string(server->getPlayerCount()) + ' ' + server->getName();
+			std::error_code ignore;
+			socket.send_to(asio::buffer(report), gate, 0, ignore);
+			// Anonymous handles in use here, so that the gate doesn't give them to other players
+			report = "ANON " + std::to_string((int)server->getGameId()) + ' ' + std::to_string(server->getIpPort());
+			for (uint64_t bits : server->getAnonymousHandles())
+			{
+				char word[20];
+				snprintf(word, sizeof(word), " %" PRIx64, bits);
+				report += word;
+			}
+			socket.send_to(asio::buffer(report), gate, 0, ignore);
+		}
+		timer.expires_at(asio::chrono::steady_clock::now() + asio::chrono::seconds(10));
+		timer.async_wait(std::bind(&InstanceReporter::onTimer, this, asio::placeholders::error));
+	}
+
+private:
+	asio::io_context& io_context;
+	asio::steady_timer timer;
+	asio::ip::udp::socket socket;
+	asio::ip::udp::endpoint gate;
+};
+
 class StatusUpdater
 {
 public:
@@ -188,6 +409,14 @@ public:
 		if (ec)
 			return;
 		status::ping("iwango");
+		DatabaseWorker::Stats dbStats = DatabaseWorker::getStats();
+		if (dbStats.tasks != 0 || dbStats.queueDepth != 0)
+			INFO_LOG(GameId::Unknown, "Database: %zd queued, %" PRIu64 " done, latency avg %" PRIu64 " us max %" PRIu64 " us",
+					dbStats.queueDepth, dbStats.tasks, dbStats.avgLatencyUs, dbStats.maxLatencyUs);
+		ExtraMemCache::Stats memStats = ExtraMemCache::getStats();
+		if (memStats.hits != 0 || memStats.misses != 0)
+			INFO_LOG(GameId::Unknown, "Extra mem cache: %zd entries, %zd bytes, %" PRIu64 " hits, %" PRIu64 " misses",
+					memStats.entries, memStats.bytes, memStats.hits, memStats.misses);
 		timer.expires_at(asio::chrono::steady_clock::now() + asio::chrono::seconds(status::pingInterval()));
 		timer.async_wait(std::bind(&StatusUpdater::onTimer, this, asio::placeholders::error));
 	}
@@ -201,7 +430,7 @@ static void breakhandler(int signum) {
 	io_context.stop();
 }
 
-static void loadConfig(const std::string& path)
+static void loadConfig(const std::string& path, std::unordered_map<std::string, std::string>& config = Config)
 {
 	std::filebuf fb;
 	if (!fb.open(path, std::ios::in)) {
@@ -217,7 +446,7 @@ static void loadConfig(const std::string& path)
 			continue;
 		auto pos = line.find_first_of("=:");
 		if (pos != std::string::npos)
-			Config[line.substr(0, pos)] = line.substr(pos + 1);
+			config[line.substr(0, pos)] = line.substr(pos + 1);
 		else
 			ERROR_LOG(GameId::Unknown, "config file syntax error: %s", line.c_str());
 	}
@@ -232,6 +461,84 @@ std::string getConfig(const std::string& name, const std::string& default_value)
 		return it->second;
 }
 
+//
+// Reloads the log levels from the config file on SIGHUP.
+// Other settings are only read at startup.
+//
+class LogLevelReloader
+{
+public:
+	LogLevelReloader(asio::io_context& io_context, const std::string& configPath)
+		: signals(io_context, SIGHUP), configPath(configPath)
+	{
+	}
+
+	void start() {
+		signals.async_wait(std::bind(&LogLevelReloader::onSignal, this, asio::placeholders::error));
+	}
+
+private:
+	void onSignal(const std::error_code& ec)
+	{
+		if (ec)
+			return;
+		// The global config is read by the database threads so a copy is used
+		std::unordered_map<std::string, std::string> config;
+		loadConfig(configPath, config);
+		Log::configure([&config](const std::string& name, const std::string& defaultValue) {
+			auto it = config.find(name);
+			return it == config.end() ? defaultValue : it->second;
+		});
+		NOTICE_LOG(GameId::Unknown, "Log levels reloaded");
+		start();
+	}
+
+	asio::signal_set signals;
+	std::string configPath;
+};
+
+// Allocations by opcode. Only available when built with ALLOC_PROFILE
+static void saveAllocProfile()
+{
+	if (!AllocProfile::Enabled)
+		return;
+	std::string path = getConfig("AllocProfileReport", "");
+	FILE *f = path.empty() ? stderr : fopen(path.c_str(), "w");
+	if (f == nullptr) {
+		ERROR_LOG(GameId::Unknown, "Can't create %s: %s", path.c_str(), strerror(errno));
+		return;
+	}
+	AllocProfile::report(f);
+	if (f != stderr)
+		fclose(f);
+}
+
+// Saves diagnostics each time a signal is received
+class DiagnosticsDumper
+{
+public:
+	DiagnosticsDumper(asio::io_context& io_context, int signum, std::function<void()> dump)
+		: signals(io_context, signum), dump(dump)
+	{
+	}
+
+	void start() {
+		signals.async_wait(std::bind(&DiagnosticsDumper::onSignal, this, asio::placeholders::error));
+	}
+
+private:
+	void onSignal(const std::error_code& ec)
+	{
+		if (ec)
+			return;
+		dump();
+		start();
+	}
+
+	asio::signal_set signals;
+	std::function<void()> dump;
+};
+
 int main(int argc, char *argv[])
 {
 	struct sigaction sigact;
@@ -242,17 +549,47 @@ int main(int argc, char *argv[])
 	sigaction(SIGTERM, &sigact, nullptr);
 	setvbuf(stdout, nullptr, _IOLBF, BUFSIZ);
 
-	loadConfig(argc >= 2 ? argv[1] : "iwango.cfg");
+	const std::string configPath = argc >= 2 ? argv[1] : "iwango.cfg";
+	loadConfig(configPath);
+	Log::configure(getConfig);
+	Log::start(std::stoul(getConfig("LogQueueSize", "4096")), getConfig("LogOverflow", "drop") == "block",
+			getConfig("BinaryLog", ""));
+	// Other processes share the database when running several instances
+	const bool sharedDatabase = !getConfig("GateAddress", "").empty() || std::stoi(getConfig("InstanceReportPort", "0")) != 0;
+	if (sharedDatabase && getConfig("DatabaseEngine", "sqlite") == "memory") {
+		fprintf(stderr, "The memory database engine can't be used by several instances\n");
+		return 1;
+	}
 	try {
 		setDatabasePath(getConfig("DatabasePath", LOCALSTATEDIR "/lib/iwango/iwango.db"));
 	} catch (const std::exception& e) {
 		fprintf(stderr, "Database error: %s\n", e.what());
 		return 1;
 	}
-
-	NOTICE_LOG(GameId::Unknown, "IWANGO Emulator: Gate Server by Ioncannon");
-	GateServer::Ptr gateServer = GateServer::create(io_context, 9500);
-	gateServer->start();
+	try {
+		if (getConfig("HandleCache", "1") == "1")
+			loadHandleCache();
+	} catch (const std::exception& e) {
+		ERROR_LOG(GameId::Unknown, "Can't load the handle cache: %s", e.what());
+	}
+	// Extra mem cached by this process would get stale when users move to another instance
+	if (sharedDatabase)
+		ExtraMemCache::setCapacity(0);
+	else
+		ExtraMemCache::setCapacity(std::stoul(getConfig("ExtraMemCacheSize", "16777216")));
+	Trace::configure(std::stod(getConfig("TraceSampleRate", "0")), std::stoul(getConfig("TraceSlowThreshold", "0")),
+			std::stoul(getConfig("TraceBufferSize", "4096")));
+	DatabaseWorker::start(std::stoi(getConfig("DatabaseThreads", "1")));
+
+	// A gate port of 0 runs additional lobby server instances only
+	uint16_t gatePort = std::stoi(getConfig("GatePort", "9500"));
+	GateServer::Ptr gateServer;
+	if (gatePort != 0)
+	{
+		NOTICE_LOG(GameId::Unknown, "IWANGO Emulator: Gate Server by Ioncannon");
+		gateServer = GateServer::create(io_context, gatePort);
+		gateServer->start();
+	}
 
 	NOTICE_LOG(GameId::Unknown, "IWANGO Emulator: Lobby Server by Ioncannon");
 	LobbyServer daytonaServer(GameId::Daytona, getConfig("DaytonaServerName", "DCNet_Daytona"));
@@ -300,10 +637,48 @@ int main(int argc, char *argv[])
 	LobbyAcceptor::Ptr runeJadeAcceptor = LobbyAcceptor::create(io_context, runeJadeServer);
 	runeJadeAcceptor->start();
 
+	GateServer::updateServers();
+	uint16_t metricsPort = std::stoi(getConfig("MetricsPort", "0"));
+	if (metricsPort != 0)
+		Metrics::startServer(io_context, getConfig("MetricsAddress", "127.0.0.1"), metricsPort);
+	InstanceReporter instanceReporter(io_context);
+	instanceReporter.start();
+	LogLevelReloader logLevelReloader(io_context, configPath);
+	logLevelReloader.start();
+	// Trace spans on SIGUSR2
+	std::string traceDirectory = getConfig("TraceDirectory", LOCALSTATEDIR "/log");
+	DiagnosticsDumper traceDumper(io_context, SIGUSR2, [traceDirectory]() {
+		if (Trace::Enabled && !traceDirectory.empty())
+			Trace::dump(traceDirectory);
+	});
+	traceDumper.start();
+	// Flight recorders of all connections on SIGRTMIN+1
+	FlightRecorder::setDirectory(getConfig("FlightRecorderDirectory", LOCALSTATEDIR "/log"));
+	DiagnosticsDumper flightRecorderDumper(io_context, SIGRTMIN + 1, LobbyServer::dumpFlightRecorders);
+	flightRecorderDumper.start();
+	// Allocation profile on SIGRTMIN+2
+	DiagnosticsDumper allocProfileDumper(io_context, SIGRTMIN + 2, saveAllocProfile);
+	if (AllocProfile::Enabled)
+		allocProfileDumper.start();
+	LoadMonitor loadMonitor(io_context);
+	loadMonitor.start();
+	AccountingReporter accountingReporter(io_context);
+	accountingReporter.start();
+
 	StatusUpdater statusUpdater(io_context);
 	statusUpdater.start();
+	ExtraMemFlusher extraMemFlusher(io_context);
+	extraMemFlusher.start();
+	BackupScheduler backupScheduler(io_context);
+	backupScheduler.start();
 
 	io_context.run();
+	// Save pending uploads then wait until everything is written
+	LobbyServer::flushAllExtraMem();
+	DatabaseWorker::stop();
+	DatabaseBackup::wait();
+	saveAllocProfile();
 
 	NOTICE_LOG(GameId::Unknown, "IWANGO Emulator: terminated");
+	Log::stop();
 }
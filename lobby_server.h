@@ -1,6 +1,8 @@
 #pragma once
 #include <dcserver/asio.hpp>
 #include <dcserver/shared_this.hpp>
+#include "flight_recorder.h"
+#include "probes.h"
 #include <stdio.h>
 #include <vector>
 
@@ -12,6 +14,9 @@ public:
 	asio::ip::tcp::socket& getSocket() {
 		return socket;
 	}
+	asio::io_context& getIoContext() {
+		return io_context;
+	}
 	void setPlayer(std::shared_ptr<Player> player) {
 		this->player = player;
 	}
@@ -19,6 +24,10 @@ public:
 	void receive();
 	void send(const std::vector<uint8_t>& data);
 	void close();
+	void dumpFlightRecorder(const char *reason);
+	const FlightRecorder& getFlightRecorder() const {
+		return flightRecorder;
+	}
 
 private:
 	LobbyConnection(asio::io_context& io_context)
@@ -31,6 +40,7 @@ private:
 			return;
 		sending = true;
 		uint16_t packetSize = *(uint16_t *)&sendBuffer[0] + 2;
+		PROBE1(send_flush, packetSize);
 		asio::async_write(socket, asio::buffer(sendBuffer, packetSize),
 			std::bind(&LobbyConnection::onSent, shared_from_this(),
 					asio::placeholders::error,
@@ -74,6 +84,7 @@ private:
 	size_t sendIdx = 0;
 	bool sending = false;
 	std::shared_ptr<Player> player;
+	FlightRecorder flightRecorder;
 
 	friend super;
 };
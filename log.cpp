@@ -0,0 +1,606 @@
+/*
+    Copyright (C) 2025  Flyinghead
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include "common.h"
+#include "binary_log.h"
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <cstdarg>
+#include <ctime>
+#include <cerrno>
+#include <signal.h>
+#include <unistd.h>
+#include <strings.h>
+
+const char *LevelNames[] = {
+	"ERROR",
+	"WARNING",
+	"NOTICE",
+	"INFO",
+	"DEBUG",
+};
+const char *Games[] = {
+	"",
+	"daytona",
+	"daytonajp",
+	"tetris",
+	"golf",
+	"aeroI",
+	"100swords",
+	"culdcept",
+	"aeroF",
+	"psmash",
+	"yakyuu",
+	"runejade",
+};
+
+namespace Log
+{
+std::atomic<uint8_t> Levels[GameCount][SubsystemCount];
+std::atomic<bool> BinaryEnabled;
+}
+
+namespace
+{
+
+const char *SubsystemNames[] = {
+	"general",
+	"gate",
+	"lobby",
+	"db",
+	"chat",
+};
+
+// Everything compiled in is enabled until configured
+struct DefaultLevels
+{
+	DefaultLevels() {
+		for (auto& game : Log::Levels)
+			for (auto& level : game)
+				level = LOG_MAX_LEVEL;
+	}
+} defaultLevels;
+
+constexpr size_t MessageSize = 480;
+static_assert(Log::Args::Capacity <= MessageSize);
+
+struct Entry
+{
+	std::atomic<size_t> sequence;
+	// Binary records only
+	Log::Site *site;
+	uint64_t timestamp;
+	// Text messages only
+	time_t time;
+	Log::LEVEL level;
+	const char *file;
+	int line;
+
+	GameId gameId;
+	unsigned length;
+	char message[MessageSize];
+};
+
+uint64_t monotonicTime()
+{
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+//
+// Messages are formatted by the calling thread into a bounded lock-free queue.
+// A background thread adds the prefix and writes them to stderr.
+// Binary records are written as is to the binary log file.
+//
+class AsyncLog
+{
+public:
+	static void start(size_t size, bool block, const std::string& binaryPath)
+	{
+		size_t capacity = 16;
+		while (capacity < size)
+			capacity *= 2;
+		entries.reset(new Entry[capacity]);
+		for (size_t i = 0; i < capacity; i++)
+			entries[i].sequence.store(i, std::memory_order_relaxed);
+		mask = capacity - 1;
+		blockWhenFull = block;
+		if (!binaryPath.empty())
+			openBinaryFile(binaryPath);
+		running = true;
+		thread = std::thread(run);
+		enabled.store(true, std::memory_order_release);
+		if (binaryFile != nullptr)
+			Log::BinaryEnabled = true;
+	}
+
+	static void stop()
+	{
+		if (!enabled.exchange(false))
+			return;
+		Log::BinaryEnabled = false;
+		{
+			std::lock_guard<std::mutex> _(mutex);
+			running = false;
+		}
+		event.notify_one();
+		thread.join();
+		// Messages queued while stopping
+		drain();
+		if (binaryFile != nullptr) {
+			fclose(binaryFile);
+			binaryFile = nullptr;
+		}
+	}
+
+	// Fills a free queue entry
+	template<typename Fill>
+	static bool push(Fill fill)
+	{
+		if (!enabled.load(std::memory_order_acquire))
+			return false;
+		Entry *entry;
+		size_t pos = enqueuePos.load(std::memory_order_relaxed);
+		for (;;)
+		{
+			entry = &entries[pos & mask];
+			size_t seq = entry->sequence.load(std::memory_order_acquire);
+			intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+			if (diff == 0)
+			{
+				if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+					break;
+			}
+			else if (diff < 0)
+			{
+				// Full
+				if (!blockWhenFull) {
+					dropped.fetch_add(1, std::memory_order_relaxed);
+					return true;
+				}
+				event.notify_one();
+				std::this_thread::yield();
+				pos = enqueuePos.load(std::memory_order_relaxed);
+			}
+			else {
+				pos = enqueuePos.load(std::memory_order_relaxed);
+			}
+		}
+		fill(*entry);
+		entry->sequence.store(pos + 1, std::memory_order_release);
+		// Wake up the writer before the queue gets full
+		if (pos - dequeuePos.load(std::memory_order_relaxed) == (mask + 1) / 2)
+			event.notify_one();
+		return true;
+	}
+
+	// Writes all queued messages
+	static size_t drain()
+	{
+		char buffer[16 * 1024];
+		size_t size = 0;
+		size_t count = 0;
+		// Stop as soon as a fatal signal handler takes over
+		while (!crashed.load())
+		{
+			Entry *entry;
+			size_t pos = dequeuePos.load(std::memory_order_relaxed);
+			for (;;)
+			{
+				entry = &entries[pos & mask];
+				size_t seq = entry->sequence.load(std::memory_order_acquire);
+				intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+				if (diff == 0)
+				{
+					if (dequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+						break;
+				}
+				else if (diff < 0) {
+					entry = nullptr;
+					break;
+				}
+				else {
+					pos = dequeuePos.load(std::memory_order_relaxed);
+				}
+			}
+			if (entry == nullptr)
+				break;
+			if (entry->site != nullptr) {
+				writeEvent(*entry);
+			}
+			else
+			{
+				if (size + MessageSize + 128 > sizeof(buffer)) {
+					write(buffer, size);
+					size = 0;
+				}
+				size += format(&buffer[size], sizeof(buffer) - size, *entry);
+			}
+			entry->sequence.store(pos + mask + 1, std::memory_order_release);
+			count++;
+		}
+		size_t lost = dropped.exchange(0, std::memory_order_relaxed);
+		if (lost != 0)
+			size += snprintf(&buffer[size], sizeof(buffer) - size, "%zd log messages dropped\n", lost);
+		write(buffer, size);
+		if (binaryFile != nullptr)
+			fflush(binaryFile);
+		return count;
+	}
+
+	// Writes the queued text messages from a fatal signal handler, without timestamp.
+	// Only uses async-signal-safe calls. Binary records are lost.
+	static void crashDrain()
+	{
+		if (crashed.exchange(true))
+			return;
+		// Let the writer thread finish its current batch. Bounded in case it is the crashing thread.
+		for (int i = 0; i < 100 && draining.load(); i++)
+		{
+			timespec ts { 0, 1000000 };
+			nanosleep(&ts, nullptr);
+		}
+		char buffer[4096];
+		size_t size = 0;
+		size_t lost = dropped.load(std::memory_order_relaxed);
+		for (size_t pos = dequeuePos.load(std::memory_order_relaxed); ; pos++)
+		{
+			Entry& entry = entries[pos & mask];
+			if (entry.sequence.load(std::memory_order_acquire) != pos + 1)
+				break;
+			if (entry.site != nullptr) {
+				lost++;
+				continue;
+			}
+			if (size + MessageSize + 128 > sizeof(buffer)) {
+				write(buffer, size);
+				size = 0;
+			}
+			size = append(buffer, size, entry.file, strlen(entry.file));
+			size = append(buffer, size, ":", 1);
+			size = appendNumber(buffer, size, entry.line);
+			size = append(buffer, size, " ", 1);
+			size = append(buffer, size, LevelNames[(int)entry.level], 1);
+			size = append(buffer, size, "[", 1);
+			const char *game = Games[(int)entry.gameId + 1];
+			size = append(buffer, size, game, strlen(game));
+			size = append(buffer, size, "] ", 2);
+			size = append(buffer, size, entry.message, entry.length);
+			size = append(buffer, size, "\n", 1);
+		}
+		if (lost != 0)
+		{
+			size = appendNumber(buffer, size, lost);
+			size = append(buffer, size, " log messages lost\n", 19);
+		}
+		write(buffer, size);
+	}
+
+	static size_t getDropped() {
+		return dropped.load(std::memory_order_relaxed);
+	}
+
+private:
+	static void run()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		while (running)
+		{
+			lock.unlock();
+			// Set before checking crashed, see crashDrain()
+			draining.store(true);
+			size_t count = drain();
+			draining.store(false);
+			lock.lock();
+			// Producers don't signal so the queue is polled while idle
+			if (count == 0 && running)
+				event.wait_for(lock, std::chrono::milliseconds(5));
+		}
+	}
+
+	static size_t format(char *out, size_t size, const Entry& entry)
+	{
+		// Only format the timestamp once per second
+		static thread_local time_t stampTime = -1;
+		static thread_local char stamp[32];
+		if (entry.time != stampTime)
+		{
+			struct tm tm;
+			localtime_r(&entry.time, &tm);
+			snprintf(stamp, sizeof(stamp), "[%02d/%02d %02d:%02d:%02d]",
+					tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec);
+			stampTime = entry.time;
+		}
+		int len = snprintf(out, size, "%s %s:%u %c[%s] %.*s\n", stamp, entry.file, entry.line,
+				LevelNames[(int)entry.level][0], Games[(int)entry.gameId + 1], (int)entry.length, entry.message);
+		return std::min<size_t>(len, size - 1);
+	}
+
+	static size_t append(char *buffer, size_t size, const char *s, size_t len)
+	{
+		memcpy(&buffer[size], s, len);
+		return size + len;
+	}
+
+	static size_t appendNumber(char *buffer, size_t size, size_t n)
+	{
+		char digits[20];
+		int i = sizeof(digits);
+		do {
+			digits[--i] = '0' + n % 10;
+			n /= 10;
+		} while (n != 0);
+		return append(buffer, size, &digits[i], sizeof(digits) - i);
+	}
+
+	static void write(const char *data, size_t size)
+	{
+		while (size > 0)
+		{
+			ssize_t n = ::write(STDERR_FILENO, data, size);
+			if (n <= 0)
+				break;
+			data += n;
+			size -= n;
+		}
+	}
+
+	static void openBinaryFile(const std::string& path)
+	{
+		binaryFile = fopen(path.c_str(), "ab");
+		if (binaryFile == nullptr) {
+			ERROR_LOG(GameId::Unknown, "Can't open binary log %s: %s", path.c_str(), strerror(errno));
+			return;
+		}
+		if (ftell(binaryFile) == 0)
+			fwrite(BinaryLog::Magic, sizeof(BinaryLog::Magic), 1, binaryFile);
+		timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		std::vector<uint8_t> body;
+		put(body, (int64_t)(ts.tv_sec * 1000000000ll + ts.tv_nsec));
+		put(body, monotonicTime());
+		writeRecord(BinaryLog::Start, body);
+		sitesWritten.clear();
+	}
+
+	template<typename T>
+	static void put(std::vector<uint8_t>& out, T v) {
+		out.insert(out.end(), (const uint8_t *)&v, (const uint8_t *)&v + sizeof(T));
+	}
+
+	static void putString(std::vector<uint8_t>& out, const char *s)
+	{
+		uint16_t len = std::min<size_t>(strlen(s), UINT16_MAX);
+		put(out, len);
+		out.insert(out.end(), s, s + len);
+	}
+
+	static void writeRecord(BinaryLog::RecordType type, const std::vector<uint8_t>& body)
+	{
+		uint8_t header[3] = { type, (uint8_t)body.size(), (uint8_t)(body.size() >> 8) };
+		fwrite(header, sizeof(header), 1, binaryFile);
+		fwrite(body.data(), body.size(), 1, binaryFile);
+	}
+
+	static void writeEvent(const Entry& entry)
+	{
+		if (binaryFile == nullptr)
+			return;
+		const Log::Site& site = *entry.site;
+		uint32_t id = site.id.load(std::memory_order_relaxed);
+		static std::vector<uint8_t> body;
+		if (id >= sitesWritten.size())
+			sitesWritten.resize(id + 1);
+		if (!sitesWritten[id])
+		{
+			body.clear();
+			put(body, id);
+			put(body, (uint8_t)site.level);
+			put(body, (uint8_t)site.subsystem);
+			put(body, (uint32_t)site.line);
+			putString(body, site.file);
+			putString(body, site.format);
+			writeRecord(BinaryLog::Site, body);
+			sitesWritten[id] = true;
+		}
+		body.clear();
+		put(body, id);
+		put(body, entry.timestamp);
+		put(body, (int8_t)entry.gameId);
+		body.insert(body.end(), entry.message, entry.message + entry.length);
+		writeRecord(BinaryLog::Event, body);
+	}
+
+	static std::unique_ptr<Entry[]> entries;
+	static size_t mask;
+	static bool blockWhenFull;
+	static std::atomic<bool> enabled;
+	static std::atomic<size_t> enqueuePos;
+	static std::atomic<size_t> dequeuePos;
+	static std::atomic<size_t> dropped;
+	// Set by fatal signal handlers to stop the writer thread
+	static std::atomic<bool> crashed;
+	// Set while the writer thread drains the queue
+	static std::atomic<bool> draining;
+	static std::thread thread;
+	static std::mutex mutex;
+	static std::condition_variable event;
+	static bool running;
+	static FILE *binaryFile;
+	static std::vector<bool> sitesWritten;
+};
+std::unique_ptr<Entry[]> AsyncLog::entries;
+size_t AsyncLog::mask;
+bool AsyncLog::blockWhenFull;
+std::atomic<bool> AsyncLog::enabled;
+std::atomic<size_t> AsyncLog::enqueuePos;
+std::atomic<size_t> AsyncLog::dequeuePos;
+std::atomic<size_t> AsyncLog::dropped;
+std::atomic<bool> AsyncLog::crashed;
+std::atomic<bool> AsyncLog::draining;
+std::thread AsyncLog::thread;
+std::mutex AsyncLog::mutex;
+std::condition_variable AsyncLog::event;
+bool AsyncLog::running;
+FILE *AsyncLog::binaryFile;
+std::vector<bool> AsyncLog::sitesWritten;
+
+std::atomic<uint32_t> nextSiteId;
+
+void fatalSignal(int signum)
+{
+	AsyncLog::crashDrain();
+	// The default handler has been restored
+	raise(signum);
+}
+
+}
+
+void logger(Log::LEVEL level, GameId gameId, const char* file, int line, const char *format, ...)
+{
+	va_list args;
+	va_start(args, format);
+	bool queued = AsyncLog::push([&](Entry& entry) {
+		entry.site = nullptr;
+		entry.time = time(nullptr);
+		entry.level = level;
+		entry.gameId = gameId;
+		entry.file = file;
+		entry.line = line;
+		int len = vsnprintf(entry.message, MessageSize, format, args);
+		if (len < 0)
+			len = 0;
+		else if ((size_t)len >= MessageSize) {
+			// Truncated
+			len = MessageSize - 1;
+			memcpy(&entry.message[len - 3], "...", 3);
+		}
+		entry.length = len;
+	});
+	va_end(args);
+	if (queued)
+		return;
+
+	va_start(args, format);
+	char *temp;
+	if (vasprintf(&temp, format, args) < 0)
+		throw std::bad_alloc();
+	va_end(args);
+
+	time_t now = time(nullptr);
+	struct tm tm = *localtime(&now);
+
+	char *msg;
+	const int len = asprintf(&msg, "[%02d/%02d %02d:%02d:%02d] %s:%u %c[%s] %s\n",
+			tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec,
+			file, line, LevelNames[(int)level][0], Games[(int)gameId + 1], temp);
+	free(temp);
+	if (len < 0)
+		throw std::bad_alloc();
+	fputs(msg, stderr);
+	free(msg);
+}
+
+namespace Log
+{
+
+static int parseLevel(const std::string& name, int defaultLevel)
+{
+	for (int level = ERROR; level <= DEBUG; level++)
+		if (strcasecmp(name.c_str(), LevelNames[level]) == 0)
+			return level;
+	if (!name.empty())
+		ERROR_LOG(GameId::Unknown, "Invalid log level: %s", name.c_str());
+	return defaultLevel;
+}
+
+void configure(const std::function<std::string(const std::string& name, const std::string& defaultValue)>& getValue)
+{
+	// The most specific setting wins: game and subsystem, game, subsystem, global
+	int global = parseLevel(getValue("LogLevel", ""), LOG_MAX_LEVEL);
+	int subsystems[SubsystemCount];
+	for (int sub = 0; sub < SubsystemCount; sub++)
+		subsystems[sub] = parseLevel(getValue(std::string("LogLevel.") + SubsystemNames[sub], ""), global);
+	for (int game = 0; game < GameCount; game++)
+	{
+		std::string gameKey = game == 0 ? "" : std::string("LogLevel.") + Games[game];
+		int gameLevel = game == 0 ? -1 : parseLevel(getValue(gameKey, ""), -1);
+		for (int sub = 0; sub < SubsystemCount; sub++)
+		{
+			int level = gameLevel != -1 ? gameLevel : subsystems[sub];
+			if (game != 0)
+				level = parseLevel(getValue(gameKey + '.' + SubsystemNames[sub], ""), level);
+			Levels[game][sub].store(level, std::memory_order_relaxed);
+		}
+	}
+}
+
+void writeBinary(Site& site, GameId gameId, const Args& args)
+{
+	uint32_t id = site.id.load(std::memory_order_relaxed);
+	if (id == 0)
+	{
+		uint32_t newId = nextSiteId.fetch_add(1, std::memory_order_relaxed) + 1;
+		if (site.id.compare_exchange_strong(id, newId, std::memory_order_relaxed))
+			id = newId;
+	}
+	AsyncLog::push([&](Entry& entry) {
+		entry.site = &site;
+		entry.timestamp = monotonicTime();
+		entry.gameId = gameId;
+		entry.length = args.size;
+		memcpy(entry.message, args.data, args.size);
+	});
+}
+
+const char *getLevelName(LEVEL level) {
+	return LevelNames[level];
+}
+
+const char *getSubsystemName(Subsystem subsystem) {
+	return SubsystemNames[subsystem];
+}
+
+const char *getGameName(GameId gameId) {
+	return Games[(int)gameId + 1];
+}
+
+void start(size_t queueSize, bool blockWhenFull, const std::string& binaryLogPath)
+{
+	AsyncLog::start(queueSize, blockWhenFull, binaryLogPath);
+	atexit(stop);
+
+	struct sigaction sigact;
+	memset(&sigact, 0, sizeof(sigact));
+	sigact.sa_handler = fatalSignal;
+	sigact.sa_flags = SA_RESETHAND;
+	for (int signum : { SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT })
+		sigaction(signum, &sigact, nullptr);
+}
+
+void stop() {
+	AsyncLog::stop();
+}
+
+size_t getDropped() {
+	return AsyncLog::getDropped();
+}
+
+}
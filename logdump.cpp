@@ -0,0 +1,372 @@
+/*
+    Copyright (C) 2025  Flyinghead
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+//
+// Prints the content of a binary log file as text
+//
+#include "common.h"
+#include "binary_log.h"
+#include <stdio.h>
+#include <unistd.h>
+#include <ctime>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+struct Site
+{
+	int level;
+	int subsystem;
+	unsigned line;
+	std::string file;
+	std::string format;
+};
+
+struct Arg
+{
+	Log::Args::Tag tag;
+	int64_t i;
+	uint64_t u;
+	double d;
+	std::string s;
+};
+
+struct Filter
+{
+	int maxLevel = Log::DEBUG;
+	int game = -2;
+	int subsystem = -1;
+	std::string player;
+};
+
+class Reader
+{
+public:
+	Reader(const uint8_t *data, size_t size)
+		: p(data), end(data + size) {}
+
+	bool eof() const {
+		return p >= end;
+	}
+	template<typename T>
+	bool get(T& v)
+	{
+		if ((size_t)(end - p) < sizeof(T))
+			return false;
+		memcpy(&v, p, sizeof(T));
+		p += sizeof(T);
+		return true;
+	}
+	bool getString(std::string& s)
+	{
+		uint16_t len;
+		if (!get(len) || (size_t)(end - p) < len)
+			return false;
+		s.assign((const char *)p, len);
+		p += len;
+		return true;
+	}
+
+private:
+	const uint8_t *p;
+	const uint8_t *end;
+};
+
+static bool readArgs(Reader& reader, std::vector<Arg>& args)
+{
+	args.clear();
+	while (!reader.eof())
+	{
+		Arg arg{};
+		if (!reader.get((uint8_t&)arg.tag))
+			return false;
+		switch (arg.tag)
+		{
+		case Log::Args::Signed:
+			if (!reader.get(arg.i))
+				return false;
+			break;
+		case Log::Args::Unsigned:
+			if (!reader.get(arg.u))
+				return false;
+			break;
+		case Log::Args::Double:
+			if (!reader.get(arg.d))
+				return false;
+			break;
+		case Log::Args::String:
+			if (!reader.getString(arg.s))
+				return false;
+			break;
+		default:
+			return false;
+		}
+		args.push_back(arg);
+	}
+	return true;
+}
+
+static int64_t asInt(const Arg& arg)
+{
+	switch (arg.tag)
+	{
+	case Log::Args::Signed: return arg.i;
+	case Log::Args::Unsigned: return arg.u;
+	case Log::Args::Double: return arg.d;
+	default: return 0;
+	}
+}
+
+// printf with the recorded arguments
+static std::string formatMessage(const std::string& format, const std::vector<Arg>& args)
+{
+	std::string out;
+	size_t argIdx = 0;
+	auto nextArg = [&]() -> const Arg * {
+		return argIdx < args.size() ? &args[argIdx++] : nullptr;
+	};
+	char buf[512];
+	for (size_t i = 0; i < format.length(); i++)
+	{
+		if (format[i] != '%') {
+			out += format[i];
+			continue;
+		}
+		if (i + 1 < format.length() && format[i + 1] == '%') {
+			out += '%';
+			i++;
+			continue;
+		}
+		// Flags, width and precision are kept, length modifiers are dropped
+		std::string spec = "%";
+		size_t j = i + 1;
+		while (j < format.length() && strchr("-+ #0123456789.*", format[j]) != nullptr)
+		{
+			if (format[j] == '*') {
+				const Arg *arg = nextArg();
+				spec += std::to_string(arg != nullptr ? asInt(*arg) : 0);
+			}
+			else {
+				spec += format[j];
+			}
+			j++;
+		}
+		while (j < format.length() && strchr("hlLqjzt", format[j]) != nullptr)
+			j++;
+		if (j == format.length())
+			break;
+		char conv = format[j];
+		i = j;
+		const Arg *arg = nextArg();
+		if (arg == nullptr) {
+			out += "<missing>";
+			continue;
+		}
+		switch (conv)
+		{
+		case 'd':
+		case 'i':
+			snprintf(buf, sizeof(buf), (spec + "lld").c_str(), (long long)asInt(*arg));
+			break;
+		case 'u':
+		case 'x':
+		case 'X':
+		case 'o':
+			snprintf(buf, sizeof(buf), (spec + "ll" + conv).c_str(), (unsigned long long)asInt(*arg));
+			break;
+		case 'c':
+			snprintf(buf, sizeof(buf), (spec + 'c').c_str(), (int)asInt(*arg));
+			break;
+		case 'f':
+		case 'F':
+		case 'e':
+		case 'E':
+		case 'g':
+		case 'G':
+			snprintf(buf, sizeof(buf), (spec + conv).c_str(), arg->tag == Log::Args::Double ? arg->d : (double)asInt(*arg));
+			break;
+		case 'p':
+			snprintf(buf, sizeof(buf), "%#llx", (unsigned long long)asInt(*arg));
+			break;
+		case 's':
+			if (arg->tag == Log::Args::String)
+				snprintf(buf, sizeof(buf), (spec + 's').c_str(), arg->s.c_str());
+			else
+				snprintf(buf, sizeof(buf), "%lld", (long long)asInt(*arg));
+			break;
+		default:
+			snprintf(buf, sizeof(buf), "<%%%c?>", conv);
+			break;
+		}
+		out += buf;
+	}
+	return out;
+}
+
+static bool dump(const std::string& path, const Filter& filter)
+{
+	FILE *f = fopen(path.c_str(), "rb");
+	if (f == nullptr) {
+		perror(path.c_str());
+		return false;
+	}
+	std::vector<uint8_t> data;
+	uint8_t buf[64 * 1024];
+	size_t n;
+	while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+		data.insert(data.end(), buf, buf + n);
+	fclose(f);
+	if (data.size() < sizeof(BinaryLog::Magic) || memcmp(data.data(), BinaryLog::Magic, sizeof(BinaryLog::Magic))) {
+		fprintf(stderr, "%s: not a binary log file\n", path.c_str());
+		return false;
+	}
+
+	std::unordered_map<uint32_t, Site> sites;
+	std::vector<Arg> args;
+	int64_t startRealtime = 0;
+	uint64_t startMonotonic = 0;
+	size_t pos = sizeof(BinaryLog::Magic);
+	while (pos + 3 <= data.size())
+	{
+		BinaryLog::RecordType type = (BinaryLog::RecordType)data[pos];
+		size_t length = data[pos + 1] | (data[pos + 2] << 8);
+		pos += 3;
+		if (pos + length > data.size()) {
+			fprintf(stderr, "%s: truncated record\n", path.c_str());
+			break;
+		}
+		Reader reader(&data[pos], length);
+		pos += length;
+		switch (type)
+		{
+		case BinaryLog::Start:
+			reader.get(startRealtime);
+			reader.get(startMonotonic);
+			sites.clear();
+			break;
+		case BinaryLog::Site:
+		{
+			uint32_t id;
+			uint8_t level, subsystem;
+			Site site;
+			if (reader.get(id) && reader.get(level) && reader.get(subsystem) && reader.get(site.line)
+					&& reader.getString(site.file) && reader.getString(site.format))
+			{
+				site.level = level;
+				site.subsystem = subsystem;
+				sites[id] = site;
+			}
+			break;
+		}
+		case BinaryLog::Event:
+		{
+			uint32_t id;
+			uint64_t timestamp;
+			int8_t game;
+			if (!reader.get(id) || !reader.get(timestamp) || !reader.get(game) || !readArgs(reader, args))
+				break;
+			auto it = sites.find(id);
+			if (it == sites.end())
+				break;
+			const Site& site = it->second;
+			if (site.level > filter.maxLevel
+					|| (filter.game != -2 && game != filter.game)
+					|| (filter.subsystem != -1 && site.subsystem != filter.subsystem))
+				break;
+			if (!filter.player.empty()
+					&& std::none_of(args.begin(), args.end(), [&filter](const Arg& arg) {
+						return arg.tag == Log::Args::String && arg.s == filter.player;
+					}))
+				break;
+			time_t time = (startRealtime + (int64_t)(timestamp - startMonotonic)) / 1000000000;
+			struct tm tm;
+			localtime_r(&time, &tm);
+			printf("[%02d/%02d %02d:%02d:%02d] %s:%u %c[%s] %s\n",
+					tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec,
+					site.file.c_str(), site.line, Log::getLevelName((Log::LEVEL)std::min(site.level, (int)Log::DEBUG))[0],
+					Log::getGameName((GameId)std::max<int>(game, -1)), formatMessage(site.format, args).c_str());
+			break;
+		}
+		default:
+			// Unknown record
+			break;
+		}
+	}
+	return true;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-l level] [-g game] [-s subsystem] [-p player] <binary log>...\n", prog);
+	fprintf(stderr, "  -l  show messages up to this level (ERROR, WARNING, NOTICE, INFO, DEBUG)\n");
+	fprintf(stderr, "  -g  only show messages of this game (daytona, tetris, golf...)\n");
+	fprintf(stderr, "  -s  only show messages of this subsystem (general, gate, lobby, db, chat)\n");
+	fprintf(stderr, "  -p  only show messages with this player name\n");
+}
+
+int main(int argc, char *argv[])
+{
+	Filter filter;
+	int opt;
+	while ((opt = getopt(argc, argv, "l:g:s:p:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'l':
+			filter.maxLevel = -1;
+			for (int level = Log::ERROR; level <= Log::DEBUG; level++)
+				if (strcasecmp(optarg, Log::getLevelName((Log::LEVEL)level)) == 0)
+					filter.maxLevel = level;
+			if (filter.maxLevel == -1) {
+				fprintf(stderr, "Unknown level: %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'g':
+			for (int game = (int)GameId::Daytona; game <= (int)GameId::RuneJade; game++)
+				if (strcasecmp(optarg, Log::getGameName((GameId)game)) == 0)
+					filter.game = game;
+			if (filter.game == -2) {
+				fprintf(stderr, "Unknown game: %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 's':
+			for (int sub = 0; sub < Log::SubsystemCount; sub++)
+				if (strcasecmp(optarg, Log::getSubsystemName((Log::Subsystem)sub)) == 0)
+					filter.subsystem = sub;
+			if (filter.subsystem == -1) {
+				fprintf(stderr, "Unknown subsystem: %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'p':
+			filter.player = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (optind >= argc) {
+		usage(argv[0]);
+		return 1;
+	}
+	bool success = true;
+	for (int i = optind; i < argc; i++)
+		success = dump(argv[i], filter) && success;
+	return success ? 0 : 1;
+}
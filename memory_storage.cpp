@@ -0,0 +1,471 @@
+/*
+    Copyright (C) 2025  Flyinghead
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#define LOG_SUBSYSTEM Log::Database
+#include "storage.h"
+#include "database.h"
+#include <dcserver/database.hpp>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <stdexcept>
+#include <algorithm>
+#include <map>
+#include <mutex>
+
+namespace
+{
+
+constexpr char SnapshotMagic[8] = { 'I', 'W', 'M', 'E', 'M', 'D', 'B', '1' };
+
+enum LogOp : uint8_t {
+	CreateHandle = 1,
+	ReplaceHandle = 2,
+	DeleteHandle = 3,
+	UpdateExtraMem = 4,
+};
+
+//
+// Serialization of log records and snapshots
+//
+class Writer
+{
+public:
+	void put8(uint8_t v) {
+		data.push_back(v);
+	}
+	void put32(int32_t v) {
+		put(&v, sizeof(v));
+	}
+	void put(const std::string& s) {
+		put32(s.length());
+		put(s.data(), s.length());
+	}
+	void put(const void *p, size_t size) {
+		data.insert(data.end(), (const uint8_t *)p, (const uint8_t *)p + size);
+	}
+	void write(FILE *f)
+	{
+		if (fwrite(data.data(), 1, data.size(), f) != data.size())
+			throw std::runtime_error(std::string("Write error: ") + strerror(errno));
+		data.clear();
+	}
+
+private:
+	std::vector<uint8_t> data;
+};
+
+class Reader
+{
+public:
+	Reader(FILE *f) : f(f) {}
+
+	// Returns false at the end of the file
+	bool get8(uint8_t& v) {
+		return fread(&v, 1, 1, f) == 1;
+	}
+	int32_t get32()
+	{
+		int32_t v;
+		get(&v, sizeof(v));
+		return v;
+	}
+	std::string getString()
+	{
+		int32_t len = get32();
+		if (len < 0 || len > 1024)
+			throw std::runtime_error("Invalid string length");
+		std::string s(len, '\0');
+		get(s.data(), len);
+		return s;
+	}
+	void get(void *p, size_t size)
+	{
+		if (fread(p, 1, size, f) != size)
+			throw std::runtime_error("Unexpected end of file");
+	}
+
+private:
+	FILE *f;
+};
+
+using UserKey = std::pair<int, std::string>;
+using HandleMap = std::map<UserKey, std::map<int, std::string>>;
+using ExtraMemMap = std::map<UserKey, std::vector<uint8_t>>;
+
+class MemoryStorage : public Storage
+{
+public:
+	MemoryStorage(const std::string& path)
+		: path(path), logPath(path + ".log")
+	{
+		// The snapshot and log can only have one writer
+		std::string lockPath = path + ".lock";
+		lockFd = open(lockPath.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+		if (lockFd == -1)
+			throw std::runtime_error("Can't create " + lockPath + ": " + strerror(errno));
+		if (flock(lockFd, LOCK_EX | LOCK_NB) != 0) {
+			close(lockFd);
+			throw std::runtime_error(path + " is used by another process");
+		}
+		FILE *f = fopen(path.c_str(), "rb");
+		if (f != nullptr) {
+			loadSnapshot(f);
+			fclose(f);
+		}
+		f = fopen(logPath.c_str(), "rb");
+		if (f != nullptr) {
+			replayLog(f);
+			fclose(f);
+		}
+		compact();
+	}
+
+	~MemoryStorage()
+	{
+		std::lock_guard<std::mutex> _(mutex);
+		try {
+			compact();
+		} catch (const std::runtime_error& e) {
+			ERROR_LOG(GameId::Unknown, "Can't write the database snapshot: %s", e.what());
+		}
+		if (log != nullptr)
+			fclose(log);
+		close(lockFd);
+	}
+
+	void forEachHandle(const HandleVisitor& visitor) override
+	{
+		std::lock_guard<std::mutex> _(mutex);
+		for (const auto& [key, handles] : userHandles)
+			for (const auto& [index, handle] : handles)
+				visitor((GameId)key.first, key.second, index, handle);
+	}
+
+	std::vector<std::string> getHandles(GameId gameId, const std::string& user) override
+	{
+		std::lock_guard<std::mutex> _(mutex);
+		std::vector<std::string> handles;
+		auto it = userHandles.find({ (int)gameId, user });
+		if (it != userHandles.end())
+			for (const auto& [index, handle] : it->second)
+				handles.push_back(handle);
+		return handles;
+	}
+
+	void createHandle(GameId gameId, const std::string& user, int index, const std::string& handle) override
+	{
+		std::lock_guard<std::mutex> _(mutex);
+		applyCreateHandle((int)gameId, user, index, handle);
+		Writer w;
+		w.put8(CreateHandle);
+		w.put32((int)gameId);
+		w.put(user);
+		w.put32(index);
+		w.put(handle);
+		append(w);
+	}
+
+	bool replaceHandle(GameId gameId, const std::string& user, int index, const std::string& handle) override
+	{
+		std::lock_guard<std::mutex> _(mutex);
+		if (!applyReplaceHandle((int)gameId, user, index, handle))
+			return false;
+		Writer w;
+		w.put8(ReplaceHandle);
+		w.put32((int)gameId);
+		w.put(user);
+		w.put32(index);
+		w.put(handle);
+		append(w);
+		return true;
+	}
+
+	void deleteHandle(GameId gameId, const std::string& user, int index) override
+	{
+		std::lock_guard<std::mutex> _(mutex);
+		applyDeleteHandle((int)gameId, user, index);
+		Writer w;
+		w.put8(DeleteHandle);
+		w.put32((int)gameId);
+		w.put(user);
+		w.put32(index);
+		append(w);
+	}
+
+	std::vector<uint8_t> getExtraUserMem(GameId gameId, const std::string& user) override
+	{
+		std::lock_guard<std::mutex> _(mutex);
+		auto it = extraMem.find({ (int)gameId, user });
+		if (it == extraMem.end())
+			return {};
+		return it->second;
+	}
+
+	void updateExtraUserMem(GameId gameId, const std::string& user, const uint8_t *data, int offset, int size) override
+	{
+		std::lock_guard<std::mutex> _(mutex);
+		applyUpdateExtraMem((int)gameId, user, data, offset, size);
+		Writer w;
+		w.put8(UpdateExtraMem);
+		w.put32((int)gameId);
+		w.put(user);
+		w.put32(offset);
+		w.put32(size);
+		w.put(data, size);
+		append(w);
+	}
+
+	void backup(const std::string& destPath) override
+	{
+		// Only copy the tables while locked. Writing the snapshot takes longer.
+		HandleMap handleCopy;
+		ExtraMemMap extraMemCopy;
+		{
+			std::lock_guard<std::mutex> _(mutex);
+			handleCopy = userHandles;
+			extraMemCopy = extraMem;
+		}
+		writeSnapshot(destPath, handleCopy, extraMemCopy);
+	}
+
+private:
+	void applyCreateHandle(int gameId, const std::string& user, int index, const std::string& handle)
+	{
+		if (owners.count({ gameId, handle }) != 0)
+			throw UniqueConstraintViolation("Handle " + handle + " already exists");
+		auto it = userHandles.find({ gameId, user });
+		if (it != userHandles.end() && it->second.count(index) != 0)
+			throw UniqueConstraintViolation("Handle index " + std::to_string(index) + " already used");
+		userHandles[{ gameId, user }][index] = handle;
+		owners[{ gameId, handle }] = index;
+	}
+
+	bool applyReplaceHandle(int gameId, const std::string& user, int index, const std::string& handle)
+	{
+		auto uit = userHandles.find({ gameId, user });
+		if (uit == userHandles.end())
+			return false;
+		auto it = uit->second.find(index);
+		if (it == uit->second.end())
+			return false;
+		if (it->second != handle && owners.count({ gameId, handle }) != 0)
+			throw UniqueConstraintViolation("Handle " + handle + " already exists");
+		owners.erase({ gameId, it->second });
+		it->second = handle;
+		owners[{ gameId, handle }] = index;
+		return true;
+	}
+
+	void applyDeleteHandle(int gameId, const std::string& user, int index)
+	{
+		auto uit = userHandles.find({ gameId, user });
+		if (uit == userHandles.end())
+			return;
+		std::map<int, std::string>& handles = uit->second;
+		auto it = handles.find(index);
+		if (it != handles.end()) {
+			owners.erase({ gameId, it->second });
+			handles.erase(it);
+		}
+		std::map<int, std::string> renumbered;
+		for (auto& [i, handle] : handles)
+		{
+			int newIndex = i > index ? i - 1 : i;
+			owners[{ gameId, handle }] = newIndex;
+			renumbered[newIndex] = std::move(handle);
+		}
+		if (renumbered.empty())
+			userHandles.erase(uit);
+		else
+			handles = std::move(renumbered);
+	}
+
+	void applyUpdateExtraMem(int gameId, const std::string& user, const uint8_t *data, int offset, int size)
+	{
+		std::vector<uint8_t>& mem = extraMem[{ gameId, user }];
+		if ((int)mem.size() < ExtraUserMemSize)
+			mem.resize(ExtraUserMemSize);
+		memcpy(&mem[offset], data, size);
+	}
+
+	void loadSnapshot(FILE *f)
+	{
+		Reader r(f);
+		char magic[sizeof(SnapshotMagic)];
+		r.get(magic, sizeof(magic));
+		if (memcmp(magic, SnapshotMagic, sizeof(magic)))
+			throw std::runtime_error(path + " isn't a database snapshot");
+		int count = r.get32();
+		for (int i = 0; i < count; i++)
+		{
+			int gameId = r.get32();
+			std::string user = r.getString();
+			int index = r.get32();
+			std::string handle = r.getString();
+			applyCreateHandle(gameId, user, index, handle);
+		}
+		count = r.get32();
+		for (int i = 0; i < count; i++)
+		{
+			int gameId = r.get32();
+			std::string user = r.getString();
+			int size = r.get32();
+			if (size < 0 || size > ExtraUserMemSize)
+				throw std::runtime_error("Invalid extra mem size");
+			std::vector<uint8_t>& mem = extraMem[{ gameId, user }];
+			mem.resize(size);
+			r.get(mem.data(), size);
+		}
+	}
+
+	void replayLog(FILE *f)
+	{
+		Reader r(f);
+		int records = 0;
+		try {
+			uint8_t op;
+			while (r.get8(op))
+			{
+				int gameId = r.get32();
+				std::string user = r.getString();
+				switch (op)
+				{
+				case CreateHandle:
+				case ReplaceHandle:
+				{
+					int index = r.get32();
+					std::string handle = r.getString();
+					if (op == CreateHandle)
+						applyCreateHandle(gameId, user, index, handle);
+					else
+						applyReplaceHandle(gameId, user, index, handle);
+					break;
+				}
+				case DeleteHandle:
+					applyDeleteHandle(gameId, user, r.get32());
+					break;
+				case UpdateExtraMem:
+				{
+					int offset = r.get32();
+					int size = r.get32();
+					if (offset < 0 || size < 0 || offset + size > ExtraUserMemSize)
+						throw std::runtime_error("Invalid extra mem range");
+					std::vector<uint8_t> data(size);
+					r.get(data.data(), size);
+					applyUpdateExtraMem(gameId, user, data.data(), offset, size);
+					break;
+				}
+				default:
+					throw std::runtime_error("Invalid record type " + std::to_string(op));
+				}
+				records++;
+			}
+		} catch (const std::runtime_error& e) {
+			// Most likely a record cut short by a crash
+			WARN_LOG(GameId::Unknown, "%s: %s after %d records", logPath.c_str(), e.what(), records);
+		}
+	}
+
+	// Write a new snapshot and start an empty log
+	void compact()
+	{
+		if (log != nullptr) {
+			fclose(log);
+			log = nullptr;
+		}
+		writeSnapshot(path, userHandles, extraMem);
+		log = fopen(logPath.c_str(), "wb");
+		if (log == nullptr)
+			throw std::runtime_error("Can't create " + logPath + ": " + strerror(errno));
+		logSize = 0;
+	}
+
+	static void writeSnapshot(const std::string& path, const HandleMap& userHandles, const ExtraMemMap& extraMem)
+	{
+		std::string tmpPath = path + ".tmp";
+		FILE *f = fopen(tmpPath.c_str(), "wb");
+		if (f == nullptr)
+			throw std::runtime_error("Can't create " + tmpPath + ": " + strerror(errno));
+		try {
+			Writer w;
+			w.put(SnapshotMagic, sizeof(SnapshotMagic));
+			int handleCount = 0;
+			for (const auto& [key, handles] : userHandles)
+				handleCount += handles.size();
+			w.put32(handleCount);
+			for (const auto& [key, handles] : userHandles)
+				for (const auto& [index, handle] : handles)
+				{
+					w.put32(key.first);
+					w.put(key.second);
+					w.put32(index);
+					w.put(handle);
+				}
+			w.put32(extraMem.size());
+			w.write(f);
+			for (const auto& [key, mem] : extraMem)
+			{
+				w.put32(key.first);
+				w.put(key.second);
+				w.put32(mem.size());
+				w.put(mem.data(), mem.size());
+				w.write(f);
+			}
+			if (fflush(f) != 0 || fsync(fileno(f)) != 0)
+				throw std::runtime_error(std::string("Write error: ") + strerror(errno));
+		} catch (...) {
+			fclose(f);
+			throw;
+		}
+		fclose(f);
+		if (rename(tmpPath.c_str(), path.c_str()) != 0)
+			throw std::runtime_error("Can't rename " + tmpPath + ": " + strerror(errno));
+	}
+
+	void append(Writer& w)
+	{
+		if (log == nullptr)
+			throw std::runtime_error("Database log isn't open");
+		w.write(log);
+		// Not synced: a crash can lose the last writes but never corrupts the snapshot
+		fflush(log);
+		logSize = ftell(log);
+		if (logSize > MaxLogSize)
+			compact();
+	}
+
+	static constexpr long MaxLogSize = 64 * 1024 * 1024;
+
+	std::mutex mutex;
+	std::string path;
+	std::string logPath;
+	FILE *log = nullptr;
+	long logSize = 0;
+	int lockFd = -1;
+	HandleMap userHandles;
+	std::map<UserKey, int> owners;	// (game, handle) -> index
+	ExtraMemMap extraMem;
+};
+
+}
+
+std::unique_ptr<Storage> createMemoryStorage(const std::string& path) {
+	return std::make_unique<MemoryStorage>(path);
+}
@@ -0,0 +1,378 @@
+/*
+    Copyright (C) 2025  Flyinghead
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include "metrics.h"
+#include <dcserver/shared_this.hpp>
+#include <vector>
+#include <unordered_map>
+#include <memory>
+
+namespace Metrics
+{
+
+namespace
+{
+
+enum class Type {
+	Counter,
+	Gauge,
+	Histogram,
+};
+
+struct Series
+{
+	std::string labels;
+	unsigned slot;
+	double unit;
+	std::function<double()> gauge;
+	std::function<void(std::vector<Sample>&)> collect;
+};
+
+struct Family
+{
+	std::string name;
+	std::string help;
+	Type type;
+	std::vector<Series> series;
+};
+
+class Registry
+{
+public:
+	static Registry& instance()
+	{
+		static Registry registry;
+		return registry;
+	}
+
+	// Returns 0 if out of slots
+	unsigned add(const std::string& name, const std::string& help, Type type, const std::string& labels,
+			unsigned slotCount, double unit = 1.0, std::function<double()> gauge = {},
+			std::function<void(std::vector<Sample>&)> collect = {})
+	{
+		std::lock_guard<std::mutex> _(mutex);
+		unsigned slot = 0;
+		if (slotCount != 0)
+		{
+			if (nextSlot + slotCount > MaxSlots)
+			{
+				if (!full)
+					WARN_LOG(GameId::Unknown, "Metrics: no more slots for %s", name.c_str());
+				full = true;
+				return 0;
+			}
+			slot = nextSlot;
+			nextSlot += slotCount;
+		}
+		auto it = familyIndex.find(name);
+		if (it == familyIndex.end())
+		{
+			it = familyIndex.emplace(name, families.size()).first;
+			families.push_back({ name, help, type, {} });
+		}
+		families[it->second].series.push_back({ labels, slot, unit, std::move(gauge), std::move(collect) });
+		return slot;
+	}
+
+	void addThread(ThreadValues *thread)
+	{
+		std::lock_guard<std::mutex> _(mutex);
+		threads.push_back(thread);
+	}
+
+	void removeThread(ThreadValues *thread)
+	{
+		std::lock_guard<std::mutex> _(mutex);
+		// Keep the values of terminated threads
+		for (unsigned i = 1; i < nextSlot; i++)
+			retired[i] += thread->values[i].load(std::memory_order_relaxed);
+		threads.erase(std::find(threads.begin(), threads.end(), thread));
+	}
+
+	std::string scrape()
+	{
+		std::lock_guard<std::mutex> _(mutex);
+		std::string out;
+		char buf[64];
+		for (const Family& family : families)
+		{
+			out += "# HELP " + family.name + ' ' + family.help + '\n';
+			out += "# TYPE " + family.name + ' '
+					+ (family.type == Type::Counter ? "counter" : family.type == Type::Gauge ? "gauge" : "histogram") + '\n';
+			for (const Series& series : family.series)
+			{
+				std::string labels = series.labels.empty() ? "" : '{' + series.labels + '}';
+				switch (family.type)
+				{
+				case Type::Counter:
+					out += family.name + labels + ' ' + std::to_string(sum(series.slot)) + '\n';
+					break;
+				case Type::Gauge:
+					if (series.collect)
+					{
+						std::vector<Sample> samples;
+						series.collect(samples);
+						std::string prefix = series.labels.empty() ? "" : series.labels + ',';
+						for (const Sample& sample : samples)
+						{
+							snprintf(buf, sizeof(buf), "%.17g", sample.value);
+							out += family.name + '{' + prefix + sample.labels + "} " + buf + '\n';
+						}
+					}
+					else
+					{
+						snprintf(buf, sizeof(buf), "%.17g", series.gauge());
+						out += family.name + labels + ' ' + buf + '\n';
+					}
+					break;
+				case Type::Histogram:
+				{
+					std::string prefix = series.labels.empty() ? "" : series.labels + ',';
+					uint64_t count = 0;
+					for (unsigned b = 0; b < Histogram::BucketCount; b++)
+					{
+						count += sum(series.slot + b);
+						if (b == Histogram::BucketCount - 1)
+							strcpy(buf, "+Inf");
+						else
+							snprintf(buf, sizeof(buf), "%.9g", Histogram::bucketLimit(b) * series.unit);
+						out += family.name + "_bucket{" + prefix + "le=\"" + buf + "\"} " + std::to_string(count) + '\n';
+					}
+					snprintf(buf, sizeof(buf), "%.17g", sum(series.slot + Histogram::BucketCount) * series.unit);
+					out += family.name + "_sum" + labels + ' ' + buf + '\n';
+					out += family.name + "_count" + labels + ' ' + std::to_string(count) + '\n';
+					break;
+				}
+				}
+			}
+		}
+		return out;
+	}
+
+private:
+	Registry() : retired(MaxSlots) {}
+
+	uint64_t sum(unsigned slot)
+	{
+		uint64_t total = retired[slot];
+		for (ThreadValues *thread : threads)
+			total += thread->values[slot].load(std::memory_order_relaxed);
+		return total;
+	}
+
+	std::mutex mutex;
+	std::vector<Family> families;
+	std::unordered_map<std::string, size_t> familyIndex;
+	std::vector<ThreadValues *> threads;
+	std::vector<uint64_t> retired;
+	// Slot 0 is unused
+	unsigned nextSlot = 1;
+	bool full = false;
+};
+
+class HttpConnection : public SharedThis<HttpConnection>
+{
+public:
+	asio::ip::tcp::socket& getSocket() {
+		return socket;
+	}
+
+	void start()
+	{
+		asio::async_read_until(socket, request, "\r\n\r\n",
+				std::bind(&HttpConnection::onRequest, shared_from_this(), asio::placeholders::error));
+	}
+
+private:
+	HttpConnection(asio::io_context& io_context)
+		: socket(io_context) {}
+
+	void onRequest(const std::error_code& ec)
+	{
+		if (ec)
+			return;
+		std::istream is(&request);
+		std::string method, path;
+		is >> method >> path;
+		std::string body;
+		if (method == "GET" && (path == "/metrics" || path == "/")) {
+			body = scrape();
+			response = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n";
+		}
+		else {
+			body = "Not found\n";
+			response = "HTTP/1.0 404 Not Found\r\nContent-Type: text/plain\r\n";
+		}
+		response += "Content-Length: " + std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+		asio::async_write(socket, asio::buffer(response),
+				std::bind(&HttpConnection::onSent, shared_from_this(), asio::placeholders::error));
+	}
+
+	void onSent(const std::error_code& ec)
+	{
+		asio::error_code ignore;
+		socket.shutdown(asio::socket_base::shutdown_both, ignore);
+		socket.close(ignore);
+	}
+
+	asio::ip::tcp::socket socket;
+	asio::streambuf request;
+	std::string response;
+
+	friend super;
+};
+
+class HttpServer : public SharedThis<HttpServer>
+{
+public:
+	void accept()
+	{
+		HttpConnection::Ptr connection = HttpConnection::create(io_context);
+		acceptor.async_accept(connection->getSocket(),
+				std::bind(&HttpServer::onAccept, shared_from_this(), connection, asio::placeholders::error));
+	}
+
+private:
+	HttpServer(asio::io_context& io_context, const asio::ip::tcp::endpoint& endpoint)
+		: io_context(io_context), acceptor(io_context, endpoint)
+	{
+	}
+
+	void onAccept(HttpConnection::Ptr connection, const std::error_code& ec)
+	{
+		if (!ec)
+			connection->start();
+		accept();
+	}
+
+	asio::io_context& io_context;
+	asio::ip::tcp::acceptor acceptor;
+
+	friend super;
+};
+
+}
+
+ThreadValues::ThreadValues()
+	: values(new std::atomic<uint64_t>[MaxSlots]())
+{
+	Registry::instance().addThread(this);
+}
+
+ThreadValues::~ThreadValues()
+{
+	Registry::instance().removeThread(this);
+	delete [] values;
+}
+
+Counter::Counter(const std::string& name, const std::string& help, const std::string& labels) {
+	slot = Registry::instance().add(name, help, Type::Counter, labels, 1);
+}
+
+Histogram::Histogram(const std::string& name, const std::string& help, const std::string& labels, double unit) {
+	slot = Registry::instance().add(name, help, Type::Histogram, labels, BucketCount + 1, unit);
+}
+
+void gauge(const std::string& name, const std::string& help, const std::string& labels, std::function<double()> value) {
+	Registry::instance().add(name, help, Type::Gauge, labels, 0, 1.0, std::move(value));
+}
+
+void gauges(const std::string& name, const std::string& help, const std::string& labels,
+		std::function<void(std::vector<Sample>&)> collect) {
+	Registry::instance().add(name, help, Type::Gauge, labels, 0, 1.0, {}, std::move(collect));
+}
+
+std::string labelValue(std::string_view value)
+{
+	std::string out;
+	for (char c : value)
+	{
+		if (c == '\\' || c == '"')
+			out += '\\';
+		if (c == '\n')
+			out += "\\n";
+		else
+			out += c;
+	}
+	return out;
+}
+
+std::string gameLabel(GameId gameId)
+{
+	const char *name = Log::getGameName(gameId);
+	return std::string("game=\"") + (name[0] == '\0' ? "none" : name) + '"';
+}
+
+GameCounter::GameCounter(const std::string& name, const std::string& help, const std::string& labels)
+{
+	for (int i = 0; i < Log::GameCount; i++)
+		counters[i] = Counter(name, help, gameLabel((GameId)(i - 1)) + (labels.empty() ? "" : "," + labels));
+}
+
+GameHistogram::GameHistogram(const std::string& name, const std::string& help)
+{
+	for (int i = 0; i < Log::GameCount; i++)
+		histograms[i] = Histogram(name, help, gameLabel((GameId)(i - 1)));
+}
+
+unsigned OpcodeCounter::createSlot(GameId gameId, unsigned opcode)
+{
+	static std::mutex mutex;
+	std::lock_guard<std::mutex> _(mutex);
+	std::atomic<unsigned>& slot = slots[(int)gameId + 1][opcode];
+	unsigned s = slot.load(std::memory_order_relaxed);
+	if (s != 0)
+		return s;
+	char label[32];
+	snprintf(label, sizeof(label), ",opcode=\"0x%02x\"", opcode);
+	s = Registry::instance().add(name, help, Type::Counter, gameLabel(gameId) + label, 1);
+	if (s == 0)
+		s = UINT_MAX;
+	slot.store(s, std::memory_order_relaxed);
+	return s;
+}
+
+std::string scrape() {
+	return Registry::instance().scrape();
+}
+
+void startServer(asio::io_context& io_context, const std::string& address, uint16_t port)
+{
+	try {
+		HttpServer::Ptr server = HttpServer::create(io_context, asio::ip::tcp::endpoint(asio::ip::make_address(address), port));
+		server->accept();
+		NOTICE_LOG(GameId::Unknown, "Metrics available at http://%s:%d/metrics", address.c_str(), port);
+	} catch (const std::exception& e) {
+		ERROR_LOG(GameId::Unknown, "Can't start the metrics server: %s", e.what());
+	}
+}
+
+OpcodeCounter PacketsReceived("iwango_packets_received_total", "Packets received by game and opcode");
+OpcodeCounter BytesReceived("iwango_received_bytes_total", "Bytes received by game and opcode");
+OpcodeCounter PacketsSent("iwango_packets_sent_total", "Packets sent by game and opcode");
+OpcodeCounter BytesSent("iwango_sent_bytes_total", "Bytes sent by game and opcode");
+GameCounter SendsDropped("iwango_sends_dropped_total", "Packets dropped because the send buffer was full");
+GameHistogram HandlerDuration("iwango_handler_duration_seconds", "Packet handler duration");
+Histogram SendQueueBytes("iwango_send_queue_bytes", "Send buffer size after a packet is queued", {}, 1.0);
+Histogram DatabaseTaskDuration("iwango_db_task_duration_seconds", "Database task duration, including the time spent in the queue");
+Counter GateAccepted("iwango_connections_accepted_total", "Accepted connections", "server=\"gate\"");
+Counter LobbyAccepted("iwango_connections_accepted_total", "Accepted connections", "server=\"lobby\"");
+Counter GateRejected("iwango_connections_rejected_total", "Failed connections and refused requests", "server=\"gate\"");
+Counter LobbyRejected("iwango_connections_rejected_total", "Failed connections and refused logins", "server=\"lobby\"");
+Histogram EventLoopLag("iwango_event_loop_lag_seconds", "Delay of the event loop probe timer");
+Counter RefreshesDeferred("iwango_refreshes_deferred_total", "List refreshes deferred because of the event loop lag");
+
+}
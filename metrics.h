@@ -0,0 +1,219 @@
+/*
+    Copyright (C) 2025  Flyinghead
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#pragma once
+#include "common.h"
+#include <dcserver/asio.hpp>
+#include <atomic>
+#include <mutex>
+#include <functional>
+#include <chrono>
+#include <climits>
+#include <vector>
+#include <string_view>
+
+//
+// Counters and histograms are written by each thread to its own values and summed when scraped.
+// Gauges are callbacks run when scraped, on the io_context thread.
+//
+namespace Metrics
+{
+constexpr unsigned MaxSlots = 16384;
+
+struct ThreadValues
+{
+	ThreadValues();
+	~ThreadValues();
+
+	std::atomic<uint64_t> *values;
+};
+
+inline std::atomic<uint64_t>& threadValue(unsigned slot)
+{
+	static thread_local ThreadValues threadValues;
+	return threadValues.values[slot];
+}
+
+// Only written by the owning thread
+inline void increment(unsigned slot, uint64_t n)
+{
+	std::atomic<uint64_t>& value = threadValue(slot);
+	value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+class Counter
+{
+public:
+	Counter() = default;
+	// labels: name="value",...
+	Counter(const std::string& name, const std::string& help, const std::string& labels = {});
+
+	void add(uint64_t n = 1) {
+		if (slot != 0)
+			increment(slot, n);
+	}
+
+private:
+	unsigned slot = 0;
+};
+
+// Log-linear buckets: 2 per power of 2, up to 2^23
+class Histogram
+{
+public:
+	static constexpr unsigned BucketCount = 48;
+
+	Histogram() = default;
+	// Values are multiplied by unit when exported. Durations are in microseconds.
+	Histogram(const std::string& name, const std::string& help, const std::string& labels = {}, double unit = 1e-6);
+
+	void observe(uint64_t value)
+	{
+		if (slot == 0)
+			return;
+		increment(slot + bucket(value), 1);
+		increment(slot + BucketCount, value);
+	}
+
+	static unsigned bucket(uint64_t value)
+	{
+		if (value < 2)
+			return value;
+		unsigned log2 = 63 - __builtin_clzll(value);
+		return std::min<unsigned>(log2 * 2 + ((value >> (log2 - 1)) & 1), BucketCount - 1);
+	}
+	// Exclusive upper bound of a bucket
+	static uint64_t bucketLimit(unsigned bucket)
+	{
+		if (bucket < 2)
+			return bucket + 1;
+		unsigned log2 = bucket / 2;
+		return (1ull << log2) + (uint64_t)(bucket % 2 + 1) * (1ull << (log2 - 1));
+	}
+
+private:
+	// Buckets followed by the sum
+	unsigned slot = 0;
+};
+
+// Scoped timer for a histogram
+class Timer
+{
+public:
+	Timer(Histogram& histogram)
+		: histogram(histogram), start(std::chrono::steady_clock::now()) {}
+	~Timer() {
+		histogram.observe(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count());
+	}
+
+private:
+	Histogram& histogram;
+	std::chrono::steady_clock::time_point start;
+};
+
+void gauge(const std::string& name, const std::string& help, const std::string& labels, std::function<double()> value);
+
+struct Sample
+{
+	std::string labels;
+	double value;
+};
+// Gauges whose series are only known when scraped. Sample labels are appended to labels.
+void gauges(const std::string& name, const std::string& help, const std::string& labels,
+		std::function<void(std::vector<Sample>&)> collect);
+// Escape a label value
+std::string labelValue(std::string_view value);
+
+// Game label value
+std::string gameLabel(GameId gameId);
+
+// A counter by game
+class GameCounter
+{
+public:
+	GameCounter(const std::string& name, const std::string& help, const std::string& labels = {});
+
+	void add(GameId gameId, uint64_t n = 1) {
+		counters[(int)gameId + 1].add(n);
+	}
+
+private:
+	Counter counters[Log::GameCount];
+};
+
+// A histogram by game
+class GameHistogram
+{
+public:
+	GameHistogram(const std::string& name, const std::string& help);
+
+	Histogram& operator[](GameId gameId) {
+		return histograms[(int)gameId + 1];
+	}
+
+private:
+	Histogram histograms[Log::GameCount];
+};
+
+// A counter by game and opcode. Series are created when first used.
+class OpcodeCounter
+{
+public:
+	OpcodeCounter(const std::string& name, const std::string& help)
+		: name(name), help(help) {}
+
+	void add(GameId gameId, uint16_t opcode, uint64_t n = 1)
+	{
+		std::atomic<unsigned>& slot = slots[(int)gameId + 1][opcode & 0xff];
+		unsigned s = slot.load(std::memory_order_relaxed);
+		if (s == 0)
+			s = createSlot(gameId, opcode & 0xff);
+		if (s != UINT_MAX)
+			increment(s, n);
+	}
+
+private:
+	unsigned createSlot(GameId gameId, unsigned opcode);
+
+	std::string name;
+	std::string help;
+	std::atomic<unsigned> slots[Log::GameCount][256] {};
+};
+
+// Prometheus text exposition format
+std::string scrape();
+
+// Serve /metrics over HTTP
+void startServer(asio::io_context& io_context, const std::string& address, uint16_t port);
+
+//
+// Server metrics
+//
+extern OpcodeCounter PacketsReceived;
+extern OpcodeCounter BytesReceived;
+extern OpcodeCounter PacketsSent;
+extern OpcodeCounter BytesSent;
+extern GameCounter SendsDropped;
+extern GameHistogram HandlerDuration;
+extern Histogram SendQueueBytes;
+extern Histogram DatabaseTaskDuration;
+extern Counter GateAccepted;
+extern Counter GateRejected;
+extern Counter LobbyAccepted;
+extern Counter LobbyRejected;
+extern Histogram EventLoopLag;
+extern Counter RefreshesDeferred;
+}
@@ -1,13 +1,21 @@
+#define LOG_SUBSYSTEM Log::Lobby
 #include "models.h"
 #include "lobby_server.h"
 #include "discord.h"
 #include "database.h"
+#include "metrics.h"
+#include "trace.h"
+#include "load_monitor.h"
 #include <dcserver/status.hpp>
+#include <cinttypes>
+#include <charconv>
 
 std::vector<LobbyServer *> LobbyServer::servers;
+Player *Player::sender;
 
 void Lobby::addPlayer(Player::Ptr player)
 {
+	Trace::Span span("broadcast", "Lobby::addPlayer", player->gameId, -1, &player->name);
 	if (members.size() == capacity) {
 		player->send(S_LOBBY_FULL);
 		return;
@@ -22,8 +30,10 @@ void Lobby::addPlayer(Player::Ptr player)
 	// Confirm Join Lobby
 	player->send(S_JOIN_LOBBY_ACK, getSjisName() + " " + player->fromUtf8(player->name));
 
-	std::vector<std::string> playerNames;
+	tmp::vector<std::string_view> playerNames(tmp::arena());
+	playerNames.reserve(members.size());
 	// Send player info to all members
+	PROBE4(broadcast, (int)player->gameId, name.c_str(), members.size() - 1, S_PLAYER_LIST_ITEM);
 	for (auto& p : members)
 	{
 		playerNames.push_back(p->name);
@@ -36,6 +46,7 @@ void Lobby::addPlayer(Player::Ptr player)
 
 void Lobby::removePlayer(Player::Ptr player)
 {
+	Trace::Span span("broadcast", "Lobby::removePlayer", player->gameId, -1, &player->name);
 	auto it = std::find(members.begin(), members.end(), player);
 	if (it != members.end())
 	{
@@ -46,6 +57,7 @@ void Lobby::removePlayer(Player::Ptr player)
 		player->send(S_LEAVE_LOBBY_ACK);
 
 		// Tell all members to remove the player
+		PROBE4(broadcast, (int)player->gameId, name.c_str(), members.size(), S_LOBBY_LEFT);
 		for (auto& p : members)
 			p->send(S_LOBBY_LEFT, p->fromUtf8(player->name));
 		if (!permanent && members.empty())
@@ -58,13 +70,16 @@ void Lobby::removePlayer(Player::Ptr player)
 
 void Lobby::sendChat(const std::string& from, const std::string& message)
 {
-	INFO_LOG(parent.getGameId(), "%s lobby chat: %s", from.c_str(), message.c_str());
+	Trace::Span span("broadcast", "Lobby::sendChat", parent.getGameId(), -1, &from);
+	SUBSYSTEM_LOG(Log::INFO, Log::Chat, parent.getGameId(), "%s lobby chat: %s", from.c_str(), message.c_str());
+	PROBE4(broadcast, (int)parent.getGameId(), name.c_str(), members.size(), S_LOBBY_CHAT);
 	for (auto& player : members)
 		player->send(S_LOBBY_CHAT, player->fromUtf8(from) + " " + player->fromUtf8(message));
 }
 
 Team::Ptr Lobby::createTeam(Player::Ptr creator, const std::string& name, unsigned capacity, const std::string& type)
 {
+	Trace::Span span("broadcast", "Lobby::createTeam", creator->gameId, -1, &creator->name);
 	Team::Ptr team = Team::create(shared_from_this(), name, capacity, creator);
 	if (type == "SPECTATOR")
 		team->flags = 2;
@@ -74,7 +89,9 @@ Team::Ptr Lobby::createTeam(Player::Ptr creator, const std::string& name, unsign
 
 	sstream ss;
 	ss << creator->fromUtf8(name) << ' ' << creator->fromUtf8(creator->name) << ' ' << capacity << ' ' << team->flags << ' ' << gameName;
-	std::vector<std::string> playerNames;
+	tmp::vector<std::string_view> playerNames(tmp::arena());
+	playerNames.reserve(members.size());
+	PROBE4(broadcast, (int)creator->gameId, this->name.c_str(), members.size(), S_NEW_TEAM);
 	for (auto& p : members) {
 		p->send(S_NEW_TEAM, ss.str());
 		playerNames.push_back(p->name);
@@ -86,10 +103,12 @@ Team::Ptr Lobby::createTeam(Player::Ptr creator, const std::string& name, unsign
 }
 void Lobby::deleteTeam(Team::Ptr team)
 {
+	Trace::Span span("broadcast", "Lobby::deleteTeam", parent.getGameId());
 	auto it = std::find(teams.begin(), teams.end(), team);
 	if (it != teams.end())
 		teams.erase(it);
 	// Tell all members to remove team
+	PROBE4(broadcast, (int)parent.getGameId(), name.c_str(), members.size(), S_TEAM_DELETED);
 	for (auto& p : members)
 		p->send(S_TEAM_DELETED, p->fromUtf8(team->name));
 	status::deleteGame(getDCNetGameId(parent.getGameId()));
@@ -111,6 +130,7 @@ std::string Lobby::getSjisName() const {
 
 void Lobby::setSharedMem(const std::string& data)
 {
+	Trace::Span span("broadcast", "Lobby::setSharedMem", parent.getGameId());
 	sharedMem = data;
 	hasSharedMem = !data.empty();
 	if (hasSharedMem)
@@ -118,12 +138,15 @@ void Lobby::setSharedMem(const std::string& data)
 		// send shared mem to lobby members
 		sstream ss;
 		ss << getSjisName() << ' ' << data;
+		PROBE4(broadcast, (int)parent.getGameId(), name.c_str(), members.size(), S_LOBBY_SHARED_MEM);
 		for (auto& p : members)
 			p->send(S_LOBBY_SHARED_MEM, ss.str());
 	}
 }
 
 void Lobby::sendSharedMemPlayer(Player::Ptr owner, const std::vector<uint8_t>& data) {
+	Trace::Span span("broadcast", "Lobby::sendSharedMemPlayer", owner->gameId, -1, &owner->name);
+	PROBE4(broadcast, (int)owner->gameId, name.c_str(), members.size(), S_PLAYER_SHARED_MEM);
 	for (auto& player : members)
 		player->send(S_PLAYER_SHARED_MEM, Packet::createSharedMemPacket(data, player->fromUtf8(owner->name)));
 }
@@ -137,10 +160,27 @@ Player::Player(LobbyConnection::Ptr connection, LobbyServer& server)
 	port = connection->getSocket().remote_endpoint().port();
 }
 
-void Player::login(const std::string& name)
+void Player::login(const std::string& name, std::function<void()> onLoaded)
 {
 	this->name = name;
-	extraUserMem = getExtraUserMem(gameId, name);
+	server.onLogin(shared_from_this());
+	extraUserMem = ExtraMemCache::get(gameId, name);
+	if (extraUserMem != nullptr) {
+		onLoaded();
+		return;
+	}
+	if (connection == nullptr)
+		return;
+	DatabaseWorker::run(connection->getIoContext(), name,
+		[gameId = gameId, name]() {
+			return ExtraMemCache::load(gameId, name);
+		},
+		[player = shared_from_this(), onLoaded](const ExtraMem& extraMem) {
+			if (player->disconnected)
+				return;
+			player->extraUserMem = extraMem;
+			onLoaded();
+		});
 }
 
 std::string Player::getIp() {
@@ -161,6 +201,12 @@ void Player::disconnect(bool sendDCPacket)
 		send(S_DO_DISCONNECT);
 
 	status::leave(getDCNetGameId(gameId), ipAddress, port, name);
+	if (!name.empty())
+		PROBE2(logout, (int)gameId, name.c_str());
+	flushExtraMem();
+	INFO_LOG(gameId, "[%s] Player %s usage: %" PRIu64 " packets, %" PRIu64 " bytes in, %" PRIu64 " bytes out, %" PRIu64 " us cpu",
+			ipAddress.c_str(), name.c_str(), usage[Accounting::PacketsIn], usage[Accounting::BytesIn],
+			usage[Accounting::BytesOut], usage[Accounting::CpuTime]);
 
 	// Remove player from everything
 	if (team) {
@@ -187,7 +233,12 @@ void Player::setSharedMem(const std::vector<uint8_t>& data)
 	}
 	memcpy(sharedMem.data(), &data[0], data.size());
 	if (lobby)
-		lobby->sendSharedMemPlayer(shared_from_this(), sharedMem);
+	{
+		if (LoadMonitor::isAtLeast(LoadMonitor::CoalesceSharedMem))
+			server.queueSharedMem(shared_from_this());
+		else
+			lobby->sendSharedMemPlayer(shared_from_this(), sharedMem);
+	}
 }
 
 std::vector<uint8_t> Player::getSendDataPacket()
@@ -270,14 +321,43 @@ void Player::leaveTeam()
 
 void Player::getExtraMem(const std::string& playerName, int offset, int length)
 {
-	extraMemPlayer = server.getPlayer(playerName);
-	if (extraMemPlayer == nullptr) {
-		WARN_LOG(gameId, "Player::getExtraMem: user %s not found", playerName.c_str());
+	if (offset < 0 || length < 0 || offset + length > ExtraUserMemSize) {
+		WARN_LOG(gameId, "Player::getExtraMem: invalid range %d-%d", offset, offset + length);
+		return;
+	}
+	ExtraMem mem = ExtraMemCache::get(gameId, playerName);
+	if (mem == nullptr)
+	{
+		Player::Ptr extraMemPlayer = server.getPlayer(playerName);
+		if (extraMemPlayer != nullptr)
+			mem = extraMemPlayer->extraUserMem;
+	}
+	if (mem != nullptr) {
+		startSendingExtraMem(mem, offset, length);
 		return;
 	}
-	if ((int)extraMemPlayer->extraUserMem.size() < offset + length)
-		extraMemPlayer->extraUserMem.resize(offset + length);
+	// Not cached: read it from the database
+	if (connection == nullptr)
+		return;
+	DatabaseWorker::run(connection->getIoContext(), playerName,
+		[gameId = gameId, playerName]() {
+			return ExtraMemCache::load(gameId, playerName);
+		},
+		[player = shared_from_this(), playerName, offset, length](const ExtraMem& mem) {
+			if (player->disconnected)
+				return;
+			if (mem->empty() && player->server.getPlayer(playerName) == nullptr) {
+				WARN_LOG(player->gameId, "Player::getExtraMem: user %s not found", playerName.c_str());
+				return;
+			}
+			player->startSendingExtraMem(mem, offset, length);
+		});
+}
+
+void Player::startSendingExtraMem(ExtraMem mem, int offset, int length)
+{
 	send(S_EXTUSER_MEM_START);
+	extraMemSent = mem;
 	extraMemOffset = offset;
 	extraMemEnd = offset + length;
 	extraMemChunkNum = 0;
@@ -285,17 +365,20 @@ void Player::getExtraMem(const std::string& playerName, int offset, int length)
 
 void Player::sendExtraMem()
 {
-	if (extraMemPlayer == nullptr)
+	if (extraMemSent == nullptr)
 		return;
-	if (extraMemOffset >= extraMemEnd || extraMemOffset >= (int)extraMemPlayer->extraUserMem.size()) {
+	if (extraMemOffset >= extraMemEnd) {
 		send(S_EXTUSER_MEM_END);
-		extraMemPlayer = nullptr;
+		extraMemSent = nullptr;
 		return;
 	}
 	int chunksz = std::min(extraMemEnd - extraMemOffset, 200);
 	std::vector<uint8_t> payload(2 + chunksz);
 	*(uint16_t *)&payload[0] = extraMemChunkNum++;
-	memcpy(&payload[2], &extraMemPlayer->extraUserMem[extraMemOffset], chunksz);
+	// missing bytes are zeroes
+	int available = std::clamp((int)extraMemSent->size() - extraMemOffset, 0, chunksz);
+	if (available > 0)
+		memcpy(&payload[2], &(*extraMemSent)[extraMemOffset], available);
 	extraMemOffset += chunksz;
 	send(S_EXTUSER_MEM_CHUNK, payload);
 }
@@ -304,19 +387,26 @@ void Player::startExtraMem(int offset, int length)
 {
 	assert(offset >= 0);
 	assert(length > 0);
-	assert(offset + length <= 0x2000);
+	assert(offset + length <= ExtraUserMemSize);
 	extraMemOffset = offset;
 	extraMemEnd = offset + length;
-	if (extraMemEnd >= (int)extraUserMem.size())
-		extraUserMem.resize(extraMemEnd);
 	send(S_EXTUSER_MEM_ACK);
 }
 void Player::setExtraMem(int index, const uint8_t *data, int size)
 {
 	if (extraMemEnd == 0)
 		return;
-	memcpy(extraUserMem.data() + extraMemOffset, data, size);
-	updateExtraUserMem(gameId, name, data, extraMemOffset, size);
+	size = std::min(size, extraMemEnd - extraMemOffset);
+	extraUserMem = ExtraMemCache::update(gameId, name, std::move(extraUserMem), extraMemOffset, data, size);
+	// Written to the database at the end of the transfer
+	if (extraMemDirtyEnd == 0) {
+		extraMemDirtyStart = extraMemOffset;
+		extraMemDirtyEnd = extraMemOffset + size;
+	}
+	else {
+		extraMemDirtyStart = std::min(extraMemDirtyStart, extraMemOffset);
+		extraMemDirtyEnd = std::max(extraMemDirtyEnd, extraMemOffset + size);
+	}
 	extraMemOffset += size;
 	if (extraMemOffset >= extraMemEnd)
 		extraMemEnd = 0;
@@ -325,9 +415,31 @@ void Player::setExtraMem(int index, const uint8_t *data, int size)
 void Player::endExtraMem()
 {
 	extraMemEnd = 0;
+	flushExtraMem();
 	send(S_EXTUSER_MEM_ACK);
 }
 
+void Player::flushExtraMem()
+{
+	if (extraMemDirtyEnd == 0)
+		return;
+	if (!name.empty())
+	{
+		std::vector<uint8_t> data(&(*extraUserMem)[extraMemDirtyStart], &(*extraUserMem)[extraMemDirtyEnd]);
+		DatabaseWorker::post(name, [gameId = gameId, name = name, offset = extraMemDirtyStart, data = std::move(data)]() {
+			updateExtraUserMem(gameId, name, data.data(), offset, data.size());
+		});
+	}
+	extraMemDirtyStart = 0;
+	extraMemDirtyEnd = 0;
+}
+
+void Player::account(Accounting::Resource resource, uint64_t n)
+{
+	usage[resource] += n;
+	server.getUsage().add(name, ipAddress, resource, n);
+}
+
 int Player::send(uint16_t opcode, const uint8_t *payload, unsigned length)
 {
 	if (connection == nullptr) {
@@ -336,6 +448,10 @@ int Player::send(uint16_t opcode, const uint8_t *payload, unsigned length)
 	}
 	std::vector<uint8_t> data = makePacket(opcode, payload, length);
 	connection->send(data);
+	Metrics::PacketsSent.add(gameId, opcode);
+	Metrics::BytesSent.add(gameId, opcode, data.size());
+	if (sender != nullptr)
+		sender->account(Accounting::BytesOut, data.size());
 	return data.size();
 }
 
@@ -354,20 +470,35 @@ std::vector<uint8_t> Player::makePacket(uint16_t opcode, const uint8_t *payload,
 	return data;
 }
 
-void Player::receive(uint16_t opcode, const std::vector<uint8_t> payload) {
+void Player::dumpFlightRecorder(const char *reason)
+{
+	if (connection != nullptr)
+		connection->dumpFlightRecorder(reason);
+}
+
+void Player::printFlightRecorder(FILE *f)
+{
+	if (connection == nullptr)
+		return;
+	fprintf(f, "# %s %s:%d %s\n", Log::getGameName(gameId), ipAddress.c_str(), port, name.c_str());
+	connection->getFlightRecorder().print(f);
+}
+
+void Player::receive(uint16_t opcode, const std::vector<uint8_t>& payload) {
 	PacketProcessor::handlePacket(shared_from_this(), opcode, payload);
 }
 
-std::string Player::toUtf8(const std::string& str) const {
+std::string Player::toUtf8(std::string_view str) const {
 	return sjisToUtf8(str);
 }
 
-std::string Player::fromUtf8(const std::string& str) const {
+std::string Player::fromUtf8(std::string_view str) const {
 	return utf8ToSjis(str, gameId == GameId::GolfShiyouyo || gameId == GameId::CuldCept || gameId == GameId::RuneJade);
 }
 
 bool Team::addPlayer(Player::Ptr player, bool spectator)
 {
+	Trace::Span span("broadcast", "Team::addPlayer", player->gameId, -1, &player->name);
 	if (!spectator && members.size() == capacity)
 		return false;
 	members.push_back(player);
@@ -379,6 +510,7 @@ bool Team::addPlayer(Player::Ptr player, bool spectator)
 		ss << ' ' << p->name;
 
 	// Send packet to all members
+	PROBE4(broadcast, (int)player->gameId, player->lobby->name.c_str(), player->lobby->members.size(), S_TEAM_JOINED);
 	for (auto& p : player->lobby->members)
 		p->send(S_TEAM_JOINED, p->fromUtf8(ss.str()));
 
@@ -387,6 +519,7 @@ bool Team::addPlayer(Player::Ptr player, bool spectator)
 
 bool Team::removePlayer(Player::Ptr player)
 {
+	Trace::Span span("broadcast", "Team::removePlayer", player->gameId, -1, &player->name);
 	auto it = std::find(members.begin(), members.end(), player);
 	if (it != members.end())
 	{
@@ -400,6 +533,7 @@ bool Team::removePlayer(Player::Ptr player)
 		// FIXME player->lobby is null! yes, lobby can be null, not sure how
 		if (player->lobby != nullptr)
 		{
+			PROBE4(broadcast, (int)player->gameId, player->lobby->name.c_str(), player->lobby->members.size(), S_TEAM_LEFT);
 			for (auto& p : player->lobby->members)
 				p->send(S_TEAM_LEFT, p->fromUtf8(name + " " + player->name));
 		}
@@ -427,11 +561,27 @@ void Team::sendGameServer(Player::Ptr p)
 }
 
 LobbyServer::LobbyServer(GameId gameId, const std::string& name)
-	: gameId(gameId)
+	: gameId(gameId), usage(gameId)
 {
 	if (!name.empty())
 		this->name = name;
 	servers.push_back(this);
+	anonymousHandles.setCapacity(std::stoi(getConfig("AnonymousHandleCount", "99")));
+	portOffset = std::stoi(getConfig("LobbyPortOffset", "0"));
+	std::string label = Metrics::gameLabel(gameId);
+	Metrics::gauge("iwango_players", "Connected players", label, [this]() {
+		return players.size();
+	});
+	Metrics::gauge("iwango_lobbies", "Lobbies", label, [this]() {
+		return lobbies.size();
+	});
+	Metrics::gauge("iwango_teams", "Teams", label, [this]() {
+		size_t teams = 0;
+		for (const Lobby::Ptr& lobby : lobbies)
+			teams += lobby->teams.size();
+		return teams;
+	});
+	usage.registerMetrics();
 	switch (gameId)
 	{
 	case GameId::AeroDancingI:
@@ -501,22 +651,145 @@ LobbyServer::LobbyServer(GameId gameId, const std::string& name)
 	}
 }
 
+void LobbyServer::flushSharedMem()
+{
+	std::vector<Player::Ptr> pending;
+	pending.swap(pendingSharedMem);
+	for (auto& player : pending)
+	{
+		player->sharedMemPending = false;
+		if (player->lobby != nullptr && !player->isDisconnected())
+			player->lobby->sendSharedMemPlayer(player, player->sharedMem);
+	}
+}
+
+void LobbyServer::dumpFlightRecorders()
+{
+	std::string path;
+	FILE *f = FlightRecorder::createFile("", path);
+	if (f == nullptr)
+		return;
+	fprintf(f, "# time opcode length data\n");
+	for (LobbyServer *server : servers)
+		for (auto& player : server->players)
+			player->printFlightRecorder(f);
+	fclose(f);
+	NOTICE_LOG(GameId::Unknown, "Flight recorders saved to %s", path.c_str());
+}
+
+std::string LobbyServer::reserveAnonymousHandle(const std::vector<uint64_t>& remoteHandles)
+{
+	for (;;)
+	{
+		std::string handle = anonymousHandles.reserve(remoteHandles);
+		if (handle.empty() || getPlayer(handle) == nullptr)
+			return handle;
+		// Used by a registered user: taken until this player leaves
+		anonymousHandles.login(handle);
+	}
+}
+
+void AnonymousHandles::setCapacity(unsigned capacity)
+{
+	usedBits.assign((capacity + 63) / 64, 0);
+	// Bits past the capacity are never free
+	if (capacity % 64 != 0)
+		usedBits.back() = ~0ull << (capacity % 64);
+	states.assign(capacity, Free);
+	reservationTimes.assign(capacity, {});
+	reservations.clear();
+}
+
+std::string AnonymousHandles::reserve(const std::vector<uint64_t>& remoteBits)
+{
+	expireReservations();
+	for (unsigned i = 0; i < usedBits.size(); i++)
+	{
+		uint64_t used = usedBits[i] | (i < remoteBits.size() ? remoteBits[i] : 0);
+		if (used == ~0ull)
+			continue;
+		unsigned slot = i * 64 + __builtin_ctzll(~used);
+		usedBits[i] |= 1ull << (slot % 64);
+		states[slot] = Reserved;
+		reservationTimes[slot] = the_clock::now();
+		reservations.push_back({ slot, reservationTimes[slot] });
+		return "Player" + std::to_string(slot + 1);
+	}
+	return {};
+}
+
+std::vector<uint64_t> AnonymousHandles::getLoggedIn() const
+{
+	std::vector<uint64_t> bits(usedBits.size());
+	for (unsigned slot = 0; slot < states.size(); slot++)
+		if (states[slot] == LoggedIn)
+			bits[slot / 64] |= 1ull << (slot % 64);
+	return bits;
+}
+
+void AnonymousHandles::login(const std::string& name)
+{
+	int slot = getSlot(name);
+	if (slot < 0)
+		return;
+	usedBits[slot / 64] |= 1ull << (slot % 64);
+	states[slot] = LoggedIn;
+}
+
+void AnonymousHandles::logout(const std::string& name)
+{
+	int slot = getSlot(name);
+	if (slot < 0 || states[slot] != LoggedIn)
+		return;
+	usedBits[slot / 64] &= ~(1ull << (slot % 64));
+	states[slot] = Free;
+}
+
+int AnonymousHandles::getSlot(const std::string& name) const
+{
+	if (name.length() <= 6 || name.length() > 16 || name.compare(0, 6, "Player") != 0
+			|| name[6] == '0' || name.find_first_not_of("0123456789", 6) != std::string::npos)
+		return -1;
+	unsigned number;
+	auto [end, ec] = std::from_chars(name.data() + 6, name.data() + name.length(), number);
+	if (ec != std::errc() || number > states.size())
+		return -1;
+	return number - 1;
+}
+
+void AnonymousHandles::expireReservations()
+{
+	const the_clock::time_point expired = the_clock::now() - std::chrono::seconds(60);
+	while (!reservations.empty() && reservations.front().time < expired)
+	{
+		const Reservation& res = reservations.front();
+		// Ignore reservations that have been replaced or used
+		if (states[res.slot] == Reserved && reservationTimes[res.slot] == res.time) {
+			usedBits[res.slot / 64] &= ~(1ull << (res.slot % 64));
+			states[res.slot] = Free;
+		}
+		reservations.pop_front();
+	}
+}
+
 uint16_t LobbyServer::getIpPort() const
 {
+	uint16_t port;
 	switch (gameId)
 	{
-	case GameId::Daytona: return 9501;
-	case GameId::Tetris: return 9502;
-	case GameId::GolfShiyouyo: return 9503;
-	case GameId::AeroDancingI: return 9504;
-	case GameId::HundredSwords: return 9505;
-	case GameId::AeroDancingF: return 9506;
-	case GameId::CuldCept: return 9507;
-	case GameId::PowerSmash: return 9508;
-	case GameId::YakyuuTeam: return 9509;
-	case GameId::RuneJade: return 9510;
+	case GameId::Daytona: port = 9501; break;
+	case GameId::Tetris: port = 9502; break;
+	case GameId::GolfShiyouyo: port = 9503; break;
+	case GameId::AeroDancingI: port = 9504; break;
+	case GameId::HundredSwords: port = 9505; break;
+	case GameId::AeroDancingF: port = 9506; break;
+	case GameId::CuldCept: port = 9507; break;
+	case GameId::PowerSmash: port = 9508; break;
+	case GameId::YakyuuTeam: port = 9509; break;
+	case GameId::RuneJade: port = 9510; break;
 	default: assert(false); return 0;
 	}
+	return port + portOffset;
 }
 
 std::string LobbyServer::getGameName() const
@@ -1,5 +1,8 @@
 #pragma once
 #include "common.h"
+#include "database.h"
+#include "accounting.h"
+#include "probes.h"
 #include <dcserver/shared_this.hpp>
 #include <string>
 #include <memory>
@@ -9,6 +12,9 @@
 #include <sstream>
 #include <cassert>
 #include <algorithm>
+#include <functional>
+#include <deque>
+#include <chrono>
 
 enum SRVOpcode : uint16_t
 {
@@ -116,11 +122,13 @@ private:
 class Player : public SharedThis<Player>
 {
 public:
-	void login(const std::string& name);
+	// onLoaded is called once the player's data has been loaded from the database
+	void login(const std::string& name, std::function<void()> onLoaded);
 	std::string getIp();
 	std::array<uint8_t, 4> getIpBytes();
 	int getPort() const { return port; };
 	void disconnect(bool sendDCPacket = true);
+	bool isDisconnected() const { return disconnected; }
 	void setSharedMem(const std::vector<uint8_t>& data);
 	std::vector<uint8_t> getSendDataPacket();
 
@@ -157,17 +165,22 @@ public:
 	void startExtraMem(int offset, int length);
 	void setExtraMem(int index, const uint8_t *data, int size);
 	void endExtraMem();
-
-	int send(uint16_t opcode, const std::string& payload = {}) {
-		//printf("send: %04x [%s]\n", opcode, payload.c_str());
-		return send(opcode, (const uint8_t *)&payload[0], payload.length());
+	// Save the uploaded extra mem bytes that haven't been written yet
+	void flushExtraMem();
+	void account(Accounting::Resource resource, uint64_t n);
+	// Save the last packets of the connection after a protocol error
+	void dumpFlightRecorder(const char *reason);
+	void printFlightRecorder(FILE *f);
+
+	int send(uint16_t opcode, std::string_view payload = {}) {
+		return send(opcode, (const uint8_t *)payload.data(), payload.length());
 	}
 	int send(uint16_t opcode, const std::vector<uint8_t>& payload) {
 		return send(opcode, &payload[0], payload.size());
 	}
-	void receive(uint16_t opcode, const std::vector<uint8_t> payload);
-	std::string toUtf8(const std::string& str) const;
-	std::string fromUtf8(const std::string& str) const;
+	void receive(uint16_t opcode, const std::vector<uint8_t>& payload);
+	std::string toUtf8(std::string_view str) const;
+	std::string fromUtf8(std::string_view str) const;
 
 	std::string name;
 	unsigned flags = 0;
@@ -175,22 +188,30 @@ public:
 	Lobby::Ptr lobby;
 	std::shared_ptr<Team> team;
 	bool spectator = false;
+	// Shared mem update waiting to be sent to the lobby
+	bool sharedMemPending = false;
+	Accounting::Usage usage {};
+	// Player whose packet is being handled, charged for the packets sent
+	static Player *sender;
 	GameId gameId;
 	LobbyServer& server;
 
 private:
 	Player(std::shared_ptr<LobbyConnection> connection, LobbyServer& server);
 	int send(uint16_t opcode, const uint8_t *payload, unsigned length);
+	void startSendingExtraMem(ExtraMem mem, int offset, int length);
 	std::vector<uint8_t> makePacket(uint16_t opcode, const uint8_t *payload, unsigned length);
 
 	bool disconnected = false;
 	std::shared_ptr<LobbyConnection> connection;
 	std::vector<uint8_t> lastRecvPacket;
-	std::vector<uint8_t> extraUserMem;
+	ExtraMem extraUserMem;
 	int extraMemOffset = 0;
 	int extraMemEnd = 0;
 	int extraMemChunkNum = 0;
-	Player::Ptr extraMemPlayer;
+	ExtraMem extraMemSent;	// extra mem being sent to this player
+	int extraMemDirtyStart = 0;
+	int extraMemDirtyEnd = 0;
 	std::string ipAddress;
 	std::array<uint8_t, 4> ipBytes;
 	int port = 0;
@@ -203,6 +224,7 @@ public:
 	void setSharedMem(std::string memAsStr)
 	{
 		sharedMem = memAsStr;
+		PROBE4(broadcast, (int)host->gameId, name.c_str(), members.size(), S_TEAM_SHARED_MEM);
 		for (auto& player : members)
 			player->send(S_TEAM_SHARED_MEM, player->fromUtf8(name) + " " + sharedMem);
 	}
@@ -212,6 +234,7 @@ public:
 	void sendChat(const std::string& from, const std::string& message)
 	{
 		INFO_LOG(host->gameId, "%s team chat: %s", from.c_str(), message.c_str());
+		PROBE4(broadcast, (int)host->gameId, name.c_str(), members.size(), S_TEAM_CHAT);
 		for (auto& player : members)
 			player->send(S_TEAM_CHAT, player->fromUtf8(from + " " + message));
 	}
@@ -244,6 +267,42 @@ private:
 	friend super;
 };
 
+//
+// PlayerN handles given to anonymous users. A handle is reserved when the gate assigns it
+// and stays used while a player is logged in with it. Reservations expire if nobody logs in.
+// Handles used by other instances are reported to the gate as bitmaps, bit i being Player<i+1>.
+//
+class AnonymousHandles
+{
+public:
+	void setCapacity(unsigned capacity);
+	// Returns the lowest handle free here and in remoteBits, or an empty string if all are used
+	std::string reserve(const std::vector<uint64_t>& remoteBits);
+	// Handles of the logged in players
+	std::vector<uint64_t> getLoggedIn() const;
+	// Other names are ignored
+	void login(const std::string& name);
+	void logout(const std::string& name);
+
+private:
+	using the_clock = std::chrono::steady_clock;
+	// -1 if not a PlayerN handle
+	int getSlot(const std::string& name) const;
+	void expireReservations();
+
+	enum State : uint8_t { Free, Reserved, LoggedIn };
+	struct Reservation
+	{
+		unsigned slot;
+		the_clock::time_point time;
+	};
+
+	std::vector<uint64_t> usedBits;	// slot i is Player<i+1>
+	std::vector<State> states;
+	std::vector<the_clock::time_point> reservationTimes;
+	std::deque<Reservation> reservations;
+};
+
 class LobbyServer
 {
 public:
@@ -300,11 +359,27 @@ public:
 	void addPlayer(Player::Ptr player) {
 		players.push_back(player);
 	}
+	unsigned getPlayerCount() const {
+		return players.size();
+	}
 	void removePlayer(Player::Ptr player)
 	{
 		auto it = std::find(players.begin(), players.end(), player);
-		if (it != players.end())
+		if (it != players.end()) {
 			players.erase(it);
+			onLogout(player);
+		}
+	}
+	void onLogin(Player::Ptr player) {
+		anonymousHandles.login(player->name);
+	}
+	void onLogout(Player::Ptr player) {
+		anonymousHandles.logout(player->name);
+	}
+	// Handles logged in on other instances are skipped
+	std::string reserveAnonymousHandle(const std::vector<uint64_t>& remoteHandles = {});
+	std::vector<uint64_t> getAnonymousHandles() const {
+		return anonymousHandles.getLoggedIn();
 	}
 
 	const std::string& getName() const {
@@ -325,6 +400,46 @@ public:
 		this->motd = motd;
 	}
 
+	void flushExtraMem()
+	{
+		for (auto& player : players)
+			player->flushExtraMem();
+	}
+	static void flushAllExtraMem()
+	{
+		for (LobbyServer *server : servers)
+			server->flushExtraMem();
+	}
+
+	void queueSharedMem(Player::Ptr player)
+	{
+		if (!player->sharedMemPending) {
+			player->sharedMemPending = true;
+			pendingSharedMem.push_back(player);
+		}
+	}
+	void flushSharedMem();
+	static void flushAllSharedMem()
+	{
+		for (LobbyServer *server : servers)
+			server->flushSharedMem();
+	}
+
+	// Save the last packets of all connections to a single file
+	static void dumpFlightRecorders();
+
+	Accounting::GameUsage& getUsage() {
+		return usage;
+	}
+	static void endAccountingPeriod()
+	{
+		for (LobbyServer *server : servers)
+			server->usage.endPeriod();
+	}
+
+	static const std::vector<LobbyServer *>& getServers() {
+		return servers;
+	}
 	static LobbyServer *getServer(GameId gameId)
 	{
 		for (LobbyServer *server : servers)
@@ -340,5 +455,9 @@ private:
 	std::string motd = "Welcome to IWANGO Emulator by Ioncannon";
 	std::vector<Player::Ptr> players;
 	std::vector<Lobby::Ptr> lobbies;
+	std::vector<Player::Ptr> pendingSharedMem;
+	AnonymousHandles anonymousHandles;
+	Accounting::GameUsage usage;
+	uint16_t portOffset = 0;
 	static std::vector<LobbyServer *> servers;
 };
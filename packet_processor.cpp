@@ -1,7 +1,13 @@
+#define LOG_SUBSYSTEM Log::Lobby
 #include "lobby_server.h"
 #include "models.h"
 #include "common.h"
 #include "discord.h"
+#include "metrics.h"
+#include "trace.h"
+#include "load_monitor.h"
+#include "probes.h"
+#include "alloc_profile.h"
 #include <dcserver/status.hpp>
 #include <unordered_map>
 #include <sys/time.h>
@@ -54,25 +60,38 @@ enum CLIOpcode : uint16_t
 	RJ_REQUEST_RANKING = 0x6b,
 };
 
-static void loginCommand(Player::Ptr player, const std::vector<uint8_t>&, const std::string& dataAsString)
+static void loginCommand(Player::Ptr player, const std::vector<uint8_t>&, std::string_view dataAsString)
 {
-	std::vector<std::string> split = splitString(dataAsString, ' ');
+	tmp::vector<std::string_view> split = tmp::split(dataAsString, ' ');
 	std::string userName = player->toUtf8(split[0]);
 	if (userName.empty())
 	{
 		// FIXME not working no matter what I send...
+		Metrics::LobbyRejected.add();
 		player->send(S_TEAM_NAME_EXISTS, "Empty handle");
 	    player->send(0xE3);
 	    player->send(S_DISCONNECTED);
 	    player->disconnect(false);
 		return;
 	}
-	player->login(userName);
+	if (LoadMonitor::isAtLeast(LoadMonitor::RefuseLogin))
+	{
+		WARN_LOG(player->gameId, "[%s] Server busy: login of %s refused", player->getIp().c_str(), userName.c_str());
+		Metrics::LobbyRejected.add();
+		// auth error 16: line busy
+		player->send(0x0C, "1 16 0 Busy");
+		player->send(0xE3);
+		player->send(S_DISCONNECTED);
+		player->disconnect(false);
+		return;
+	}
 	// Daytona (US) allowed characters (when searching): A-Za-z0-9_-
 
 	// Is this handle already in the server? Handle is used as a key and HAS to be unique.
 	Player::Ptr exists = player->server.getPlayer(userName, player);
 	if (exists != nullptr) {
+		// Must be saved before this player data is reloaded
+		exists->flushExtraMem();
 		exists->name = "";
 		exists->disconnect();
 	}
@@ -81,29 +100,36 @@ static void loginCommand(Player::Ptr player, const std::vector<uint8_t>&, const
 #ifdef NDEBUG
 	exists = player->server.IsIPUnique(player);
 	if (exists != nullptr) {
+		exists->flushExtraMem();
+		// Free its PlayerN handle before the name is cleared
+		player->server.onLogout(exists);
 		exists->name = "";
 		exists->disconnect();
 	}
 #endif
-	INFO_LOG(player->gameId, "[%s] Player %s logged in", player->getIp().c_str(), player->name.c_str());
-	// We are good to continue
-	time_t now;
-	time(&now);
-	struct tm *tm = localtime(&now);
-	sstream ss;
-	ss << "0100 0102 " << (tm->tm_year + 1900)
-	   << ":" << (tm->tm_mon + 1)
-	   << ":" << tm->tm_mday
-	   << ":" << tm->tm_hour
-	   << ":" << tm->tm_min
-	   << ":" << tm->tm_sec;
-	player->send(S_LOGIN_OK, ss.str());
-	status::join(getDCNetGameId(player->gameId), player->getIp(), player->getPort(), player->name);
-}
-
-static void login2Command(Player::Ptr player, const std::vector<uint8_t>&, const std::string& dataAsString)
+	// The login is acknowledged once the player data is loaded
+	player->login(userName, [player]() {
+		INFO_LOG(player->gameId, "[%s] Player %s logged in", player->getIp().c_str(), player->name.c_str());
+		// We are good to continue
+		time_t now;
+		time(&now);
+		struct tm *tm = localtime(&now);
+		sstream ss;
+		ss << "0100 0102 " << (tm->tm_year + 1900)
+		   << ":" << (tm->tm_mon + 1)
+		   << ":" << tm->tm_mday
+		   << ":" << tm->tm_hour
+		   << ":" << tm->tm_min
+		   << ":" << tm->tm_sec;
+		player->send(S_LOGIN_OK, ss.str());
+		PROBE2(login, (int)player->gameId, player->name.c_str());
+		status::join(getDCNetGameId(player->gameId), player->getIp(), player->getPort(), player->name);
+	});
+}
+
+static void login2Command(Player::Ptr player, const std::vector<uint8_t>&, std::string_view dataAsString)
 {
-	std::vector<std::string> split = splitString(dataAsString, ' ');
+	tmp::vector<std::string_view> split = tmp::split(dataAsString, ' ');
 	// args:
 	// 0	:key user id
 	// 1	":dummy"
@@ -112,7 +138,10 @@ static void login2Command(Player::Ptr player, const std::vector<uint8_t>&, const
 	// 4	:1
 	// 5	:0 or :1 (handle index?)
 	if (split.size() > 3)
-		INFO_LOG(player->gameId, "[%s] Player %s console ID: %s", player->getIp().c_str(), player->name.c_str(), split[3].substr(1).c_str());
+	{
+		std::string consoleId(split[3].substr(1));
+		INFO_LOG(player->gameId, "[%s] Player %s console ID: %s", player->getIp().c_str(), player->name.c_str(), consoleId.c_str());
+	}
 	// response:
 	// 0	auth status (0 is success)
 	// 1	error num (0 is success, 1 banned user, 8 server maintenance, 16 line busy, ...)
@@ -123,9 +152,9 @@ static void login2Command(Player::Ptr player, const std::vector<uint8_t>&, const
 	player->send(S_EXT_MEM_READY);
 }
 
-static void refreshPlayersCommand(Player::Ptr player, const std::vector<uint8_t>&, const std::string& dataAsString)
+static void refreshPlayersCommand(Player::Ptr player, const std::vector<uint8_t>&, std::string_view dataAsString)
 {
-	std::vector<std::string> split = splitString(dataAsString, ' ');
+	tmp::vector<std::string_view> split = tmp::split(dataAsString, ' ');
 	if (split[0].empty())
 	{
 		// Get all players
@@ -155,26 +184,25 @@ static void sendLobby(Player::Ptr player, uint16_t opcode, Lobby::Ptr lobby)
 	player->send(opcode, ss.str());
 }
 
-static void refreshLobbiesCommand(Player::Ptr player, const std::vector<uint8_t>&, const std::string& dataAsString)
+static void refreshLobbiesCommand(Player::Ptr player, const std::vector<uint8_t>&, std::string_view dataAsString)
 {
-	std::vector<std::string> split = splitString(dataAsString, ' ');
 	const std::vector<Lobby::Ptr>& lobbies = player->server.getLobbyList();
 	for (auto& lobby : lobbies)
 		sendLobby(player, S_LOBBY_LIST_ITEM, lobby);
 	player->send(S_LOBBY_LIST_END);
 }
 
-static void createOrJoinLobby(Player::Ptr player, const std::vector<uint8_t>&, const std::string& dataAsString)
+static void createOrJoinLobby(Player::Ptr player, const std::vector<uint8_t>&, std::string_view dataAsString)
 {
 	// name capacity [type]
 	// types: RRT (0x2000), GROUP (0x800), ARCADE (0x10), TOURNAMENT (4)
-	std::vector<std::string> split = splitString(dataAsString, ' ');
+	tmp::vector<std::string_view> split = tmp::split(dataAsString, ' ');
 	if (split.size() < 2 || split.size() > 3) {
 		ERROR_LOG(player->gameId, "[%s] ENTR_LOBBY: bad arg count %zd", player->name.c_str(), split.size());
 		return;
 	}
 	std::string lobbyName = player->toUtf8(split[0]);
-	uint16_t capacity = atoi(split[1].c_str());
+	uint16_t capacity = parseInt(split[1]);
 	Lobby::Ptr lobby = player->server.getLobby(lobbyName);
 	if (lobby == nullptr)
 	{
@@ -187,15 +215,14 @@ static void createOrJoinLobby(Player::Ptr player, const std::vector<uint8_t>&, c
 		player->joinLobby(lobby);
 }
 
-static void leaveLobbyCommand(Player::Ptr player, const std::vector<uint8_t>&, const std::string& dataAsString) {
+static void leaveLobbyCommand(Player::Ptr player, const std::vector<uint8_t>&, std::string_view dataAsString) {
 	player->leaveLobby();
 }
 
-static void refreshTeamsCommand(Player::Ptr player, const std::vector<uint8_t>&, const std::string& dataAsString)
+static void refreshTeamsCommand(Player::Ptr player, const std::vector<uint8_t>&, std::string_view dataAsString)
 {
 	if (player->lobby != nullptr)
 	{
-		std::vector<std::string> split = splitString(dataAsString, ' ');
 		for (Team::Ptr& team : player->lobby->teams)
         {
 			sstream ss;
@@ -222,59 +249,60 @@ static void refreshTeamsCommand(Player::Ptr player, const std::vector<uint8_t>&,
 	player->send(S_TEAM_LIST_END);
 }
 
-static void createTeamCommand(Player::Ptr player, const std::vector<uint8_t>&, const std::string& dataAsString)
+static void createTeamCommand(Player::Ptr player, const std::vector<uint8_t>&, std::string_view dataAsString)
 {
-	std::vector<std::string> split = splitString(dataAsString, ' ');
+	tmp::vector<std::string_view> split = tmp::split(dataAsString, ' ');
 	if (split.size() == 3)
 	{
-		unsigned capacity = atoi(split[0].c_str());
+		unsigned capacity = parseInt(split[0]);
 		if (player->lobby != nullptr)
-			player->createTeam(player->toUtf8(split[1]), capacity, split[2]);
+			player->createTeam(player->toUtf8(split[1]), capacity, std::string(split[2]));
 		else
 			player->disconnect();
 	}
 }
 
-static void joinTeamCommand(Player::Ptr player, const std::vector<uint8_t>&, const std::string& dataAsString)
+static void joinTeamCommand(Player::Ptr player, const std::vector<uint8_t>&, std::string_view dataAsString)
 {
-	std::vector<std::string> split = splitString(dataAsString, ' ');
+	tmp::vector<std::string_view> split = tmp::split(dataAsString, ' ');
 	player->joinTeam(player->toUtf8(split[0]), false);
 }
-static void joinTeamSpecCommand(Player::Ptr player, const std::vector<uint8_t>&, const std::string& dataAsString)
+static void joinTeamSpecCommand(Player::Ptr player, const std::vector<uint8_t>&, std::string_view dataAsString)
 {
-	std::vector<std::string> split = splitString(dataAsString, ' ');
+	tmp::vector<std::string_view> split = tmp::split(dataAsString, ' ');
 	player->joinTeam(player->toUtf8(split[0]), true);
 }
 
-static void leaveTeamCommand(Player::Ptr player, const std::vector<uint8_t>&, const std::string& dataAsString) {
+static void leaveTeamCommand(Player::Ptr player, const std::vector<uint8_t>&, std::string_view dataAsString) {
 	player->leaveTeam();
 }
 
-static void refreshGamesCommand(Player::Ptr player, const std::vector<uint8_t>&, const std::string& dataAsString)
+static void refreshGamesCommand(Player::Ptr player, const std::vector<uint8_t>&, std::string_view dataAsString)
 {
 	player->send(S_GAME_LIST_ITEM, "1 " + player->server.getGameName());
 	player->send(S_GAME_LIST_END);
 }
 
-static void selectGameCommand(Player::Ptr player, const std::vector<uint8_t>&, const std::string& dataAsString)
+static void selectGameCommand(Player::Ptr player, const std::vector<uint8_t>&, std::string_view dataAsString)
 {
-	std::vector<std::string> split = splitString(dataAsString, ' ');
-	std::string& gameName = split[0];
-	player->send(S_GAME_SEL_ACK, player->fromUtf8(player->name) + " " + gameName);
+	tmp::vector<std::string_view> split = tmp::split(dataAsString, ' ');
+	std::string payload = player->fromUtf8(player->name) + ' ';
+	payload += split[0];	// game name
+	player->send(S_GAME_SEL_ACK, payload);
 }
 
-static void getLicenseCommand(Player::Ptr player, const std::vector<uint8_t>&, const std::string& dataAsString) {
+static void getLicenseCommand(Player::Ptr player, const std::vector<uint8_t>&, std::string_view dataAsString) {
 	player->send(S_LICENSE, "ABCDEFGHI");
 }
 
-static void getExtraUserMem(Player::Ptr player, const std::vector<uint8_t>&, const std::string& dataAsString)
+static void getExtraUserMem(Player::Ptr player, const std::vector<uint8_t>&, std::string_view dataAsString)
 {
-	std::vector<std::string> split = splitString(dataAsString, ' ');
+	tmp::vector<std::string_view> split = tmp::split(dataAsString, ' ');
 	if (split.size() == 3)
 	{
 		std::string playerName = player->toUtf8(split[0]);
-		int offset = atoi(split[1].c_str());
-		int length = atoi(split[2].c_str());
+		int offset = parseInt(split[1]);
+		int length = parseInt(split[2]);
 		player->getExtraMem(playerName, offset, length);
 		/* tetris
 		uint8_t mem[] {
@@ -288,11 +316,11 @@ static void getExtraUserMem(Player::Ptr player, const std::vector<uint8_t>&, con
 	}
 }
 
-static void extraMemAck(Player::Ptr player, const std::vector<uint8_t>&, const std::string& dataAsString) {
+static void extraMemAck(Player::Ptr player, const std::vector<uint8_t>&, std::string_view dataAsString) {
 	player->sendExtraMem();
 }
 
-static void registerExtraUserMemStart(Player::Ptr player, const std::vector<uint8_t>& data, const std::string&)
+static void registerExtraUserMemStart(Player::Ptr player, const std::vector<uint8_t>& data, std::string_view)
 {
 	if (data.size() == 8)
 	{
@@ -301,20 +329,20 @@ static void registerExtraUserMemStart(Player::Ptr player, const std::vector<uint
 		player->startExtraMem(offset, length);
 	}
 }
-static void registerExtraUserMemData(Player::Ptr player, const std::vector<uint8_t>&data, const std::string&) {
+static void registerExtraUserMemData(Player::Ptr player, const std::vector<uint8_t>&data, std::string_view) {
 	player->setExtraMem(*(uint16_t *)&data[0], &data[2], data.size() - 2);
 }
-static void registerExtraUserMemEnd(Player::Ptr player, const std::vector<uint8_t>&, const std::string&) {
+static void registerExtraUserMemEnd(Player::Ptr player, const std::vector<uint8_t>&, std::string_view) {
 	player->endExtraMem();
 }
 
-static void chatLobbyCommand(Player::Ptr player, const std::vector<uint8_t>&, const std::string& dataAsString)
+static void chatLobbyCommand(Player::Ptr player, const std::vector<uint8_t>&, std::string_view dataAsString)
 {
 	auto pos = dataAsString.find(' ');
 	if (pos == std::string::npos)
 		return;
 	std::string recipientName = player->toUtf8(dataAsString.substr(0, pos));
-	std::string message = dataAsString.substr(pos + 1);
+	std::string_view message = dataAsString.substr(pos + 1);
 	if (!recipientName.empty() && recipientName[0] == '#')
 	{
 		// general lobby message
@@ -325,58 +353,61 @@ static void chatLobbyCommand(Player::Ptr player, const std::vector<uint8_t>&, co
 	{
 		// private DM message
 		Player::Ptr recipient = player->server.getPlayer(recipientName);
-		if (recipient != nullptr)
-			recipient->send(S_LOBBY_DM, recipient->fromUtf8(player->name) + " " + message);
+		if (recipient != nullptr) {
+			std::string payload = recipient->fromUtf8(player->name) + ' ';
+			payload += message;
+			recipient->send(S_LOBBY_DM, payload);
+		}
 		else
 			WARN_LOG(player->gameId, "Unknown private lobby DM recipient: %s", recipientName.c_str());
 	}
 }
 
-static void chatTeamCommand(Player::Ptr player, const std::vector<uint8_t>&, const std::string& dataAsString) {
+static void chatTeamCommand(Player::Ptr player, const std::vector<uint8_t>&, std::string_view dataAsString) {
 	if (player->team != nullptr)
 		player->team->sendChat(player->name, player->toUtf8(dataAsString));
 }
 
-static void sharedMemLobbyCommand(Player::Ptr player, const std::vector<uint8_t>&, const std::string& dataAsString) {
+static void sharedMemLobbyCommand(Player::Ptr player, const std::vector<uint8_t>&, std::string_view dataAsString) {
 	if (player->lobby != nullptr)
-		player->lobby->setSharedMem(dataAsString);
+		player->lobby->setSharedMem(std::string(dataAsString));
 }
 
-static void sharedMemPlayerCommand(Player::Ptr player, const std::vector<uint8_t>& data, const std::string&) {
+static void sharedMemPlayerCommand(Player::Ptr player, const std::vector<uint8_t>& data, std::string_view) {
 	player->setSharedMem(data);
 }
 
-static void sharedMemTeamCommand(Player::Ptr player, const std::vector<uint8_t>&, const std::string& dataAsString)
+static void sharedMemTeamCommand(Player::Ptr player, const std::vector<uint8_t>&, std::string_view dataAsString)
 {
-	std::vector<std::string> split = splitString(dataAsString, ' ');
+	tmp::vector<std::string_view> split = tmp::split(dataAsString, ' ');
 	//std::string& teamName = split[0];
-	std::string& sharedMemStr = split[1];
+	std::string_view sharedMemStr = split[1];
 
 	if (player->team != nullptr)
-		player->team->setSharedMem(sharedMemStr);
+		player->team->setSharedMem(std::string(sharedMemStr));
 }
 
-static void pingCommand(Player::Ptr player, const std::vector<uint8_t>&, const std::string&) {
+static void pingCommand(Player::Ptr player, const std::vector<uint8_t>&, std::string_view) {
 	player->send(S_PONG);
 }
 
-static void disconnectCommand(Player::Ptr player, const std::vector<uint8_t>&, const std::string&)
+static void disconnectCommand(Player::Ptr player, const std::vector<uint8_t>&, std::string_view)
 {
     player->send(0xE3);
     player->send(S_DISCONNECTED);
     player->disconnect(false);
 }
 
-static void reconnectCommand(Player::Ptr player, const std::vector<uint8_t>& data, const std::string&) {
+static void reconnectCommand(Player::Ptr player, const std::vector<uint8_t>& data, std::string_view) {
 	player->send(S_RECONNECT_ACK);
 }
 
-static void launchRequestCommand(Player::Ptr player, const std::vector<uint8_t>&, const std::string&) {
+static void launchRequestCommand(Player::Ptr player, const std::vector<uint8_t>&, std::string_view) {
 	if (player->team != nullptr && player->team->host == player)
 		player->team->sendGameServer(player);
 }
 
-static void launchGameCommand(Player::Ptr player, const std::vector<uint8_t>&, const std::string&) {
+static void launchGameCommand(Player::Ptr player, const std::vector<uint8_t>&, std::string_view) {
 	if (player->team != nullptr)
 		player->team->launchGame(player);
 }
@@ -406,7 +437,7 @@ static std::vector<uint8_t> test(int num)
 	return testdata;
 }
 
-static void refreshUsersCommand(Player::Ptr player, const std::vector<uint8_t>&, const std::string& dataAsString)
+static void refreshUsersCommand(Player::Ptr player, const std::vector<uint8_t>&, std::string_view dataAsString)
 {
 	std::string lobby = player->toUtf8(dataAsString);
 	int count = 0;
@@ -418,7 +449,7 @@ static void refreshUsersCommand(Player::Ptr player, const std::vector<uint8_t>&,
 	player->send(S_LOBBY_PLAYER_LIST_END);
 }
 
-static void searchCommand(Player::Ptr player, const std::vector<uint8_t>&, const std::string& dataAsString)
+static void searchCommand(Player::Ptr player, const std::vector<uint8_t>&, std::string_view dataAsString)
 {
 	Player::Ptr found = player->server.getPlayer(player->toUtf8(dataAsString));
 	if (found != nullptr) {
@@ -434,13 +465,13 @@ static void searchCommand(Player::Ptr player, const std::vector<uint8_t>&, const
 								// FIXME search and say says failed to send message although the player is found (but self so might be the issue)
 }
 
-static void sendCTCPMessage(Player::Ptr player, const std::vector<uint8_t>&, const std::string& dataAsString)
+static void sendCTCPMessage(Player::Ptr player, const std::vector<uint8_t>&, std::string_view dataAsString)
 {
 	auto pos = dataAsString.find(' ');
 	if (pos == std::string::npos)
 		return;
 	std::string recipientName = player->toUtf8(dataAsString.substr(0, pos));
-	std::string message = dataAsString.substr(pos + 1);
+	std::string_view message = dataAsString.substr(pos + 1);
 	Player::Ptr recipient = player->server.getPlayer(recipientName);
 	if (recipient == nullptr)
 		return;
@@ -448,14 +479,14 @@ static void sendCTCPMessage(Player::Ptr player, const std::vector<uint8_t>&, con
 	recipient->send(S_CTCP_MSG, message);
 }
 
-static void logData(Player::Ptr player, const std::vector<uint8_t>&, const std::string& dataAsString) {
+static void logData(Player::Ptr player, const std::vector<uint8_t>&, std::string_view dataAsString) {
 	player->send(S_SENDLOG_ACK);
 }
 
-static void nullCommand(Player::Ptr, const std::vector<uint8_t>&, const std::string&) {
+static void nullCommand(Player::Ptr, const std::vector<uint8_t>&, std::string_view) {
 }
 
-static void launchRequestSingle(Player::Ptr player, const std::vector<uint8_t>&, const std::string&)
+static void launchRequestSingle(Player::Ptr player, const std::vector<uint8_t>&, std::string_view)
 {
 	// expects: <player count> { [*]<player name> <ip addr> }...
 	// * => host
@@ -475,7 +506,7 @@ static void launchRequestSingle(Player::Ptr player, const std::vector<uint8_t>&,
 	}
 }
 
-static void rjRequestRanking(Player::Ptr player, const std::vector<uint8_t>&, const std::string& dataAsString)
+static void rjRequestRanking(Player::Ptr player, const std::vector<uint8_t>&, std::string_view dataAsString)
 {
 	// [RUNEJADE_RANKING 2 HANDLE_NAME MYNICK 0 30 SEGA_ID flycast1 0 40 9 DANJON_1 7 1 CHAT_1 7 1 ITEM_1 7 1 DANJON_2 7 1 CHAT_2 7 1 ITEM_2 7 1 DANJON_3 7 1 CHAT_3 7 1 ITEM_3 7 1 ]
 	// <data name> <identifier#> { <name> <value> <?> <max sz?> } ... <data item#> { <name> <?> <?> } ...
@@ -485,14 +516,14 @@ static void rjRequestRanking(Player::Ptr player, const std::vector<uint8_t>&, co
 	// returned values should be [1-100], otherwise forced to 100
 	// sending all ones makes you a king
 	// Looks like the returned values are levels needed to reach higher status? not sure how it could depend on the player.
-	std::vector<std::string> split = splitString(dataAsString, ' ');
-	int count = atoi(split[10].c_str());
+	tmp::vector<std::string_view> split = tmp::split(dataAsString, ' ');
+	int count = parseInt(split[10]);
 	if (count < 1)
 		return;
-	const std::string& item1 = split[11];
+	std::string_view item1 = split[11];
 	if (item1.substr(0, 7) != "DANJON_")
 		return;
-	int level = atoi(item1.substr(7).c_str());
+	int level = parseInt(item1.substr(7));
 	if (level < 1 || level > 16)
 		return;
 	player->send(S_MULTI_DATA_START, "1 9");
@@ -507,7 +538,7 @@ static void rjRequestRanking(Player::Ptr player, const std::vector<uint8_t>&, co
 	player->send(S_MULTI_DATA_END);
 }
 
-using CommandHandler = void(*)(Player::Ptr, const std::vector<uint8_t>&, const std::string&);
+using CommandHandler = void(*)(Player::Ptr, const std::vector<uint8_t>&, std::string_view);
 static std::unordered_map<CLIOpcode, CommandHandler> CommandHandlers = {
 		{ LOGIN, loginCommand },
 		{ LOGIN2, login2Command },
@@ -548,14 +579,43 @@ static std::unordered_map<CLIOpcode, CommandHandler> CommandHandlers = {
 		{ RJ_REQUEST_RANKING, rjRequestRanking },
 };
 
-void PacketProcessor::handlePacket(Player::Ptr player, uint16_t opcode, const std::vector<uint8_t>& payload)
+static void dispatch(Player::Ptr player, uint16_t opcode, const std::vector<uint8_t>& payload)
 {
-	std::string payloadAsString = std::string((const char *)&payload[0], (const char *)&payload[payload.size()]);
-	std::vector<std::string> split = splitString(payloadAsString, ' ');
-
-	if (CommandHandlers.count((CLIOpcode)opcode) != 0)
-		CommandHandlers[(CLIOpcode)opcode](player, payload, payloadAsString);
-	else
-		WARN_LOG(player->gameId, "Received unknown opcode: 0x%02x -> %s", opcode, payloadAsString.c_str());
+	std::string_view payloadAsString((const char *)payload.data(), payload.size());
+	Metrics::Timer timer(Metrics::HandlerDuration[player->gameId]);
+	Trace::Span span("lobby", "handlePacket", player->gameId, opcode, &player->name);
+	AllocProfile::Scope allocScope(opcode < 0x100 ? opcode : AllocProfile::Other);
+	Player::sender = player.get();
+	uint64_t cpuStart = Accounting::threadCpuTime();
+	PROBE3(dispatch_start, (int)player->gameId, opcode, payload.size());
+
+	auto it = CommandHandlers.find((CLIOpcode)opcode);
+	if (it != CommandHandlers.end())
+		it->second(player, payload, payloadAsString);
+	else {
+		WARN_LOG(player->gameId, "Received unknown opcode: 0x%02x -> %s", opcode,
+				std::string(payloadAsString.substr(0, cstrLength(payloadAsString))).c_str());
+		player->dumpFlightRecorder("Unknown opcode");
+	}
+	PROBE2(dispatch_end, (int)player->gameId, opcode);
+	player->account(Accounting::CpuTime, Accounting::threadCpuTime() - cpuStart);
+	Player::sender = nullptr;
+	// Handler temporaries are gone
+	tmp::releaseArena();
 }
 
+void PacketProcessor::handlePacket(Player::Ptr player, uint16_t opcode, const std::vector<uint8_t>& payload)
+{
+	if ((opcode == REFRESH_PLAYERS || opcode == GET_LOBBIES || opcode == GET_TEAMS || opcode == REFRESH_USERS)
+			&& LoadMonitor::isAtLeast(LoadMonitor::DeferRefresh))
+	{
+		// Identical requests are only answered once
+		size_t key = std::hash<std::string_view>()(std::string_view((const char *)payload.data(), payload.size())) ^ opcode;
+		LoadMonitor::defer(player.get(), key, [player, opcode, payload]() {
+			if (!player->isDisconnected())
+				dispatch(player, opcode, payload);
+		});
+		return;
+	}
+	dispatch(player, opcode, payload);
+}
@@ -0,0 +1,49 @@
+/*
+    Copyright (C) 2025  Flyinghead
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+//
+// USDT probes for bpftrace and perf, provider "iwango":
+//   conn_accept(game, ip)                    conn_close(game, player)
+//   packet_receive(game, opcode, length)     dispatch_start(game, opcode, length)  dispatch_end(game, opcode)
+//   send_enqueue(opcode, length, queued)     send_flush(length)                    send_done(length)
+//   broadcast(game, lobby, recipients, opcode)
+//   db_start(queue_us)                       db_end(queue_us, run_us)
+//   login(game, player)                      logout(game, player)
+// Only a nop when not traced. Compiled out if <sys/sdt.h> (systemtap-sdt-dev) is missing or with -DNO_USDT.
+//
+#if !defined(NO_USDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define IWANGO_USDT
+#endif
+#endif
+
+#ifdef IWANGO_USDT
+#define PROBE0(name) DTRACE_PROBE(iwango, name)
+#define PROBE1(name, a) DTRACE_PROBE1(iwango, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(iwango, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(iwango, name, a, b, c)
+#define PROBE4(name, a, b, c, d) DTRACE_PROBE4(iwango, name, a, b, c, d)
+#else
+// Arguments aren't evaluated
+#define PROBE0(name) do {} while (0)
+#define PROBE1(name, a) do { (void)sizeof(a); } while (0)
+#define PROBE2(name, a, b) do { (void)sizeof(a); (void)sizeof(b); } while (0)
+#define PROBE3(name, a, b, c) do { (void)sizeof(a); (void)sizeof(b); (void)sizeof(c); } while (0)
+#define PROBE4(name, a, b, c, d) do { (void)sizeof(a); (void)sizeof(b); (void)sizeof(c); (void)sizeof(d); } while (0)
+#endif
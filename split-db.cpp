@@ -0,0 +1,129 @@
+/*
+    Copyright (C) 2025  Flyinghead
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+//
+// Splits an iwango database into the shard files used when DatabaseShards is set
+//
+#include "storage.h"
+#include <sqlite3.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include <set>
+#include <stdexcept>
+
+static void check(sqlite3 *db, int rc)
+{
+	if (rc != SQLITE_OK && rc != SQLITE_ROW && rc != SQLITE_DONE)
+		throw std::runtime_error(sqlite3_errmsg(db));
+}
+
+static void exec(sqlite3 *db, const std::string& sql) {
+	check(db, sqlite3_exec(db, sql.c_str(), nullptr, nullptr, nullptr));
+}
+
+// Returns the first column of all rows
+static std::vector<std::string> query(sqlite3 *db, const std::string& sql)
+{
+	sqlite3_stmt *stmt;
+	check(db, sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr));
+	std::vector<std::string> rows;
+	int rc;
+	while ((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+		rows.push_back((const char *)sqlite3_column_text(stmt, 0));
+	sqlite3_finalize(stmt);
+	check(db, rc);
+	return rows;
+}
+
+static sqlite3 *open(const std::string& path, int flags)
+{
+	sqlite3 *db;
+	int rc = sqlite3_open_v2(path.c_str(), &db, flags, nullptr);
+	if (rc != SQLITE_OK)
+	{
+		std::string msg = db != nullptr ? sqlite3_errmsg(db) : sqlite3_errstr(rc);
+		sqlite3_close(db);
+		throw std::runtime_error("Can't open " + path + ": " + msg);
+	}
+	return db;
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc != 3) {
+		fprintf(stderr, "Usage: %s <database path> <game | number of shards>\n", argv[0]);
+		return 1;
+	}
+	std::string path = argv[1];
+	int shards;
+	try {
+		shards = parseShards(argv[2]);
+	} catch (const std::exception&) {
+		shards = 0;
+	}
+	if (shards == 0 || shards == 1) {
+		fprintf(stderr, "Invalid shard count: %s\n", argv[2]);
+		return 1;
+	}
+	try {
+		sqlite3 *db = open(path, SQLITE_OPEN_READWRITE);
+		std::vector<std::string> schema = query(db, "SELECT sql FROM sqlite_master WHERE sql IS NOT NULL AND name NOT LIKE 'sqlite_%'");
+		std::set<int> games;
+		for (const std::string& game : query(db, "SELECT DISTINCT GAME FROM USER_HANDLE UNION SELECT DISTINCT GAME FROM USER_EXTRAMEM"))
+			games.insert(std::stoi(game));
+
+		std::vector<int> allShards = getShards(shards);
+		for (int shard : allShards)
+			if (access(getShardPath(path, shard).c_str(), F_OK) == 0)
+				throw std::runtime_error(getShardPath(path, shard) + " already exists");
+		for (int game : games)
+			if (shards < 0 && (game < (int)GameId::Daytona || game > (int)GameId::RuneJade))
+				fprintf(stderr, "Warning: game %d has no shard and won't be copied\n", game);
+
+		for (int shard : allShards)
+		{
+			std::string shardPath = getShardPath(path, shard);
+			sqlite3 *shardDb = open(shardPath, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE);
+			for (const std::string& sql : schema)
+				exec(shardDb, sql);
+			sqlite3_close(shardDb);
+
+			exec(db, "ATTACH DATABASE '" + shardPath + "' AS shard");
+			exec(db, "BEGIN TRANSACTION");
+			int handles = 0;
+			int extraMems = 0;
+			for (int game : games)
+			{
+				if (getShard((GameId)game, shards) != shard)
+					continue;
+				exec(db, "INSERT INTO shard.USER_HANDLE SELECT * FROM main.USER_HANDLE WHERE GAME = " + std::to_string(game));
+				handles += sqlite3_changes(db);
+				exec(db, "INSERT INTO shard.USER_EXTRAMEM SELECT * FROM main.USER_EXTRAMEM WHERE GAME = " + std::to_string(game));
+				extraMems += sqlite3_changes(db);
+			}
+			exec(db, "COMMIT");
+			exec(db, "DETACH DATABASE shard");
+			printf("%s: %d handles, %d extra mems\n", shardPath.c_str(), handles, extraMems);
+		}
+		sqlite3_close(db);
+	} catch (const std::exception& e) {
+		fprintf(stderr, "Error: %s\n", e.what());
+		return 1;
+	}
+	return 0;
+}
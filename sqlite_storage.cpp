@@ -0,0 +1,460 @@
+/*
+    Copyright (C) 2025  Flyinghead
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#define LOG_SUBSYSTEM Log::Database
+#include "storage.h"
+#include "database.h"
+#include "codec.h"
+#include <sqlite3.h>
+#include <dcserver/database.hpp>
+#include <stdexcept>
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <unordered_map>
+#include <thread>
+#include <chrono>
+#include <climits>
+#include <cerrno>
+#include <cstdio>
+
+namespace
+{
+
+//
+// Long-lived connection owned by a thread, with its cache of prepared statements
+//
+class Connection
+{
+public:
+	Connection(const std::string& path)
+	{
+		int rc = sqlite3_open_v2(path.c_str(), &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_NOMUTEX, nullptr);
+		if (rc != SQLITE_OK)
+		{
+			std::string msg = db != nullptr ? sqlite3_errmsg(db) : sqlite3_errstr(rc);
+			sqlite3_close(db);
+			throw std::runtime_error("Can't open database " + path + ": " + msg);
+		}
+		sqlite3_busy_timeout(db, std::stoi(getConfig("DatabaseBusyTimeout", "5000")));
+		exec("PRAGMA journal_mode = " + getConfig("DatabaseJournalMode", "WAL"));
+		exec("PRAGMA synchronous = " + getConfig("DatabaseSynchronous", "NORMAL"));
+		exec("PRAGMA mmap_size = " + getConfig("DatabaseMmapSize", "67108864"));
+	}
+
+	~Connection()
+	{
+		for (auto& [sql, stmt] : statements)
+			sqlite3_finalize(stmt);
+		sqlite3_close(db);
+	}
+
+	// SQL strings are literals so they can be keyed by address
+	sqlite3_stmt *prepare(const char *sql)
+	{
+		auto it = statements.find(sql);
+		if (it != statements.end())
+			return it->second;
+		sqlite3_stmt *stmt;
+		check(sqlite3_prepare_v3(db, sql, -1, SQLITE_PREPARE_PERSISTENT, &stmt, nullptr));
+		statements[sql] = stmt;
+		return stmt;
+	}
+
+	void exec(const std::string& sql) {
+		check(sqlite3_exec(db, sql.c_str(), nullptr, nullptr, nullptr));
+	}
+
+	void check(int rc)
+	{
+		if (rc == SQLITE_OK || rc == SQLITE_ROW || rc == SQLITE_DONE)
+			return;
+		if (sqlite3_extended_errcode(db) == SQLITE_CONSTRAINT_UNIQUE)
+			throw UniqueConstraintViolation(sqlite3_errmsg(db));
+		throw std::runtime_error(sqlite3_errmsg(db));
+	}
+
+	sqlite3 *db = nullptr;
+
+private:
+	std::unordered_map<const char *, sqlite3_stmt *> statements;
+};
+
+// One connection per thread and database file
+static thread_local std::unordered_map<std::string, std::unique_ptr<Connection>> connections;
+
+static Connection& getConnection(const std::string& path)
+{
+	std::unique_ptr<Connection>& connection = connections[path];
+	if (connection == nullptr)
+		connection = std::make_unique<Connection>(path);
+	return *connection;
+}
+
+//
+// A cached prepared statement. It is reset and its bindings cleared when going out of scope.
+//
+class CachedStatement
+{
+public:
+	CachedStatement(Connection& conn, const char *sql)
+		: conn(conn), stmt(conn.prepare(sql)) {
+	}
+	~CachedStatement() {
+		sqlite3_reset(stmt);
+		sqlite3_clear_bindings(stmt);
+	}
+
+	void bind(int idx, int v) {
+		conn.check(sqlite3_bind_int(stmt, idx, v));
+	}
+	void bind(int idx, const std::string& s) {
+		conn.check(sqlite3_bind_text(stmt, idx, s.c_str(), s.length(), SQLITE_STATIC));
+	}
+	void bind(int idx, const uint8_t *data, int size) {
+		conn.check(sqlite3_bind_blob(stmt, idx, data, size, SQLITE_STATIC));
+	}
+
+	bool step()
+	{
+		int rc = sqlite3_step(stmt);
+		conn.check(rc);
+		return rc == SQLITE_ROW;
+	}
+
+	std::string getStringColumn(int idx)
+	{
+		const char *s = (const char *)sqlite3_column_text(stmt, idx);
+		return std::string(s != nullptr ? s : "", sqlite3_column_bytes(stmt, idx));
+	}
+	std::vector<uint8_t> getBlobColumn(int idx)
+	{
+		const uint8_t *data = (const uint8_t *)sqlite3_column_blob(stmt, idx);
+		return std::vector<uint8_t>(data, data + sqlite3_column_bytes(stmt, idx));
+	}
+	int changedRows() {
+		return sqlite3_changes(conn.db);
+	}
+	void bind(int idx, int64_t v) {
+		conn.check(sqlite3_bind_int64(stmt, idx, v));
+	}
+	int getIntColumn(int idx) {
+		return sqlite3_column_int(stmt, idx);
+	}
+	int64_t getInt64Column(int idx) {
+		return sqlite3_column_int64(stmt, idx);
+	}
+
+private:
+	Connection& conn;
+	sqlite3_stmt *stmt;
+};
+
+//
+// Incremental I/O on the EXTRAMEM blob of a USER_EXTRAMEM row
+//
+class ExtraMemBlob
+{
+public:
+	ExtraMemBlob(Connection& conn, int64_t rowid, bool writable)
+		: conn(conn) {
+		open(rowid, writable);
+	}
+	~ExtraMemBlob() {
+		close();
+	}
+
+	void open(int64_t rowid, bool writable) {
+		conn.check(sqlite3_blob_open(conn.db, "main", "USER_EXTRAMEM", "EXTRAMEM", rowid, writable ? 1 : 0, &blob));
+	}
+	void close()
+	{
+		if (blob != nullptr)
+			sqlite3_blob_close(blob);
+		blob = nullptr;
+	}
+	int size() {
+		return sqlite3_blob_bytes(blob);
+	}
+	void write(const uint8_t *data, int offset, int size) {
+		conn.check(sqlite3_blob_write(blob, data, size, offset));
+	}
+
+private:
+	Connection& conn;
+	sqlite3_blob *blob = nullptr;
+};
+
+// USER_EXTRAMEM.FORMAT
+enum ExtraMemFormat
+{
+	RawExtraMem = 0,
+	PackedExtraMem = 1,	// packBlock()
+};
+
+struct ExtraMemRow
+{
+	int64_t id;	// 0 if not found
+	int format;
+};
+
+static ExtraMemRow findExtraMemRow(Connection& conn, GameId gameId, const std::string& user)
+{
+	CachedStatement stmt(conn, "SELECT ID, FORMAT FROM USER_EXTRAMEM WHERE USER_NAME = ? AND GAME = ?");
+	stmt.bind(1, user);
+	stmt.bind(2, (int)gameId);
+	if (stmt.step())
+		return { stmt.getInt64Column(0), stmt.getIntColumn(1) };
+	else
+		return { 0, RawExtraMem };
+}
+
+static std::vector<uint8_t> readExtraMem(Connection& conn, GameId gameId, const std::string& user)
+{
+	CachedStatement stmt(conn, "SELECT EXTRAMEM, FORMAT FROM USER_EXTRAMEM WHERE USER_NAME = ? AND GAME = ?");
+	stmt.bind(1, user);
+	stmt.bind(2, (int)gameId);
+	if (!stmt.step())
+		return {};
+	std::vector<uint8_t> data = stmt.getBlobColumn(0);
+	int format = stmt.getIntColumn(1);
+	if (format == RawExtraMem)
+		return data;
+	std::vector<uint8_t> unpacked;
+	if (format != PackedExtraMem || !unpackBlock(data.data(), data.size(), unpacked, ExtraUserMemSize))
+		throw std::runtime_error("Invalid extra mem data for " + user);
+	return unpacked;
+}
+
+//
+// Rolls back unless committed
+//
+class Transaction
+{
+public:
+	Transaction(Connection& conn) : conn(conn) {
+		CachedStatement(conn, "BEGIN TRANSACTION").step();
+	}
+	~Transaction()
+	{
+		if (!committed)
+			try {
+				CachedStatement(conn, "ROLLBACK").step();
+			} catch (const std::runtime_error& e) {
+				ERROR_LOG(GameId::Unknown, "rollback failed: %s", e.what());
+			}
+	}
+	void commit() {
+		CachedStatement(conn, "COMMIT").step();
+		committed = true;
+	}
+
+private:
+	Connection& conn;
+	bool committed = false;
+};
+
+class SqliteStorage : public Storage
+{
+public:
+	SqliteStorage(const std::string& path) : path(path)
+	{
+		Connection& conn = getConnection(path);
+		// Databases created before extra mem compression
+		if (!CachedStatement(conn, "SELECT 1 FROM pragma_table_info('USER_EXTRAMEM') WHERE name = 'FORMAT'").step())
+			conn.exec("ALTER TABLE USER_EXTRAMEM ADD COLUMN FORMAT INTEGER NOT NULL DEFAULT 0");
+		compressExtraMem = getConfig("ExtraMemCompression", "1") == "1";
+	}
+
+	void forEachHandle(const HandleVisitor& visitor) override
+	{
+		Connection& conn = getConnection(path);
+		CachedStatement stmt(conn, "SELECT USER_NAME, GAME, HANDLE_INDEX, HANDLE FROM USER_HANDLE");
+		while (stmt.step())
+			visitor((GameId)stmt.getIntColumn(1), stmt.getStringColumn(0), stmt.getIntColumn(2), stmt.getStringColumn(3));
+	}
+
+	std::vector<std::string> getHandles(GameId gameId, const std::string& user) override
+	{
+		Connection& conn = getConnection(path);
+		std::vector<std::string> handles;
+		CachedStatement stmt(conn, "SELECT HANDLE FROM USER_HANDLE WHERE USER_NAME = ? AND GAME = ? ORDER BY HANDLE_INDEX");
+		stmt.bind(1, user);
+		stmt.bind(2, (int)gameId);
+		while (stmt.step())
+			handles.push_back(stmt.getStringColumn(0));
+		return handles;
+	}
+
+	void createHandle(GameId gameId, const std::string& user, int index, const std::string& handle) override
+	{
+		Connection& conn = getConnection(path);
+		CachedStatement stmt(conn, "INSERT INTO USER_HANDLE (USER_NAME, GAME, HANDLE_INDEX, HANDLE) VALUES (?, ?, ?, ?)");
+		stmt.bind(1, user);
+		stmt.bind(2, (int)gameId);
+		stmt.bind(3, index);
+		stmt.bind(4, handle);
+		stmt.step();
+	}
+
+	bool replaceHandle(GameId gameId, const std::string& user, int index, const std::string& handle) override
+	{
+		Connection& conn = getConnection(path);
+		CachedStatement stmt(conn, "UPDATE USER_HANDLE SET HANDLE = ? WHERE USER_NAME = ? AND GAME = ? AND HANDLE_INDEX = ?");
+		stmt.bind(1, handle);
+		stmt.bind(2, user);
+		stmt.bind(3, (int)gameId);
+		stmt.bind(4, index);
+		stmt.step();
+		return stmt.changedRows() != 0;
+	}
+
+	void deleteHandle(GameId gameId, const std::string& user, int index) override
+	{
+		Connection& conn = getConnection(path);
+		Transaction transaction(conn);
+		{
+			CachedStatement stmt(conn, "DELETE FROM USER_HANDLE WHERE USER_NAME = ? AND GAME = ? AND HANDLE_INDEX = ?");
+			stmt.bind(1, user);
+			stmt.bind(2, (int)gameId);
+			stmt.bind(3, index);
+			stmt.step();
+		}
+		// UNIQUE_USER_INDEX is checked row by row in rowid order, so the following slots are first
+		// moved out of the way to negative indexes, then moved down one slot
+		{
+			CachedStatement stmt(conn, "UPDATE USER_HANDLE SET HANDLE_INDEX = -HANDLE_INDEX WHERE USER_NAME = ? AND GAME = ? AND HANDLE_INDEX > ?");
+			stmt.bind(1, user);
+			stmt.bind(2, (int)gameId);
+			stmt.bind(3, index);
+			stmt.step();
+		}
+		{
+			CachedStatement stmt(conn, "UPDATE USER_HANDLE SET HANDLE_INDEX = -HANDLE_INDEX - 1 WHERE USER_NAME = ? AND GAME = ? AND HANDLE_INDEX < 0");
+			stmt.bind(1, user);
+			stmt.bind(2, (int)gameId);
+			stmt.step();
+		}
+		transaction.commit();
+	}
+
+	std::vector<uint8_t> getExtraUserMem(GameId gameId, const std::string& user) override
+	{
+		return readExtraMem(getConnection(path), gameId, user);
+	}
+
+	void updateExtraUserMem(GameId gameId, const std::string& user, const uint8_t *data, int offset, int size) override
+	{
+		Connection& conn = getConnection(path);
+		Transaction transaction(conn);
+		ExtraMemRow row = findExtraMemRow(conn, gameId, user);
+		if (compressExtraMem || row.format != RawExtraMem)
+		{
+			// Packed blobs are rewritten
+			std::vector<uint8_t> mem = readExtraMem(conn, gameId, user);
+			mem.resize(ExtraUserMemSize);
+			memcpy(&mem[offset], data, size);
+			std::vector<uint8_t> packed;
+			if (compressExtraMem)
+				packed = packBlock(mem.data(), mem.size());
+			CachedStatement stmt(conn, "INSERT INTO USER_EXTRAMEM (USER_NAME, GAME, EXTRAMEM, FORMAT) VALUES (?, ?, ?, ?) "
+					"ON CONFLICT (USER_NAME, GAME) DO UPDATE SET EXTRAMEM = excluded.EXTRAMEM, FORMAT = excluded.FORMAT");
+			stmt.bind(1, user);
+			stmt.bind(2, (int)gameId);
+			if (compressExtraMem) {
+				stmt.bind(3, packed.data(), packed.size());
+				stmt.bind(4, PackedExtraMem);
+			}
+			else {
+				stmt.bind(3, mem.data(), mem.size());
+				stmt.bind(4, RawExtraMem);
+			}
+			stmt.step();
+			transaction.commit();
+			return;
+		}
+		// Raw blobs are preallocated so that they can be patched in place
+		{
+			CachedStatement stmt(conn, "INSERT INTO USER_EXTRAMEM (USER_NAME, GAME, EXTRAMEM) VALUES (?, ?, zeroblob(?)) "
+					"ON CONFLICT (USER_NAME, GAME) DO NOTHING");
+			stmt.bind(1, user);
+			stmt.bind(2, (int)gameId);
+			stmt.bind(3, ExtraUserMemSize);
+			stmt.step();
+		}
+		int64_t rowid = findExtraMemRow(conn, gameId, user).id;
+		ExtraMemBlob blob(conn, rowid, true);
+		if (blob.size() < ExtraUserMemSize)
+		{
+			// Row created before preallocation
+			blob.close();
+			CachedStatement stmt(conn, "UPDATE USER_EXTRAMEM SET EXTRAMEM = CAST(ifnull(EXTRAMEM, x'') || zeroblob(? - ifnull(length(EXTRAMEM), 0)) AS BLOB) WHERE ID = ?");
+			stmt.bind(1, ExtraUserMemSize);
+			stmt.bind(2, rowid);
+			stmt.step();
+			blob.open(rowid, true);
+		}
+		blob.write(data, offset, size);
+		blob.close();
+		transaction.commit();
+	}
+
+	void backup(const std::string& destPath) override
+	{
+		Connection& conn = getConnection(path);
+		std::string tmpPath = destPath + ".tmp";
+		sqlite3 *dest;
+		int rc = sqlite3_open_v2(tmpPath.c_str(), &dest, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, nullptr);
+		sqlite3_backup *backup = rc == SQLITE_OK ? sqlite3_backup_init(dest, "main", conn.db, "main") : nullptr;
+		if (backup == nullptr)
+		{
+			std::string msg = dest != nullptr ? sqlite3_errmsg(dest) : sqlite3_errstr(rc);
+			sqlite3_close(dest);
+			throw std::runtime_error("Can't create " + tmpPath + ": " + msg);
+		}
+		// Copy a few pages at a time so that the destination I/O doesn't starve the server.
+		// A write from another connection restarts the backup: copy everything at once if it happens too often.
+		int stepPages = std::stoi(getConfig("BackupStepPages", "100"));
+		int stepDelay = std::stoi(getConfig("BackupStepDelay", "10"));
+		int restarts = 0;
+		int remaining = INT_MAX;
+		do {
+			rc = sqlite3_backup_step(backup, restarts < 3 ? stepPages : -1);
+			if (sqlite3_backup_remaining(backup) > remaining)
+				restarts++;
+			remaining = sqlite3_backup_remaining(backup);
+			if (rc == SQLITE_OK || rc == SQLITE_BUSY || rc == SQLITE_LOCKED)
+				std::this_thread::sleep_for(std::chrono::milliseconds(stepDelay));
+		} while (rc == SQLITE_OK || rc == SQLITE_BUSY || rc == SQLITE_LOCKED);
+		sqlite3_backup_finish(backup);
+		std::string msg = sqlite3_errmsg(dest);
+		sqlite3_close(dest);
+		if (rc != SQLITE_DONE)
+			throw std::runtime_error("Backup to " + tmpPath + " failed: " + msg);
+		if (rename(tmpPath.c_str(), destPath.c_str()) != 0)
+			throw std::runtime_error("Can't rename " + tmpPath + ": " + strerror(errno));
+	}
+
+private:
+	std::string path;
+	bool compressExtraMem;
+};
+
+}
+
+std::unique_ptr<Storage> createSqliteStorage(const std::string& path) {
+	return std::make_unique<SqliteStorage>(path);
+}
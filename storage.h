@@ -0,0 +1,92 @@
+/*
+    Copyright (C) 2025  Flyinghead
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#pragma once
+#include "common.h"
+#include <string>
+#include <vector>
+#include <memory>
+#include <functional>
+
+//
+// Storage engine for user handles and extra user memory.
+// Methods can be called concurrently from several threads. Errors are reported by throwing
+// UniqueConstraintViolation when a handle is already used, or std::runtime_error.
+//
+class Storage
+{
+public:
+	virtual ~Storage() = default;
+
+	using HandleVisitor = std::function<void(GameId gameId, const std::string& user, int index, const std::string& handle)>;
+	virtual void forEachHandle(const HandleVisitor& visitor) = 0;
+	// Ordered by index
+	virtual std::vector<std::string> getHandles(GameId gameId, const std::string& user) = 0;
+	virtual void createHandle(GameId gameId, const std::string& user, int index, const std::string& handle) = 0;
+	// Returns false if there is no handle at this index
+	virtual bool replaceHandle(GameId gameId, const std::string& user, int index, const std::string& handle) = 0;
+	// Following handles move down one slot
+	virtual void deleteHandle(GameId gameId, const std::string& user, int index) = 0;
+
+	// Returns nothing if the user has no extra mem
+	virtual std::vector<uint8_t> getExtraUserMem(GameId gameId, const std::string& user) = 0;
+	virtual void updateExtraUserMem(GameId gameId, const std::string& user, const uint8_t *data, int offset, int size) = 0;
+
+	// Write a consistent copy of the storage to the given path. Other calls can proceed meanwhile.
+	virtual void backup(const std::string& path) = 0;
+};
+
+std::unique_ptr<Storage> createSqliteStorage(const std::string& path);
+// Tables are kept in memory. Changes are appended to path.log and compacted into the path snapshot.
+std::unique_ptr<Storage> createMemoryStorage(const std::string& path);
+
+//
+// Sharding of storage by game. Shards is -1 for one shard per game, or the number of shards.
+//
+inline int parseShards(const std::string& s) {
+	return s == "game" ? -1 : std::stoi(s);
+}
+
+inline int getShard(GameId gameId, int shards)
+{
+	if (shards < 0)
+		return (int)gameId;
+	else
+		return ((int)gameId % shards + shards) % shards;
+}
+
+inline std::vector<int> getShards(int shards)
+{
+	std::vector<int> v;
+	if (shards < 0)
+		for (int i = (int)GameId::Daytona; i <= (int)GameId::RuneJade; i++)
+			v.push_back(i);
+	else
+		for (int i = 0; i < shards; i++)
+			v.push_back(i);
+	return v;
+}
+
+// iwango.db -> iwango.2.db
+inline std::string getShardPath(const std::string& path, int shard)
+{
+	size_t dot = path.rfind('.');
+	size_t slash = path.rfind('/');
+	if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+		return path + '.' + std::to_string(shard);
+	else
+		return path.substr(0, dot) + '.' + std::to_string(shard) + path.substr(dot);
+}
@@ -0,0 +1,198 @@
+/*
+    Copyright (C) 2025  Flyinghead
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include "trace.h"
+#include <mutex>
+#include <vector>
+#include <memory>
+#include <ctime>
+#include <cerrno>
+#include <stdio.h>
+
+namespace Trace
+{
+
+std::atomic<bool> Enabled;
+
+namespace
+{
+
+struct Record
+{
+	uint64_t start;
+	uint64_t duration;
+	const char *category;
+	const char *name;
+	GameId gameId;
+	int opcode;
+	char player[24];
+};
+
+struct Ring
+{
+	Ring(unsigned id, unsigned size)
+		: id(id), records(size) {}
+
+	std::mutex mutex;
+	unsigned id;
+	std::vector<Record> records;
+	size_t next = 0;
+	size_t count = 0;
+};
+
+std::mutex ringsMutex;
+// Never freed since threads can be traced until exit
+std::vector<Ring *> rings;
+unsigned ringSize = 4096;
+// Sampling threshold compared to a 32-bit random number
+std::atomic<uint32_t> sampleThreshold;
+std::atomic<uint64_t> slowThresholdNs;
+
+Ring& getRing()
+{
+	static thread_local Ring *ring;
+	if (ring == nullptr)
+	{
+		std::lock_guard<std::mutex> _(ringsMutex);
+		ring = new Ring(rings.size() + 1, ringSize);
+		rings.push_back(ring);
+	}
+	return *ring;
+}
+
+uint32_t random()
+{
+	static thread_local uint32_t state = (uint32_t)(uintptr_t)&state | 1;
+	// xorshift32
+	state ^= state << 13;
+	state ^= state >> 17;
+	state ^= state << 5;
+	return state;
+}
+
+void jsonString(FILE *f, const char *s)
+{
+	fputc('"', f);
+	for (; *s != '\0'; s++)
+	{
+		if (*s == '"' || *s == '\\')
+			fprintf(f, "\\%c", *s);
+		else if ((uint8_t)*s < 0x20)
+			fprintf(f, "\\u%04x", *s);
+		else
+			fputc(*s, f);
+	}
+	fputc('"', f);
+}
+
+}
+
+uint64_t now()
+{
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void configure(double sampleRate, unsigned slowThreshold, unsigned bufferSize)
+{
+	sampleRate = std::min(std::max(sampleRate, 0.0), 1.0);
+	sampleThreshold = sampleRate >= 1.0 ? UINT32_MAX : (uint32_t)(sampleRate * UINT32_MAX);
+	slowThresholdNs = slowThreshold == 0 ? UINT64_MAX : slowThreshold * 1000ull;
+	ringSize = std::max(bufferSize, 16u);
+	Enabled = sampleRate > 0.0 || slowThreshold != 0;
+}
+
+void Span::end()
+{
+	uint64_t duration = now() - start;
+	if (duration < slowThresholdNs.load(std::memory_order_relaxed)
+			&& random() >= sampleThreshold.load(std::memory_order_relaxed))
+		return;
+	Ring& ring = getRing();
+	std::lock_guard<std::mutex> _(ring.mutex);
+	Record& record = ring.records[ring.next];
+	record.start = start;
+	record.duration = duration;
+	record.category = category;
+	record.name = name;
+	record.gameId = gameId;
+	record.opcode = opcode;
+	if (player != nullptr) {
+		strncpy(record.player, player->c_str(), sizeof(record.player) - 1);
+		record.player[sizeof(record.player) - 1] = '\0';
+	}
+	else {
+		record.player[0] = '\0';
+	}
+	ring.next = (ring.next + 1) % ring.records.size();
+	ring.count = std::min(ring.count + 1, ring.records.size());
+}
+
+void dump(const std::string& directory)
+{
+	time_t t = time(nullptr);
+	struct tm tm;
+	localtime_r(&t, &tm);
+	char name[64];
+	strftime(name, sizeof(name), "iwango-trace-%Y%m%d-%H%M%S.json", &tm);
+	std::string path = directory + '/' + name;
+	FILE *f = fopen(path.c_str(), "w");
+	if (f == nullptr) {
+		ERROR_LOG(GameId::Unknown, "Can't create trace file %s: %s", path.c_str(), strerror(errno));
+		return;
+	}
+	fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n", f);
+	bool first = true;
+	size_t total = 0;
+	std::vector<Ring *> allRings;
+	{
+		std::lock_guard<std::mutex> _(ringsMutex);
+		allRings = rings;
+	}
+	for (Ring *ring : allRings)
+	{
+		std::vector<Record> records;
+		{
+			std::lock_guard<std::mutex> _(ring->mutex);
+			size_t size = ring->records.size();
+			for (size_t i = 0; i < ring->count; i++)
+				records.push_back(ring->records[(ring->next + size - ring->count + i) % size]);
+		}
+		for (const Record& record : records)
+		{
+			fprintf(f, "%s{\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f,\"cat\":\"%s\",\"name\":\"%s\",\"args\":{",
+					first ? "" : ",\n", ring->id, record.start / 1000.0, record.duration / 1000.0, record.category, record.name);
+			first = false;
+			fprintf(f, "\"game\":\"%s\"", Log::getGameName(record.gameId));
+			if (record.opcode != -1)
+				fprintf(f, ",\"opcode\":\"0x%02x\"", record.opcode);
+			if (record.player[0] != '\0') {
+				fputs(",\"player\":", f);
+				jsonString(f, record.player);
+			}
+			fputs("}}", f);
+		}
+		total += records.size();
+	}
+	fputs("\n]}\n", f);
+	if (fclose(f) != 0)
+		ERROR_LOG(GameId::Unknown, "Can't write trace file %s: %s", path.c_str(), strerror(errno));
+	else
+		NOTICE_LOG(GameId::Unknown, "%zd trace events saved to %s", total, path.c_str());
+}
+
+}
@@ -0,0 +1,72 @@
+/*
+    Copyright (C) 2025  Flyinghead
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#pragma once
+#include "common.h"
+#include <atomic>
+#include <string>
+
+//
+// Sampled spans kept in a ring buffer per thread. Spans slower than a threshold are always kept.
+// The rings can be saved as Chrome trace events (chrome://tracing or Perfetto).
+//
+namespace Trace
+{
+extern std::atomic<bool> Enabled;
+
+// sampleRate: fraction of spans recorded, slowThreshold: duration in us above which spans are always recorded.
+// Tracing is disabled if both are 0.
+void configure(double sampleRate, unsigned slowThreshold, unsigned bufferSize);
+// Write all recorded spans to a new file in the given directory
+void dump(const std::string& directory);
+
+uint64_t now();
+
+class Span
+{
+public:
+	// category and name must be string literals
+	Span(const char *category, const char *name, GameId gameId = GameId::Unknown, int opcode = -1,
+			const std::string *player = nullptr)
+	{
+		if (!Enabled.load(std::memory_order_relaxed))
+			return;
+		this->category = category;
+		this->name = name;
+		this->gameId = gameId;
+		this->opcode = opcode;
+		this->player = player;
+		start = now();
+	}
+	~Span() {
+		if (start != 0)
+			end();
+	}
+
+	Span(const Span&) = delete;
+	Span& operator=(const Span&) = delete;
+
+private:
+	void end();
+
+	uint64_t start = 0;
+	const char *category;
+	const char *name;
+	GameId gameId;
+	int opcode;
+	const std::string *player;
+};
+}
@@ -0,0 +1,639 @@
+/*
+    Copyright (C) 2025  Flyinghead
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+//
+// Bulk export and import of user handles and extra memory.
+// The iwango server must not be running during an import.
+//
+#include "codec.h"
+#include "storage.h"
+#include <sqlite3.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <stdexcept>
+
+constexpr int ExtraUserMemSize = 0x2000;
+constexpr char BinaryMagic[8] = { 'I', 'W', 'U', 'D', 'A', 'T', 'A', '1' };
+constexpr char CsvHeader[] = "type,game,user,index,data";
+
+enum RecordType : uint8_t {
+	End = 0,
+	Handle = 1,
+	ExtraMem = 2,
+};
+
+struct Record
+{
+	RecordType type;
+	int game;
+	std::string user;
+	int index;					// handle only
+	std::string handle;
+	std::vector<uint8_t> data;	// extra mem, packed with packBlock when imported
+};
+
+//
+// SQLite helpers
+//
+class Database
+{
+public:
+	Database(const std::string& path)
+	{
+		int rc = sqlite3_open_v2(path.c_str(), &db, SQLITE_OPEN_READWRITE, nullptr);
+		if (rc != SQLITE_OK)
+		{
+			std::string msg = db != nullptr ? sqlite3_errmsg(db) : sqlite3_errstr(rc);
+			sqlite3_close(db);
+			throw std::runtime_error("Can't open " + path + ": " + msg);
+		}
+	}
+	~Database() {
+		sqlite3_close(db);
+	}
+
+	void check(int rc)
+	{
+		if (rc != SQLITE_OK && rc != SQLITE_ROW && rc != SQLITE_DONE)
+			throw std::runtime_error(sqlite3_errmsg(db));
+	}
+	void exec(const std::string& sql) {
+		check(sqlite3_exec(db, sql.c_str(), nullptr, nullptr, nullptr));
+	}
+	bool hasFormatColumn()
+	{
+		sqlite3_stmt *stmt = prepare("SELECT 1 FROM pragma_table_info('USER_EXTRAMEM') WHERE name = 'FORMAT'");
+		bool found = sqlite3_step(stmt) == SQLITE_ROW;
+		sqlite3_finalize(stmt);
+		return found;
+	}
+	sqlite3_stmt *prepare(const std::string& sql)
+	{
+		sqlite3_stmt *stmt;
+		check(sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr));
+		return stmt;
+	}
+
+	sqlite3 *db = nullptr;
+};
+
+static std::string columnText(sqlite3_stmt *stmt, int idx)
+{
+	const char *s = (const char *)sqlite3_column_text(stmt, idx);
+	return std::string(s != nullptr ? s : "", sqlite3_column_bytes(stmt, idx));
+}
+
+//
+// Base64
+//
+static const char Base64Chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static std::string base64Encode(const std::vector<uint8_t>& data)
+{
+	std::string s;
+	s.reserve((data.size() + 2) / 3 * 4);
+	for (size_t i = 0; i < data.size(); i += 3)
+	{
+		uint32_t v = data[i] << 16;
+		if (i + 1 < data.size())
+			v |= data[i + 1] << 8;
+		if (i + 2 < data.size())
+			v |= data[i + 2];
+		s += Base64Chars[(v >> 18) & 63];
+		s += Base64Chars[(v >> 12) & 63];
+		s += i + 1 < data.size() ? Base64Chars[(v >> 6) & 63] : '=';
+		s += i + 2 < data.size() ? Base64Chars[v & 63] : '=';
+	}
+	return s;
+}
+
+static std::vector<uint8_t> base64Decode(const std::string& s)
+{
+	std::vector<uint8_t> data;
+	uint32_t v = 0;
+	int bits = 0;
+	for (char c : s)
+	{
+		if (c == '=')
+			break;
+		const char *p = strchr(Base64Chars, c);
+		if (p == nullptr || c == '\0')
+			throw std::runtime_error("Invalid base64 data");
+		v = (v << 6) | (p - Base64Chars);
+		bits += 6;
+		if (bits >= 8) {
+			bits -= 8;
+			data.push_back(v >> bits);
+		}
+	}
+	return data;
+}
+
+//
+// CSV with RFC 4180 quoting
+//
+static std::string csvField(const std::string& s)
+{
+	if (s.find_first_of(",\"\r\n") == std::string::npos)
+		return s;
+	std::string quoted = "\"";
+	for (char c : s)
+	{
+		if (c == '"')
+			quoted += '"';
+		quoted += c;
+	}
+	return quoted + '"';
+}
+
+// Returns false at the end of the file
+static bool readCsvLine(FILE *f, std::vector<std::string>& fields)
+{
+	fields.clear();
+	int c = getc(f);
+	if (c == EOF)
+		return false;
+	std::string field;
+	bool quoted = false;
+	for (; c != EOF; c = getc(f))
+	{
+		if (quoted)
+		{
+			if (c == '"')
+			{
+				c = getc(f);
+				if (c != '"') {
+					quoted = false;
+					ungetc(c, f);
+					continue;
+				}
+			}
+			field += c;
+		}
+		else if (c == '"')
+			quoted = true;
+		else if (c == ',') {
+			fields.push_back(field);
+			field.clear();
+		}
+		else if (c == '\n')
+			break;
+		else if (c != '\r')
+			field += c;
+	}
+	fields.push_back(field);
+	return true;
+}
+
+//
+// Binary format
+//
+static void write16(FILE *f, uint16_t v) {
+	fwrite(&v, sizeof(v), 1, f);
+}
+static void write32(FILE *f, int32_t v) {
+	fwrite(&v, sizeof(v), 1, f);
+}
+static void writeString(FILE *f, const std::string& s)
+{
+	write16(f, s.length());
+	fwrite(s.data(), 1, s.length(), f);
+}
+
+static void read(FILE *f, void *p, size_t size)
+{
+	if (fread(p, 1, size, f) != size)
+		throw std::runtime_error("Unexpected end of file");
+}
+static uint16_t read16(FILE *f)
+{
+	uint16_t v;
+	read(f, &v, sizeof(v));
+	return v;
+}
+static int32_t read32(FILE *f)
+{
+	int32_t v;
+	read(f, &v, sizeof(v));
+	return v;
+}
+static std::string readString(FILE *f)
+{
+	std::string s(read16(f), '\0');
+	read(f, s.data(), s.length());
+	return s;
+}
+
+//
+// Export
+//
+static void writeRecord(FILE *f, const Record& record, bool csv)
+{
+	if (csv)
+	{
+		if (record.type == Handle) {
+			fprintf(f, "handle,%d,%s,%d,%s\n", record.game, csvField(record.user).c_str(), record.index, csvField(record.handle).c_str());
+		}
+		else
+		{
+			// Trailing zeros are restored on import
+			std::vector<uint8_t> data = record.data;
+			while (!data.empty() && data.back() == 0)
+				data.pop_back();
+			fprintf(f, "extramem,%d,%s,,%s\n", record.game, csvField(record.user).c_str(), base64Encode(data).c_str());
+		}
+		return;
+	}
+	fputc(record.type, f);
+	if (record.type == End)
+		return;
+	write32(f, record.game);
+	writeString(f, record.user);
+	if (record.type == Handle) {
+		write32(f, record.index);
+		writeString(f, record.handle);
+	}
+	else
+	{
+		std::vector<uint8_t> packed = packBlock(record.data.data(), record.data.size());
+		write32(f, packed.size());
+		fwrite(packed.data(), 1, packed.size(), f);
+	}
+}
+
+static void exportRecords(Database& db, FILE *f, bool csv, int& handles, int& extraMems)
+{
+	sqlite3_stmt *stmt = db.prepare("SELECT GAME, USER_NAME, HANDLE_INDEX, HANDLE FROM USER_HANDLE ORDER BY GAME, USER_NAME, HANDLE_INDEX");
+	int rc;
+	while ((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+	{
+		Record record { Handle, sqlite3_column_int(stmt, 0), columnText(stmt, 1), sqlite3_column_int(stmt, 2), columnText(stmt, 3) };
+		writeRecord(f, record, csv);
+		handles++;
+	}
+	sqlite3_finalize(stmt);
+	db.check(rc);
+
+	stmt = db.prepare(std::string("SELECT GAME, USER_NAME, EXTRAMEM, ") + (db.hasFormatColumn() ? "FORMAT" : "0") + " FROM USER_EXTRAMEM ORDER BY GAME, USER_NAME");
+	while ((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+	{
+		Record record { ExtraMem, sqlite3_column_int(stmt, 0), columnText(stmt, 1) };
+		const uint8_t *blob = (const uint8_t *)sqlite3_column_blob(stmt, 2);
+		std::vector<uint8_t> data(blob, blob + sqlite3_column_bytes(stmt, 2));
+		// Always exported uncompressed
+		if (sqlite3_column_int(stmt, 3) != 0) {
+			if (!unpackBlock(data.data(), data.size(), record.data, ExtraUserMemSize))
+				throw std::runtime_error("Invalid extra mem data for " + record.user);
+		}
+		else {
+			record.data = std::move(data);
+		}
+		writeRecord(f, record, csv);
+		extraMems++;
+	}
+	sqlite3_finalize(stmt);
+	db.check(rc);
+}
+
+// Exports all the shard files if shards isn't 0
+static void exportData(const std::string& path, int shards, FILE *f, bool csv)
+{
+	std::vector<std::string> paths;
+	if (shards == 0)
+		paths.push_back(path);
+	else
+		for (int shard : getShards(shards))
+			paths.push_back(getShardPath(path, shard));
+	if (csv)
+		fprintf(f, "%s\n", CsvHeader);
+	else
+		fwrite(BinaryMagic, 1, sizeof(BinaryMagic), f);
+	int handles = 0;
+	int extraMems = 0;
+	for (const std::string& dbPath : paths)
+	{
+		Database db(dbPath);
+		exportRecords(db, f, csv, handles, extraMems);
+	}
+	if (!csv)
+		writeRecord(f, { End }, false);
+	fprintf(stderr, "Exported %d handles and %d extra mems\n", handles, extraMems);
+}
+
+//
+// Import
+//
+// Extra mem is kept packed to limit the memory used by large imports
+template<typename Add>
+static void readRecords(FILE *f, Add add)
+{
+	// Can't seek back in stdin: peek at the first byte only
+	int c = getc(f);
+	ungetc(c, f);
+	if (c == BinaryMagic[0])
+	{
+		char magic[sizeof(BinaryMagic)];
+		read(f, magic, sizeof(magic));
+		if (memcmp(magic, BinaryMagic, sizeof(magic)))
+			throw std::runtime_error("Unknown file format");
+		for (;;)
+		{
+			Record record {};
+			record.type = (RecordType)fgetc(f);
+			if (record.type == End)
+				break;
+			if (record.type != Handle && record.type != ExtraMem)
+				throw std::runtime_error("Invalid record type " + std::to_string(record.type));
+			record.game = read32(f);
+			record.user = readString(f);
+			if (record.type == Handle) {
+				record.index = read32(f);
+				record.handle = readString(f);
+			}
+			else
+			{
+				int size = read32(f);
+				if (size < 0 || size > ExtraUserMemSize * 2)
+					throw std::runtime_error("Invalid extra mem size");
+				record.data.resize(size);
+				read(f, record.data.data(), size);
+				std::vector<uint8_t> unpacked;
+				if (!unpackBlock(record.data.data(), record.data.size(), unpacked, ExtraUserMemSize))
+					throw std::runtime_error("Invalid extra mem data for " + record.user);
+			}
+			add(record);
+		}
+		return;
+	}
+	std::vector<std::string> fields;
+	if (!readCsvLine(f, fields) || fields.size() != 5 || fields[0] != "type")
+		throw std::runtime_error("Unknown file format");
+	for (int line = 2; readCsvLine(f, fields); line++)
+	{
+		if (fields.size() == 1 && fields[0].empty())
+			continue;
+		if (fields.size() != 5 || (fields[0] != "handle" && fields[0] != "extramem"))
+			throw std::runtime_error("Invalid record at line " + std::to_string(line));
+		Record record {};
+		record.game = std::stoi(fields[1]);
+		record.user = fields[2];
+		if (fields[0] == "handle") {
+			record.type = Handle;
+			record.index = std::stoi(fields[3]);
+			record.handle = fields[4];
+		}
+		else
+		{
+			record.type = ExtraMem;
+			std::vector<uint8_t> data = base64Decode(fields[4]);
+			if (data.size() > ExtraUserMemSize)
+				throw std::runtime_error("Extra mem too big at line " + std::to_string(line));
+			record.data = packBlock(data.data(), data.size());
+		}
+		add(record);
+	}
+}
+
+using GameKey = std::pair<int, std::string>;
+
+struct Slot
+{
+	std::string user;
+	int index;
+
+	bool operator==(const Slot& other) const {
+		return user == other.user && index == other.index;
+	}
+};
+
+// Returns the number of conflicting handles. They are removed from the records if skip is true.
+static int checkConflicts(Database& db, std::vector<Record>& records, bool skip)
+{
+	std::map<GameKey, Slot> owners;						// (game, handle) -> slot
+	std::map<std::pair<GameKey, int>, std::string> slots;	// ((game, user), index) -> handle
+	sqlite3_stmt *stmt = db.prepare("SELECT GAME, USER_NAME, HANDLE_INDEX, HANDLE FROM USER_HANDLE");
+	int rc;
+	while ((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+	{
+		int game = sqlite3_column_int(stmt, 0);
+		Slot slot { columnText(stmt, 1), sqlite3_column_int(stmt, 2) };
+		std::string handle = columnText(stmt, 3);
+		owners[{ game, handle }] = slot;
+		slots[{ { game, slot.user }, slot.index }] = handle;
+	}
+	sqlite3_finalize(stmt);
+	db.check(rc);
+
+	int conflicts = 0;
+	std::vector<Record> valid;
+	for (Record& record : records)
+	{
+		if (record.type == Handle)
+		{
+			Slot slot { record.user, record.index };
+			auto oit = owners.find({ record.game, record.handle });
+			auto sit = slots.find({ { record.game, record.user }, record.index });
+			if (oit != owners.end() && oit->second == slot)
+				// Already there
+				continue;
+			if (oit != owners.end()) {
+				fprintf(stderr, "Conflict: game %d handle %s of %s[%d] already used by %s[%d]\n", record.game, record.handle.c_str(),
+						record.user.c_str(), record.index, oit->second.user.c_str(), oit->second.index);
+				conflicts++;
+				continue;
+			}
+			if (sit != slots.end()) {
+				fprintf(stderr, "Conflict: game %d handle %s of %s[%d]: slot already used by handle %s\n", record.game, record.handle.c_str(),
+						record.user.c_str(), record.index, sit->second.c_str());
+				conflicts++;
+				continue;
+			}
+			owners[{ record.game, record.handle }] = slot;
+			slots[{ { record.game, record.user }, record.index }] = record.handle;
+		}
+		valid.push_back(std::move(record));
+	}
+	if (skip || conflicts == 0)
+		records = std::move(valid);
+	return conflicts;
+}
+
+static void importRecords(Database& db, const std::string& path, const std::vector<Record>& records)
+{
+	bool packed = db.hasFormatColumn();
+	db.exec("PRAGMA synchronous = OFF");
+	db.exec("PRAGMA cache_size = -65536");
+	db.exec("BEGIN TRANSACTION");
+	try {
+		// Handle indexes are rebuilt once at the end
+		std::vector<std::string> indexes;
+		sqlite3_stmt *stmt = db.prepare("SELECT name, sql FROM sqlite_master WHERE type = 'index' AND tbl_name = 'USER_HANDLE' AND sql IS NOT NULL");
+		int rc;
+		std::vector<std::string> names;
+		while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+			names.push_back(columnText(stmt, 0));
+			indexes.push_back(columnText(stmt, 1));
+		}
+		sqlite3_finalize(stmt);
+		db.check(rc);
+		for (const std::string& name : names)
+			db.exec("DROP INDEX \"" + name + "\"");
+
+		sqlite3_stmt *insertHandle = db.prepare("INSERT INTO USER_HANDLE (GAME, USER_NAME, HANDLE_INDEX, HANDLE) VALUES (?, ?, ?, ?)");
+		sqlite3_stmt *insertExtraMem = db.prepare(packed ?
+				"INSERT INTO USER_EXTRAMEM (GAME, USER_NAME, EXTRAMEM, FORMAT) VALUES (?, ?, ?, 1) "
+				"ON CONFLICT (USER_NAME, GAME) DO UPDATE SET EXTRAMEM = excluded.EXTRAMEM, FORMAT = excluded.FORMAT"
+				: "INSERT INTO USER_EXTRAMEM (GAME, USER_NAME, EXTRAMEM) VALUES (?, ?, ?) "
+				"ON CONFLICT (USER_NAME, GAME) DO UPDATE SET EXTRAMEM = excluded.EXTRAMEM");
+		int handles = 0;
+		int extraMems = 0;
+		for (const Record& record : records)
+		{
+			sqlite3_stmt *stmt = record.type == Handle ? insertHandle : insertExtraMem;
+			sqlite3_bind_int(stmt, 1, record.game);
+			sqlite3_bind_text(stmt, 2, record.user.c_str(), record.user.length(), SQLITE_STATIC);
+			std::vector<uint8_t> data;
+			if (record.type == Handle)
+			{
+				sqlite3_bind_int(stmt, 3, record.index);
+				sqlite3_bind_text(stmt, 4, record.handle.c_str(), record.handle.length(), SQLITE_STATIC);
+				handles++;
+			}
+			else
+			{
+				// Preallocated like the server does
+				unpackBlock(record.data.data(), record.data.size(), data, ExtraUserMemSize);
+				data.resize(ExtraUserMemSize);
+				if (packed)
+					data = packBlock(data.data(), data.size());
+				sqlite3_bind_blob(stmt, 3, data.data(), data.size(), SQLITE_STATIC);
+				extraMems++;
+			}
+			rc = sqlite3_step(stmt);
+			sqlite3_reset(stmt);
+			db.check(rc);
+		}
+		sqlite3_finalize(insertHandle);
+		sqlite3_finalize(insertExtraMem);
+
+		for (const std::string& sql : indexes)
+			db.exec(sql);
+		db.exec("COMMIT");
+		fprintf(stderr, "%s: imported %d handles and %d extra mems\n", path.c_str(), handles, extraMems);
+	} catch (...) {
+		sqlite3_exec(db.db, "ROLLBACK", nullptr, nullptr, nullptr);
+		throw;
+	}
+}
+
+// Routes the records to their shard file if shards isn't 0, like split-db
+static void importData(const std::string& path, int shards, FILE *f, bool skipConflicts)
+{
+	std::map<int, std::vector<Record>> shardRecords;
+	if (shards == 0)
+		shardRecords[0];
+	readRecords(f, [&](Record& record) {
+		if (shards < 0 && (record.game < (int)GameId::Daytona || record.game > (int)GameId::RuneJade)) {
+			fprintf(stderr, "Warning: game %d has no shard, %s ignored\n", record.game, record.user.c_str());
+			return;
+		}
+		shardRecords[shards == 0 ? 0 : getShard((GameId)record.game, shards)].push_back(std::move(record));
+	});
+	std::map<int, std::unique_ptr<Database>> dbs;
+	int conflicts = 0;
+	for (auto& [shard, records] : shardRecords)
+	{
+		std::unique_ptr<Database>& db = dbs[shard];
+		db = std::make_unique<Database>(shards == 0 ? path : getShardPath(path, shard));
+		conflicts += checkConflicts(*db, records, skipConflicts);
+	}
+	if (conflicts != 0 && !skipConflicts)
+		throw std::runtime_error(std::to_string(conflicts) + " conflicts found. Nothing imported");
+
+	for (auto& [shard, records] : shardRecords)
+		importRecords(*dbs[shard], shards == 0 ? path : getShardPath(path, shard), records);
+}
+
+static void usage(const char *progName)
+{
+	fprintf(stderr, "Usage: %s export [--csv] [--shards <game | number>] <database path> <file>\n", progName);
+	fprintf(stderr, "       %s import [--skip-conflicts] [--shards <game | number>] <database path> <file>\n", progName);
+	fprintf(stderr, "Use - as file for stdin or stdout. The server must be stopped during an import.\n");
+	fprintf(stderr, "--shards uses the shard files of the database path, as set by DatabaseShards.\n");
+}
+
+int main(int argc, char *argv[])
+{
+	std::vector<std::string> args(argv + 1, argv + argc);
+	bool csv = false;
+	bool skipConflicts = false;
+	int shards = 0;
+	for (auto it = args.begin(); it != args.end(); )
+	{
+		if (*it == "--csv")
+			csv = true;
+		else if (*it == "--skip-conflicts")
+			skipConflicts = true;
+		else if (*it == "--shards" && it + 1 != args.end())
+		{
+			try {
+				shards = parseShards(*(it + 1));
+			} catch (const std::exception&) {
+				shards = 0;
+			}
+			if (shards == 0 || shards == 1) {
+				fprintf(stderr, "Invalid shard count: %s\n", (it + 1)->c_str());
+				return 1;
+			}
+			it = args.erase(it);
+		}
+		else {
+			++it;
+			continue;
+		}
+		it = args.erase(it);
+	}
+	if (args.size() != 3 || (args[0] != "export" && args[0] != "import")) {
+		usage(argv[0]);
+		return 1;
+	}
+	bool exporting = args[0] == "export";
+	FILE *f;
+	if (args[2] == "-")
+		f = exporting ? stdout : stdin;
+	else
+		f = fopen(args[2].c_str(), exporting ? "wb" : "rb");
+	if (f == nullptr) {
+		perror(args[2].c_str());
+		return 1;
+	}
+	try {
+		if (exporting)
+			exportData(args[1], shards, f, csv);
+		else
+			importData(args[1], shards, f, skipConflicts);
+	} catch (const std::exception& e) {
+		fprintf(stderr, "Error: %s\n", e.what());
+		return 1;
+	}
+	if (f != stdout && f != stdin)
+		fclose(f);
+	return 0;
+}